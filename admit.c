@@ -0,0 +1,330 @@
+/*
+ * Copyright 2025 Jillian Alana Bolton
+ *
+ * The BSD 2-Clause License
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *
+ *     2. Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* admit.c - deciding whether to take a new connection at all
+ *
+ * acceptcon_ssl() asks before it allocates anything for a connection, so a
+ * bot or a reconnect loop costs an accept(2) and a close(2) instead of a
+ * player record, a welcome and a TLS handshake.  A connection has to get a
+ * token from the bucket for its address, the one for its /24, and the
+ * server's.  Buckets that are out of tokens refuse without taking any.
+ *
+ * Addresses and subnets are kept in small open-addressed tables.  When a
+ * table is crowded, the bucket that has been idle longest is reused: it
+ * would have refilled by now anyway.
+ *
+ * Loopback isn't limited, so that a local proxy (e.g., stunnel) or test
+ * doesn't count as one very busy client.
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "admit.h"
+#include "log.h"
+#include "lorien.h"
+#include "newplayer.h"
+#include "platform.h"
+#include "utility.h"
+
+#define ADMIT_PROBES 8	/* slots looked at for an address */
+#define ADMIT_SHOWN  10 /* refusing buckets listed by /admit */
+
+struct admit_bucket {
+	in_addr_t key; /* host order, the /24 for subnets */
+	bool used;
+	bool refusing; /* logged, until it admits again */
+	double tokens;
+	uint64_t stamp; /* milliseconds, when tokens was brought up to date */
+	unsigned long refused;
+};
+
+struct admit_limit {
+	const char *name;
+	unsigned int rate;
+	unsigned int burst;
+	unsigned long admitted;
+	unsigned long refused;
+	struct admit_bucket *buckets;
+	int nbuckets;
+};
+
+static struct admit_bucket addresses[ADMIT_BUCKETS];
+static struct admit_bucket subnets[ADMIT_BUCKETS];
+static struct admit_bucket server;
+
+static struct admit_limit limits[ADMIT_KINDS] = {
+	[ADMIT_ADDRESS] = { "address", ADMIT_ADDRESS_RATE, ADMIT_ADDRESS_BURST,
+	    0, 0, addresses, ADMIT_BUCKETS },
+	[ADMIT_SUBNET] = { "subnet/24", ADMIT_SUBNET_RATE, ADMIT_SUBNET_BURST,
+	    0, 0, subnets, ADMIT_BUCKETS },
+	[ADMIT_SERVER] = { "server", ADMIT_SERVER_RATE, ADMIT_SERVER_BURST, 0,
+	    0, &server, 1 },
+};
+
+static uint64_t
+admit_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void
+admit_refill(struct admit_limit *l, struct admit_bucket *b, uint64_t now)
+{
+	b->tokens += (double)(now - b->stamp) * l->rate / 1000.0;
+	if (b->tokens > l->burst)
+		b->tokens = l->burst;
+	b->stamp = now;
+}
+
+/* the bucket for key, or a fresh one in its place */
+static struct admit_bucket *
+admit_bucket(struct admit_limit *l, in_addr_t key, uint64_t now)
+{
+	struct admit_bucket *b, *victim = NULL;
+	unsigned int h;
+	int i;
+
+	if (l->nbuckets == 1) {
+		b = l->buckets;
+		if (!b->used) {
+			b->used = true;
+			b->tokens = l->burst;
+			b->stamp = now;
+		}
+		return b;
+	}
+
+	h = (key * 2654435761U) % l->nbuckets;
+	for (i = 0; i < ADMIT_PROBES; i++) {
+		b = &l->buckets[(h + i) % l->nbuckets];
+		if (b->used && (b->key == key))
+			return b;
+
+		/* an empty slot, or else the one idle longest */
+		if (!victim ||
+		    (victim->used && (!b->used || (b->stamp < victim->stamp))))
+			victim = b;
+	}
+
+	memset(victim, 0, sizeof(*victim));
+	victim->key = key;
+	victim->used = true;
+	victim->tokens = l->burst;
+	victim->stamp = now;
+	return victim;
+}
+
+static void
+admit_format(enum admit_kind kind, in_addr_t key, char *buf, size_t len)
+{
+	struct in_addr a = { htonl(key) };
+
+	snprintf(buf, len, "%s%s", inet_ntoa(a),
+	    (kind == ADMIT_SUBNET) ? "/24" : "");
+}
+
+/* Takes a token for a new connection from addr, or returns false if it
+ * should be refused.
+ */
+bool
+admit_check(struct in_addr addr)
+{
+	struct admit_bucket *b[ADMIT_KINDS] = { NULL };
+	in_addr_t key = ntohl(addr.s_addr);
+	uint64_t now;
+	char host[INET_ADDRSTRLEN + 3];
+	int i;
+
+	if ((key >> 24) == 127)
+		return true;
+
+	now = admit_now();
+	for (i = 0; i < ADMIT_KINDS; i++) {
+		if (!limits[i].rate)
+			continue;
+
+		b[i] = admit_bucket(&limits[i], (i == ADMIT_SUBNET) ?
+			(key & 0xffffff00) :
+			key,
+		    now);
+		admit_refill(&limits[i], b[i], now);
+		if (b[i]->tokens >= 1.0)
+			continue;
+
+		b[i]->refused++;
+		limits[i].refused++;
+		if (!b[i]->refusing) {
+			b[i]->refusing = true;
+			if (i == ADMIT_SERVER)
+				strlcpy(host, "everyone", sizeof(host));
+			else
+				admit_format(i, b[i]->key, host, sizeof(host));
+			snprintf(sendbuf, sendbufsz,
+			    "refusing new connections from %s, over the %s "
+			    "limit",
+			    host, limits[i].name);
+			logmsg(sendbuf);
+		}
+
+		/* the buckets already looked at keep their tokens */
+		return false;
+	}
+
+	for (i = 0; i < ADMIT_KINDS; i++) {
+		if (!b[i])
+			continue;
+		b[i]->tokens -= 1.0;
+		b[i]->refusing = false;
+		limits[i].admitted++;
+	}
+	return true;
+}
+
+/* Changes a limit at runtime.  A rate of 0 turns it off. */
+int
+admit_set(enum admit_kind kind, unsigned int rate, unsigned int burst)
+{
+	struct admit_limit *l;
+
+	if ((kind < 0) || (kind >= ADMIT_KINDS) || (rate && !burst)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	l = &limits[kind];
+	l->rate = rate;
+	l->burst = burst;
+
+	/* everyone starts over under the new limit */
+	memset(l->buckets, 0, l->nbuckets * sizeof(*l->buckets));
+
+	errno = 0;
+	return 0;
+}
+
+static void
+admit_show(struct splayer *pplayer)
+{
+	struct admit_limit *l;
+	struct admit_bucket *b;
+	char host[INET_ADDRSTRLEN + 3];
+	int kind, i, shown = 0;
+
+	sendtoplayer(pplayer,
+	    ">> limit      rate/s   burst   admitted    refused\r\n"
+	    ">> ---------- ------ ------- ---------- ----------\r\n");
+
+	for (kind = 0; kind < ADMIT_KINDS; kind++) {
+		l = &limits[kind];
+		if (l->rate)
+			snprintf(sendbuf, sendbufsz,
+			    ">> %-10s %6u %7u %10lu %10lu\r\n", l->name,
+			    l->rate, l->burst, l->admitted, l->refused);
+		else
+			snprintf(sendbuf, sendbufsz,
+			    ">> %-10s    off         %10lu %10lu\r\n", l->name,
+			    l->admitted, l->refused);
+		sendtoplayer(pplayer, sendbuf);
+	}
+
+	for (kind = 0; kind < ADMIT_SERVER; kind++) {
+		l = &limits[kind];
+		for (i = 0; (i < l->nbuckets) && (shown < ADMIT_SHOWN); i++) {
+			b = &l->buckets[i];
+			if (!b->used || !b->refusing)
+				continue;
+
+			if (!shown++)
+				sendtoplayer(pplayer,
+				    ">> Refusing connections from:\r\n");
+			admit_format(kind, b->key, host, sizeof(host));
+			snprintf(sendbuf, sendbufsz,
+			    ">>   %-18s %lu refused\r\n", host, b->refused);
+			sendtoplayer(pplayer, sendbuf);
+		}
+	}
+
+	sendtoplayer(pplayer, ">> Loopback connections are not limited.\r\n");
+}
+
+/* /admit shows the limits and what they've done, and
+ * /admit <address|subnet|server> <rate> <burst> changes one.
+ */
+parse_error
+admit_command(struct splayer *pplayer, char *buf)
+{
+	char name[16];
+	unsigned int rate, burst = 0;
+	int kind, n;
+	size_t len;
+
+	buf = skipspace(buf);
+	if (!*buf) {
+		admit_show(pplayer);
+		return PARSE_OK;
+	}
+
+	n = sscanf(buf, "%15s %u %u", name, &rate, &burst);
+	if (n < 2)
+		return PARSERR_NUMARGS;
+
+	len = strlen(name);
+	for (kind = 0; kind < ADMIT_KINDS; kind++)
+		if (!strncasecmp(name, limits[kind].name, len))
+			break;
+
+	if ((kind == ADMIT_KINDS) || (admit_set(kind, rate, burst) == -1)) {
+		sendtoplayer(pplayer, IVCMD_SYN);
+		return PARSERR_SUPPRESS;
+	}
+
+	if (rate)
+		snprintf(sendbuf, sendbufsz,
+		    ">> %s limit set to %u per second, bursts of %u.\r\n",
+		    limits[kind].name, rate, burst);
+	else
+		snprintf(sendbuf, sendbufsz, ">> %s limit turned off.\r\n",
+		    limits[kind].name);
+	sendtoplayer(pplayer, sendbuf);
+
+	snprintf(sendbuf, sendbufsz, "%s changed the %s limit to %u/%u",
+	    pplayer->name, limits[kind].name, rate, burst);
+	logmsg(sendbuf);
+	return PARSE_OK;
+}
@@ -0,0 +1,67 @@
+/*
+ * Copyright 2025 Jillian Alana Bolton
+ *
+ * The BSD 2-Clause License
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *
+ *     2. Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* admit.h - deciding whether to take a new connection at all
+ */
+
+#ifndef _ADMIT_H_
+#define _ADMIT_H_
+
+#include <netinet/in.h>
+
+#include <stdbool.h>
+
+#include "parse.h"
+
+/* Each kind of limit is a token bucket: a connection takes a token, and
+ * tokens come back at rate per second, up to burst.  A rate of 0 turns the
+ * limit off.
+ */
+enum admit_kind {
+	ADMIT_ADDRESS, /* per client address */
+	ADMIT_SUBNET,  /* per /24 */
+	ADMIT_SERVER,  /* every new connection */
+	ADMIT_KINDS
+};
+
+#define ADMIT_ADDRESS_RATE  5
+#define ADMIT_ADDRESS_BURST 30
+#define ADMIT_SUBNET_RATE   20
+#define ADMIT_SUBNET_BURST  120
+#define ADMIT_SERVER_RATE   500
+#define ADMIT_SERVER_BURST  SOMAXCONN
+
+#define ADMIT_BUCKETS 4096 /* addresses and subnets remembered, each */
+
+bool admit_check(struct in_addr addr);
+parse_error admit_command(struct splayer *pplayer, char *buf);
+int admit_set(enum admit_kind kind, unsigned int rate, unsigned int burst);
+
+#endif
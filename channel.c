@@ -39,6 +39,7 @@
 
 #include <err.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -50,6 +51,25 @@
 
 SLIST_HEAD(chanlist, channel) channelhead = SLIST_HEAD_INITIALIZER(channelhead);
 
+/* channels by name, see channel_find() */
+#define CHANNEL_HASHSIZE 256 /* power of 2 */
+
+static SLIST_HEAD(chanbucket, channel) chanhash[CHANNEL_HASHSIZE];
+
+/* FNV-1a over as much of the name as channel_find() compares */
+static struct chanbucket *
+channel_bucket(const char *name)
+{
+	uint32_t hash = 2166136261U;
+	size_t i;
+
+	for (i = 0; (i < MAX_CHAN) && name[i]; i++) {
+		hash ^= (unsigned char)name[i];
+		hash *= 16777619U;
+	}
+	return &chanhash[hash & (CHANNEL_HASHSIZE - 1)];
+}
+
 bool
 channel_persists(const struct channel *chan)
 {
@@ -68,6 +88,12 @@ channel_secure(struct channel *chan, bool secure)
 	chan->secure = secure;
 }
 
+void
+channel_persist(struct channel *chan, bool persists)
+{
+	chan->persistent = persists;
+}
+
 void
 channel_init(void)
 {
@@ -81,6 +107,8 @@ channel_init(void)
 		}
 		SLIST_INSERT_HEAD(&channelhead, newc, entries);
 		strlcpy(newc->name, DEFCHAN, sizeof(newc->name));
+		SLIST_INSERT_HEAD(channel_bucket(newc->name), newc,
+		    hashentries);
 		newc->persistent = true;
 	}
 }
@@ -90,7 +118,7 @@ channel_find(const char *name)
 {
 	struct channel *curr;
 
-	SLIST_FOREACH(curr, &channelhead, entries)
+	SLIST_FOREACH(curr, channel_bucket(name), hashentries)
 		if (!strncmp(curr->name, name, MAX_CHAN))
 			return curr;
 
@@ -105,6 +133,8 @@ channel_add(const char *name)
 	if (newchan) {
 		strlcpy(newchan->name, name, MAX_CHAN);
 		SLIST_INSERT_AFTER(SLIST_FIRST(&channelhead), newchan, entries);
+		SLIST_INSERT_HEAD(channel_bucket(newchan->name), newchan,
+		    hashentries);
 	}
 	return newchan;
 }
@@ -112,7 +142,10 @@ channel_add(const char *name)
 void
 channel_rename(struct channel *channel, const char *name)
 {
+	SLIST_REMOVE(channel_bucket(channel->name), channel, channel,
+	    hashentries);
 	strlcpy(channel->name, name, sizeof(channel->name));
+	SLIST_INSERT_HEAD(channel_bucket(channel->name), channel, hashentries);
 }
 
 char *
@@ -135,6 +168,8 @@ channel_del(struct channel *channel)
 		return;
 
 	SLIST_REMOVE(&channelhead, channel, channel, entries);
+	SLIST_REMOVE(channel_bucket(channel->name), channel, channel,
+	    hashentries);
 
 	free(channel);
 }
@@ -145,15 +180,33 @@ channel_count(const struct channel *channel)
 	return channel->refcnt;
 };
 
+/* Calls func for each channel, the main channel first, until it returns
+ * non-zero, and returns what it returned.
+ */
+int
+channel_walk(int (*func)(struct channel *channel, void *arg), void *arg)
+{
+	struct channel *curr;
+	int rc;
+
+	SLIST_FOREACH(curr, &channelhead, entries)
+		if ((rc = func(curr, arg)))
+			return rc;
+	return 0;
+}
+
+/* channel speech goes to the members, see sendall() */
 int
-channel_ref(struct channel *channel)
+channel_join(struct channel *channel, struct splayer *pplayer)
 {
+	LIST_INSERT_HEAD(&channel->members, pplayer, chanentries);
 	return ++channel->refcnt;
 }
 
 int
-channel_deref(struct channel *channel)
+channel_leave(struct channel *channel, struct splayer *pplayer)
 {
+	LIST_REMOVE(pplayer, chanentries);
 	return --channel->refcnt;
 }
 
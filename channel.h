@@ -52,24 +52,27 @@ struct channel {
 	/* stuff that doesn't need to go in the db goes below here */
 
 	bool secure;
-	int refcnt;
+	int refcnt; /* the number of members */
 	bool persistent;
 	SLIST_ENTRY(channel) entries;
+	SLIST_ENTRY(channel) hashentries; /* see channel_find() */
+	LIST_HEAD(chanmembers, splayer) members;
 };
 
 struct channel *channel_add(const char *name);
 int channel_count(const struct channel *channel);
 void channel_del(struct channel *channel);
-int channel_deref(struct channel *channel);
 struct channel *channel_find(const char *name);
 struct channel *channel_getmain(void);
 char *channel_getname(const struct channel *channel, char *buf, int buflen);
 void channel_init(void);
+int channel_join(struct channel *channel, struct splayer *pplayer);
+int channel_leave(struct channel *channel, struct splayer *pplayer);
 parse_error channel_list(struct splayer *splayer);
 void channel_persist(struct channel *channel, bool persists);
 bool channel_persists(const struct channel *channel);
-int channel_ref(struct channel *channel);
 void channel_rename(struct channel *channel, const char *name);
 void channel_secure(struct channel *channel, bool secure);
 bool channel_secured(const struct channel *channel);
+int channel_walk(int (*func)(struct channel *channel, void *arg), void *arg);
 #endif
@@ -43,26 +43,66 @@
  */
 
 #include <err.h>
+#include <signal.h>
 #include <sysexits.h>
 
 #include "ban.h"
 #include "board.h"
 #include "channel.h"
 #include "db.h"
+#include "event.h"
 #include "files.h"
 #include "log.h"
 #include "lorien.h"
 #include "newplayer.h"
 #include "platform.h"
+#include "resolver.h"
+#include "shard.h"
 #include "servsock_ssl.h"
+#include "timer.h"
+#include "upgrade.h"
 #include "utility.h"
 
+static volatile sig_atomic_t stopsig;
+
+/* The loop notices within a second, even when another thread took the
+ * signal, and exits so that the log is written out, see log_buffer().
+ */
+static void
+stophandler(int sig)
+{
+	stopsig = sig;
+}
+
+static void
+listener_ready(int fd, int events, void *arg)
+{
+	int i, e;
+
+	/* take everyone who is waiting, up to a point */
+	for (i = 0; i < SERVSOCK_ACCEPT_BATCH; i++) {
+		if (newplayer(arg) != -1)
+			continue;
+
+		e = errno;
+		if ((e == EAGAIN) || (e == EWOULDBLOCK))
+			break;
+		if (e == ECONNREFUSED)
+			continue; /* see admit_check() */
+		logerror("cannot add player", e);
+
+		/* the rest wait until there are fds or memory again */
+		if ((e == EMFILE) || (e == ENFILE) || (e == ENOBUFS) ||
+		    (e == ENOMEM))
+			break;
+	}
+}
+
 int
-doit(struct servsock_handle *handle, struct servsock_handle *sslhandle)
+doit(struct servsock_handle *handle, struct servsock_handle *sslhandle,
+    int nshards)
 {
-	fd_set needread; /* for seeing which fds we need to read from */
-	int num;	 /* the number of needy fds */
-	int max;	 /* The highest fd we are using. */
+	struct sigaction stopaction = { 0 };
 
 	strncpy(lorien_db.dbname, "./lorien.db", sizeof(lorien_db.dbname) - 1);
 	lorien_db.dbname[sizeof(lorien_db.dbname) - 1] = (char)0;
@@ -96,43 +136,60 @@ doit(struct servsock_handle *handle, struct servsock_handle *sslhandle)
 	}
 #endif
 
-	MAXCONN = gettablesize();
-
-	if (MAXCONN > FD_SETSIZE)
-		MAXCONN = FD_SETSIZE;
-
-	while (1) {
-		FD_ZERO(&needread);
-		if (handle)
-			FD_SET(handle->sock, &needread);
-		if (sslhandle)
-			FD_SET(sslhandle->sock, &needread);
-		max = setfds(&needread, true);
-		if (handle && (handle->sock > max))
-			max = handle->sock;
-		if (sslhandle && (sslhandle->sock > max))
-			max = sslhandle->sock;
-
-		if ((num = select(max + 1, &needread, (fd_set *)0, (fd_set *)0,
-			 (struct timeval *)0)) == -1) {
-			if (errno != EINTR) {
-				logerror("lorien select failed", errno);
-				continue;
-			} else
-				continue; /* do it again and get it right */
-		}
+	if (event_init() == -1)
+		err(EX_OSERR, "can't initialize %s", event_backend());
+
+#ifndef SKIP_HOSTLOOKUP
+	if (resolver_init() == -1)
+		err(EX_OSERR, "can't start the host name resolver");
+#endif
+
+	/* the main thread keeps the players, the shards serve their sockets */
+	if (shard_init(nshards) == -1)
+		err(EX_OSERR, "can't start %d threads", nshards);
+
+	/* raise the soft fd limit as far as the event backend can use it */
+	MAXCONN = setdtablesize(event_maxfds());
+
+	if (MAXCONN > event_maxfds())
+		MAXCONN = event_maxfds();
+
+	fprintf(stderr, "using %s for up to %lu lines\n", event_backend(),
+	    MAXCONN);
+
+	if (handle &&
+	    (event_add(handle->sock, EVENT_READ, listener_ready, handle) == -1))
+		err(EX_OSERR, "can't watch listening socket");
+
+	if (sslhandle &&
+	    (event_add(sslhandle->sock, EVENT_READ, listener_ready, sslhandle) ==
+		-1))
+		err(EX_OSERR, "can't watch listening ssl socket");
+
+	/* the players from before an upgrade, if there was one */
+	upgrade_resume();
+
+	stopaction.sa_handler = stophandler;
+	if ((sigaction(SIGTERM, &stopaction, NULL) == -1) ||
+	    (sigaction(SIGINT, &stopaction, NULL) == -1))
+		logerror("sigaction (SIGTERM) failed", errno);
+
+	while (!stopsig) {
+		if ((event_wait(timer_timeout()) == -1) && (errno != EINTR))
+			logerror("lorien event_wait failed", errno);
 
-		if (handle && FD_ISSET(handle->sock, &needread))
-			if (newplayer(handle) == -1)
-				logerror("cannot add player", errno);
+		/* timeouts, and the time of day for the next pass */
+		timer_run();
 
-		if (sslhandle && FD_ISSET(sslhandle->sock, &needread))
-			if (newplayer(sslhandle) == -1)
-				logerror("cannot add player", errno);
+		/* players who left while their events were handled */
+		player_reap();
 
-		handleinput(needread);
+		/* see upgrade_command() */
+		upgrade_poll();
 	}
 
-	/*NOTREACHED*/
-	return 0;
+	snprintf(sendbuf, sendbufsz, "stopping on signal %d", (int)stopsig);
+	logmsg(sendbuf);
+	ldb_close(&lorien_db);
+	exit(0);
 }
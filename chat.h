@@ -33,4 +33,5 @@
 
 struct servsock_handle;
 
-int doit(struct servsock_handle *handle, struct servsock_handle *sslhandle);
+int doit(struct servsock_handle *handle, struct servsock_handle *sslhandle,
+    int nshards);
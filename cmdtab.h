@@ -0,0 +1,107 @@
+/*
+ * Copyright 2008-2025, Bolton-Dormer Research Partnership
+ *
+ * The BSD 2-Clause License
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *
+ *     2. Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* cmdtab.h - the default command table
+ *
+ * Each PARSE_KEY(token, cmd) is a way to type a command.  commands.c makes
+ * default_parse_table from them, and mkcmdtab makes cmdtab.c, which finds
+ * them without a trie.  Keep them sorted; where an abbreviation fits more
+ * than one, the first in byte order wins.
+ */
+
+PARSE_KEY("`", CMD_STAGEPOSE)
+PARSE_KEY(":", CMD_POSE)
+PARSE_KEY(";", CMD_POSE)
+PARSE_KEY("/+", CMD_PROMOTE)
+PARSE_KEY("/-", CMD_DEMOTE)
+PARSE_KEY("/?", CMD_HELP)
+PARSE_KEY("/Broadcast", CMD_BROADCAST)
+PARSE_KEY("/Changeprivs", CMD_GRANT)
+PARSE_KEY("/DeletePlayer", CMD_DELPLAYER)
+PARSE_KEY("/EnablePlayer", CMD_ADDPLAYER)
+PARSE_KEY("/Gag", CMD_GAG)
+PARSE_KEY("/Hilite", CMD_HILITE)
+PARSE_KEY("/Infotoggle", CMD_SHOWINFO)
+PARSE_KEY("/K", CMD_KILLALL)
+PARSE_KEY("/M", CMD_SETMAIN)
+PARSE_KEY("/Main", CMD_SETMAIN)
+PARSE_KEY("/ModifyMAXCONN", CMD_SETMAX)
+PARSE_KEY("/ModPlayer", CMD_MODPLAYER)
+PARSE_KEY("/P", CMD_PASSWORD)
+PARSE_KEY("/Parser", CMD_PARSER)
+PARSE_KEY("/Password", CMD_PASSWORD)
+PARSE_KEY("/Purgelog", CMD_PURGELOG)
+PARSE_KEY("/Restoreparser", CMD_RESTOREPARSER)
+PARSE_KEY("/Upgrade", CMD_UPGRADE)
+PARSE_KEY("/Who", CMD_WHO2)
+PARSE_KEY("/Yellmode", CMD_SCREAM)
+PARSE_KEY("/a", CMD_YELL) /* announce */
+PARSE_KEY("/addchannel", CMD_ADDCHANNEL)
+PARSE_KEY("/addplayer", CMD_ADDPLAYER)
+PARSE_KEY("/admit", CMD_ADMIT)
+PARSE_KEY("/announce", CMD_YELL)
+PARSE_KEY("/b", CMD_BEEPS)
+PARSE_KEY("/ban", CMD_BANLIST)
+PARSE_KEY("/banadd", CMD_BANADD)
+PARSE_KEY("/bandel", CMD_BANDEL)
+PARSE_KEY("/banlist", CMD_BANLIST)
+PARSE_KEY("/bbadd", CMD_BOARDADD)
+PARSE_KEY("/bbdel", CMD_BOARDDEL)
+PARSE_KEY("/bblist", CMD_BOARDLIST)
+PARSE_KEY("/beeps", CMD_BEEPS)
+PARSE_KEY("/channel", CMD_TUNE)
+PARSE_KEY("/doing", CMD_DOING)
+PARSE_KEY("/echo", CMD_ECHO)
+PARSE_KEY("/finger", CMD_FINGER)
+PARSE_KEY("/force", CMD_FORCE)
+PARSE_KEY("/gag", CMD_GAG)
+PARSE_KEY("/h", CMD_HUSH)
+PARSE_KEY("/help", CMD_HELP)
+PARSE_KEY("/hilite", CMD_HILITE)
+PARSE_KEY("/hush", CMD_HUSH)
+PARSE_KEY("/invisible", CMD_BROADCAST2)
+PARSE_KEY("/kill", CMD_KILL)
+PARSE_KEY("/level", CMD_SHOWLEVEL)
+PARSE_KEY("/messages", CMD_MESSAGES)
+PARSE_KEY("/name", CMD_NAME)
+PARSE_KEY("/onfrom", CMD_DOING)
+PARSE_KEY("/p", CMD_WHISPER)
+PARSE_KEY("/post", CMD_POST)
+PARSE_KEY("/private", CMD_WHISPER)
+PARSE_KEY("/quit", CMD_QUIT)
+PARSE_KEY("/r", CMD_WRAP)
+PARSE_KEY("/read", CMD_READ)
+PARSE_KEY("/secure", CMD_SECURE)
+PARSE_KEY("/shutdown", CMD_SHUTDOWN)
+PARSE_KEY("/tune", CMD_TUNE)
+PARSE_KEY("/uptime", CMD_UPTIME)
+PARSE_KEY("/who", CMD_WHO)
+PARSE_KEY("/wrap", CMD_WRAP)
+PARSE_KEY("/yell", CMD_YELL)
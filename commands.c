@@ -42,6 +42,7 @@ Dave Mott          (Energizer Rabbit)
 
 */
 
+#include "admit.h"
 #include "ban.h"
 #include "board.h"
 #include "channel.h"
@@ -55,77 +56,14 @@ Dave Mott          (Energizer Rabbit)
 #include "parse.h"
 #include "platform.h"
 #include "security.h"
+#include "upgrade.h"
 #include "utility.h"
 
-/* sorted list, binary search, ambiguous runs first match. */
+/* sorted list, see cmdtab.h */
 struct parse_key default_parse_table[] = {
-	{ "`", CMD_STAGEPOSE },
-	{ ":", CMD_POSE },
-	{ ";", CMD_POSE },
-	{ "/+", CMD_PROMOTE },
-	{ "/-", CMD_DEMOTE },
-	{ "/?", CMD_HELP },
-	{ "/Broadcast", CMD_BROADCAST },
-	{ "/Changeprivs", CMD_GRANT },
-	{ "/DeletePlayer", CMD_DELPLAYER },
-	{ "/EnablePlayer", CMD_ADDPLAYER },
-	{ "/Gag", CMD_GAG },
-	{ "/Hilite", CMD_HILITE },
-	{ "/Infotoggle", CMD_SHOWINFO },
-	{ "/K", CMD_KILLALL },
-	{ "/M", CMD_SETMAIN },
-	{ "/Main", CMD_SETMAIN },
-	{ "/ModifyMAXCONN", CMD_SETMAX },
-	{ "/ModPlayer", CMD_MODPLAYER },
-	{ "/P", CMD_PASSWORD },
-	{ "/Parser", CMD_PARSER },
-	{ "/Password", CMD_PASSWORD },
-	{ "/Purgelog", CMD_PURGELOG },
-	{ "/Restoreparser", CMD_RESTOREPARSER },
-	{ "/Who", CMD_WHO2 },
-	{ "/Yellmode", CMD_SCREAM },
-	{ "/a", CMD_YELL }, /* announce */
-	{ "/addchannel", CMD_ADDCHANNEL },
-	{ "/addplayer", CMD_ADDPLAYER },
-	{ "/announce", CMD_YELL },
-	{ "/b", CMD_BEEPS },
-	{ "/ban", CMD_BANLIST },
-	{ "/banadd", CMD_BANADD },
-	{ "/bandel", CMD_BANDEL },
-	{ "/banlist", CMD_BANLIST },
-	{ "/bbadd", CMD_BOARDADD },
-	{ "/bbdel", CMD_BOARDDEL },
-	{ "/bblist", CMD_BOARDLIST },
-	{ "/beeps", CMD_BEEPS },
-	{ "/channel", CMD_TUNE },
-	{ "/doing", CMD_DOING },
-	{ "/echo", CMD_ECHO },
-	{ "/finger", CMD_FINGER },
-	{ "/force", CMD_FORCE },
-	{ "/gag", CMD_GAG },
-	{ "/h", CMD_HUSH },
-	{ "/help", CMD_HELP },
-	{ "/hilite", CMD_HILITE },
-	{ "/hush", CMD_HUSH },
-	{ "/invisible", CMD_BROADCAST2 },
-	{ "/kill", CMD_KILL },
-	{ "/level", CMD_SHOWLEVEL },
-	{ "/messages", CMD_MESSAGES },
-	{ "/name", CMD_NAME },
-	{ "/onfrom", CMD_DOING },
-	{ "/p", CMD_WHISPER },
-	{ "/post", CMD_POST },
-	{ "/private", CMD_WHISPER },
-	{ "/quit", CMD_QUIT },
-	{ "/r", CMD_WRAP },
-	{ "/read", CMD_READ },
-	{ "/secure", CMD_SECURE },
-	{ "/shutdown", CMD_SHUTDOWN },
-	{ "/tune", CMD_TUNE },
-	{ "/uptime", CMD_UPTIME },
-	{ "/who", CMD_WHO },
-	{ "/wrap", CMD_WRAP },
-	{ "/yell", CMD_YELL },
+#define PARSE_KEY(token, cmd) { token, cmd },
+#include "cmdtab.h"
+#undef PARSE_KEY
 	{ "", 0 },
 };
 
@@ -590,7 +528,10 @@ set_name(struct splayer *pplayer, char *buf)
 		pplayer->privs =
 		    rplayer.privs; /* do we need to persist this? */
 		pplayer->wrap = rplayer.wrap;
-		pplayer->flags = rplayer.flags;
+		/* keep the flags that only make sense for this connection,
+		 * LEAVING in particular */
+		pplayer->flags = (rplayer.flags & ~PLAYER_DONT_SAVE_MASK) |
+		    (pplayer->flags & PLAYER_DONT_SAVE_MASK);
 		pplayer->pagelen = rplayer.pagelen; /* BUG: not implemented */
 		pplayer->playerwhen = rplayer.playerwhen;
 		pplayer->cameon = rplayer.cameon;
@@ -610,7 +551,7 @@ set_name(struct splayer *pplayer, char *buf)
 		    player_getline(pplayer), pplayer->host);
 		sendall(sendbuf, ARRIVAL, 0);
 		pplayer->chnl = channel_getmain();
-		channel_ref(pplayer->chnl);
+		channel_join(pplayer->chnl, pplayer);
 	}
 
 	return PARSE_OK;
@@ -620,6 +561,7 @@ parse_error
 pose_it(struct splayer *pplayer, char *buf)
 {
 	int line = player_getline(pplayer);
+	struct envelope env;
 
 	if (*buf == ',' || *buf == '\'')
 		snprintf(sendbuf, sendbufsz, "(%d) %s%s\r\n", line,
@@ -627,7 +569,8 @@ pose_it(struct splayer *pplayer, char *buf)
 	else
 		snprintf(sendbuf, sendbufsz, "(%d) %s %s\r\n", line,
 		    pplayer->name, buf);
-	sendall(sendbuf, pplayer->chnl, 0);
+	envelope_init(&env, pplayer, SPEECH_NORMAL, sendbuf);
+	deliver(&env);
 	return PARSE_OK;
 }
 
@@ -644,6 +587,7 @@ stagepose(struct splayer *pplayer, char *buf, speechmode mode)
 	int linenum;
 	int sender = player_getline(pplayer);
 	struct splayer *who;
+	struct envelope env;
 
 	if (isdigit(buf[0])) {
 		linenum = atoi(buf);
@@ -694,10 +638,10 @@ stagepose(struct splayer *pplayer, char *buf, speechmode mode)
 				sendtoplayer(pplayer, sendbuf);
 				return PARSE_OK;
 			}
-			if (mode == SPEECH_YELL)
-				sendall(sendbuf, YELL, 0);
-			else
-				sendall(sendbuf, pplayer->chnl, 0);
+			envelope_init(&env, pplayer,
+			    (mode == SPEECH_YELL) ? SPEECH_YELL : SPEECH_NORMAL,
+			    sendbuf);
+			deliver(&env);
 		}
 	} else {
 		snprintf(sendbuf, sendbufsz, bad_comm_prompt);
@@ -734,8 +678,7 @@ force(struct splayer *pplayer, char *buf)
 	if (who->seclevel < pplayer->seclevel) {
 		buf = (char *)skipspace(buf);
 
-		strlcpy(who->pbuf, buf, sizeof(who->pbuf));
-		processinput(who);
+		processinput(who, buf);
 		rc = PARSE_OK;
 	} else {
 		snprintf(sendbuf, sendbufsz,
@@ -763,14 +706,18 @@ gag_Player(struct splayer *pplayer, char *buf)
 	if (!who) {
 		snprintf(sendbuf, sendbufsz,
 		    ">> error:  Player %d does not exist!\r\n", line_number);
-	} else if ((line_number >= 1) && (line_number < MAXCONN)) {
+	} else if (line_number >= 1) {
 		rc = PARSE_OK;
-		if (FD_ISSET(line_number, &pplayer->gags)) {
-			FD_CLR(line_number, &pplayer->gags);
+		if (isgagged(pplayer, who)) {
+			player_removegag(pplayer, who);
 			snprintf(sendbuf, sendbufsz,
 			    ">> Player %d ungagged.\r\n", line_number);
+		} else if (player_gag(pplayer, who) == -1) {
+			rc = PARSERR_SUPPRESS;
+			snprintf(sendbuf, sendbufsz,
+			    ">> error:  Cannot gag player %d.\r\n",
+			    line_number);
 		} else {
-			FD_SET(line_number, &pplayer->gags);
 			snprintf(sendbuf, sendbufsz, ">> Player %d gagged.\r\n",
 			    line_number);
 		}
@@ -803,7 +750,8 @@ finger(struct splayer *pplayer, char *instring)
 {
 	struct splayer *who;
 	char maskbuf[BUFSIZE];
-	int currfd, gagcount;
+	unsigned int i;
+	int gagcount;
 	int line;
 	char *buf;
 
@@ -842,11 +790,11 @@ finger(struct splayer *pplayer, char *instring)
 
 	if ((pplayer->seclevel > BABYCO) || (pplayer == who)) {
 		snprintf(sendbuf, sendbufsz, ">> Gags: ");
-		for (currfd = 1, gagcount = 0; currfd <= MAXCONN; currfd++) {
-			if (FD_ISSET(currfd, &who->gags)) {
+		for (i = 0, gagcount = 0; i < who->gags.count; i++) {
+			if (player_deref(who->gags.handles[i])) {
 				gagcount++;
 				snprintf(maskbuf, sizeof(maskbuf), "%d ",
-				    currfd);
+				    who->gags.handles[i].line);
 				strncat(sendbuf, maskbuf,
 				    (sendbufsz - 1) - strlen(sendbuf));
 				if (gagcount && !(gagcount % 8)) {
@@ -992,17 +940,17 @@ change_channel(struct splayer *pplayer, char *buf)
 	}
 
 	oldc = pplayer->chnl;
-	if (channel_deref(oldc) <= 0) {
+	if (channel_leave(oldc, pplayer) <= 0) {
 		channel_del(oldc);
 		oldc = NULL;
 	}
 
-	channel_ref(newc);
-
+	/* before they're a member, so that only the others hear it */
 	snprintf(sendbuf, sendbufsz, ">> (%d) %s has joined.\r\n", sender,
 	    pplayer->name);
 	sendall(sendbuf, newc, 0);
 
+	channel_join(newc, pplayer);
 	pplayer->chnl = newc;
 
 	snprintf(sendbuf, sendbufsz, ">> Channel changed.\r\n");
@@ -1031,6 +979,7 @@ whisper(struct splayer *pplayer, char *buf)
 	int linenum;
 	int sender;
 	struct splayer *who = NULL;
+	struct envelope env;
 
 	if (!(pplayer->privs & CANWHISPER)) {
 		sendtoplayer(pplayer, NO_PERM);
@@ -1051,13 +1000,15 @@ whisper(struct splayer *pplayer, char *buf)
 	sender = player_getline(pplayer);
 
 	if (who) {
-		pplayer->dotspeeddial = who;
+		pplayer->dotspeeddial = player_handle(who);
 		buf = (char *)skipdigits(buf);
 	} else {
-		who = pplayer->dotspeeddial;
+		/* NULL if they left, even if someone else has their line now */
+		who = player_deref(pplayer->dotspeeddial);
 		if (!who) {
 			snprintf(sendbuf, sendbufsz, bad_comm_prompt);
 			sendtoplayer(pplayer, sendbuf);
+			return PARSERR_SUPPRESS;
 		}
 		linenum = player_getline(who);
 		if (isspace(*buf))
@@ -1086,8 +1037,11 @@ whisper(struct splayer *pplayer, char *buf)
 		snprintf(buf2, sizeof(buf2), formatposeecho, who->name,
 		    pplayer->name, buf);
 
-	if (pplayer->seclevel > JOEUSER && !isgagged(who, pplayer))
-		sendtoplayer(who, sendbuf);
+	if (pplayer->seclevel > JOEUSER) {
+		envelope_init(&env, pplayer, SPEECH_PRIVATE, sendbuf);
+		env.target = player_handle(who);
+		deliver(&env);
+	}
 
 	if (!PLAYER_HAS(ECHO, pplayer)) {
 		sendtoplayer(pplayer, ">> /p sent.\r\n");
@@ -1257,6 +1211,7 @@ yell(struct splayer *pplayer, char *buf)
 	static char formatposespace[20] = "(*%d*) %s %s\r\n";
 	static char formatposenospace[20] = "(*%d*) %s%s\r\n";
 	int sender = player_getline(pplayer);
+	struct envelope env;
 
 	if (!(pplayer->privs & CANYELL)) {
 		sendtoplayer(pplayer, NO_PERM);
@@ -1290,7 +1245,8 @@ yell(struct splayer *pplayer, char *buf)
 			    sender, pplayer->name, buf);
 		}
 		if ((pplayer->seclevel) > JOEUSER) {
-			sendall(sendbuf, YELL, 0);
+			envelope_init(&env, pplayer, SPEECH_YELL, sendbuf);
+			deliver(&env);
 		} else /* Joe should think it was sent, but it wasnt */
 			sendtoplayer(pplayer, sendbuf);
 	};
@@ -1440,7 +1396,7 @@ kill_player(struct splayer *pplayer, char *buf)
 			snprintf(sendbuf, sendbufsz, "%s killed %s.",
 			    pplayer->name, who->name);
 			logmsg(sendbuf);
-			PLAYER_SET(LEAVING, who);
+			player_leave(who);
 		} else {
 			snprintf(sendbuf, sendbufsz,
 			    ">> You don't have authority over %s!\r\n",
@@ -1523,7 +1479,7 @@ playerquit(struct splayer *pplayer, char *buf)
 
 		snprintf(sendbuf, sendbufsz, EXIT_MSG);
 		sendtoplayer(pplayer, sendbuf);
-		PLAYER_SET(LEAVING, pplayer); /* handleinput() will remove */
+		player_leave(pplayer); /* player_reap() will remove */
 	}
 
 	return PARSE_OK;
@@ -1572,6 +1528,15 @@ info_toggle(struct splayer *pplayer)
 	return PARSE_OK;
 }
 
+/* purgelog() wants a name, not the player */
+static parse_error
+purgelog_command(struct splayer *pplayer)
+{
+	purgelog(pplayer->name);
+	sendtoplayer(pplayer, ">> log purged.\r\n");
+	return PARSE_OK;
+}
+
 parse_error
 level_toggle(struct splayer *pplayer)
 {
@@ -1759,83 +1724,85 @@ prelogon(struct splayer *pplayer, char *buf)
 
 // clang-format off
 struct command commands[] = {
-	CMD_DECLS(CMD_ADDCHANNEL, 0, 2, COSYSOP, add_channel),
-	CMD_DECLS(CMD_ADDPLAYER, 0, 2, SUPREME, enablePassword),
-	CMD_DECLS(CMD_BANADD, 0, 2, COSYSOP, add_ban),
-	CMD_DECLS(CMD_BANDEL, 0, 2, COSYSOP, delete_ban),
-	CMD_DECL(CMD_BANLIST, 0, 1, ban_list),
-	CMD_DECLS(CMD_BOARDADD, 0, 2, COSYSOP, add_board),
-	CMD_DECLS(CMD_BOARDDEL, 0, 2, COSYSOP, delete_board),
-	CMD_DECL(CMD_BOARDLIST, 0, 1, board_list),
-	CMD_DECL(CMD_BEEPS, 0, 1, beeps),
-	CMD_DECLS(CMD_BROADCAST, 0, 2, SYSOP, broadcast),
-	CMD_DECLS(CMD_BROADCAST2, 0, 2, SUPREME, broadcast2),
-	CMD_DECLS(CMD_DELPLAYER, 0, 2, SUPREME, delete_player),
-	CMD_DECLS(CMD_DEMOTE, 0, 2, SYSOP, demote),
+	CMD_TEXT(CMD_ADDCHANNEL, COSYSOP, add_channel),
+	CMD_TEXT(CMD_ADDPLAYER, SUPREME, enablePassword),
+	CMD_TEXT(CMD_ADMIT, COSYSOP, admit_command),
+	CMD_TEXT(CMD_BANADD, COSYSOP, add_ban),
+	CMD_TEXT(CMD_BANDEL, COSYSOP, delete_ban),
+	CMD_BARE(CMD_BANLIST, JOEUSER, ban_list),
+	CMD_TEXT(CMD_BOARDADD, COSYSOP, add_board),
+	CMD_TEXT(CMD_BOARDDEL, COSYSOP, delete_board),
+	CMD_BARE(CMD_BOARDLIST, JOEUSER, board_list),
+	CMD_BARE(CMD_BEEPS, JOEUSER, beeps),
+	CMD_TEXT(CMD_BROADCAST, SYSOP, broadcast),
+	CMD_TEXT(CMD_BROADCAST2, SUPREME, broadcast2),
+	CMD_TEXT(CMD_DELPLAYER, SUPREME, delete_player),
+	CMD_TEXT(CMD_DEMOTE, SYSOP, demote),
 #ifdef ONFROM_ANY
 #define CAN_SET_DOING BABYCO
 #else
 #define CAN_SET_DOING SYSOP
 #endif
-	CMD_DECLS(CMD_DOING, 0, 2, CAN_SET_DOING, change_onfrom),
-	CMD_DECL(CMD_ECHO, 0, 1, echo),
+	CMD_TEXT(CMD_DOING, CAN_SET_DOING, change_onfrom),
+	CMD_BARE(CMD_ECHO, JOEUSER, echo),
 	/* BABYCO can see their own gags with finger.
 	 * SYSOP and higher can see who others have gagged.
 	 */
-	CMD_DECL(CMD_FINGER, 0, 2, finger),
-	CMD_DECLS(CMD_FORCE, 0, 2, SUPREME, force),
-	CMD_DECL(CMD_GAG, 0, 2, gag_Player),
-	CMD_DECLS(CMD_GRANT, 0, 2, SUPREME, change_privs),
-	CMD_DECL(CMD_HELP, 0, 2, showhelp),
-	CMD_DECL(CMD_HILITE, 0, 2, hilites),
-	CMD_DECL(CMD_HUSH, 0, 1, hush),
+	CMD_TEXT(CMD_FINGER, JOEUSER, finger),
+	CMD_TEXT(CMD_FORCE, SUPREME, force),
+	CMD_TEXT(CMD_GAG, JOEUSER, gag_Player),
+	CMD_TEXT(CMD_GRANT, SUPREME, change_privs),
+	CMD_TEXT(CMD_HELP, JOEUSER, showhelp),
+	CMD_TEXT(CMD_HILITE, JOEUSER, hilites),
+	CMD_BARE(CMD_HUSH, JOEUSER, hush),
 	/* JOEUSER can't change channel, but they get told that they did.
 	 * BABYCO can change own channel.
 	 * SYSOP and higher can move players to channels.
 	 */
-	CMD_DECL(CMD_JOIN, 0, 2, change_channel),
-	CMD_DECLS(CMD_KILL, 0, 2, SYSOP, kill_player),
-	CMD_DECLS(CMD_KILLALL, 0, 2, SUPREME, kill_all_players),
-	CMD_DECL(CMD_MESSAGES, 0, 1, messages),
-	CMD_DECLS(CMD_MODPLAYER, 0, 2, SUPREME, modPlayer),
-	CMD_DECL(CMD_NAME, 0, 2, set_name),
-	CMD_DECLS(CMD_PARSER, 0, 2, SUPREME, install_parser_from_file),
-	CMD_DECL(CMD_PASSWORD, 0, 2, changePlayer),
-	CMD_DECL(CMD_POSE, 0, 2, pose_it),
-	CMD_DECL(CMD_POST, 0, 2, bulletin_post),
-	CMD_DECLS(CMD_PROMOTE, 0, 2, SYSOP, promote),
-	CMD_DECLS(CMD_PURGELOG, 0, 1, SUPREME, purgelog),
-	CMD_DECLS(CMD_RESTOREPARSER, 0, 1, SYSOP, restore_default_commands),
+	CMD_TEXT(CMD_JOIN, JOEUSER, change_channel),
+	CMD_TEXT(CMD_KILL, SYSOP, kill_player),
+	CMD_TEXT(CMD_KILLALL, SUPREME, kill_all_players),
+	CMD_BARE(CMD_MESSAGES, JOEUSER, messages),
+	CMD_TEXT(CMD_MODPLAYER, SUPREME, modPlayer),
+	CMD_TEXT(CMD_NAME, JOEUSER, set_name),
+	CMD_TEXT(CMD_PARSER, SUPREME, install_parser_from_file),
+	CMD_TEXT(CMD_PASSWORD, JOEUSER, changePlayer),
+	CMD_TEXT(CMD_POSE, JOEUSER, pose_it),
+	CMD_TEXT(CMD_POST, JOEUSER, bulletin_post),
+	CMD_TEXT(CMD_PROMOTE, SYSOP, promote),
+	CMD_BARE(CMD_PURGELOG, SUPREME, purgelog_command),
+	CMD_BARE(CMD_RESTOREPARSER, SYSOP, restore_default_commands),
 	/* quit invokes change_level(), which allows modifiation of the
 	 * in-core passwords if SUPREME or higher.
 	 */
-	CMD_DECL(CMD_QUIT, 0, 2, playerquit),
-	CMD_DECL(CMD_READ, 0, 2, bulletin_read),
-	CMD_DECL(CMD_SCREAM, 0, 1, scream),
-	CMD_DECL(CMD_SECURE, 0, 2, secure_channel),
-	CMD_DECLS(CMD_SETMAIN, 0, 2, SYSOP, setmain),
-	CMD_DECLS(CMD_SETMAX, 0, 2, SUPREME, setmax),
-	CMD_DECL(CMD_SHOWINFO, 0, 1, info_toggle),
-	CMD_DECLS(CMD_SHOWLEVEL, 0, 1, SYSOP, level_toggle),
-	CMD_DECLS(CMD_SHUTDOWN, 0, 1, SUPREME, haven_shutdown),
+	CMD_TEXT(CMD_QUIT, JOEUSER, playerquit),
+	CMD_TEXT(CMD_READ, JOEUSER, bulletin_read),
+	CMD_BARE(CMD_SCREAM, JOEUSER, scream),
+	CMD_TEXT(CMD_SECURE, JOEUSER, secure_channel),
+	CMD_TEXT(CMD_SETMAIN, SYSOP, setmain),
+	CMD_TEXT(CMD_SETMAX, SUPREME, setmax),
+	CMD_BARE(CMD_SHOWINFO, JOEUSER, info_toggle),
+	CMD_BARE(CMD_SHOWLEVEL, SYSOP, level_toggle),
+	CMD_BARE(CMD_SHUTDOWN, SUPREME, haven_shutdown),
 	/* JOEUSER can't really stage pose, the code pretends to do it for
 	 * for them, but will not actually show the results to others.
 	 */
-	CMD_DECL(CMD_STAGEPOSE, 1, 3, stagepose),
+	CMD_SPEECH(CMD_STAGEPOSE, JOEUSER, stagepose),
 	/* SEE CMD_JOIN for restrictions */
-	CMD_DECL(CMD_TUNE, 0, 2, change_channel),
-	CMD_DECL(CMD_UPTIME, 0, 1, format_uptime),
+	CMD_TEXT(CMD_TUNE, JOEUSER, change_channel),
+	CMD_BARE(CMD_UPGRADE, SUPREME, upgrade_command),
+	CMD_BARE(CMD_UPTIME, JOEUSER, format_uptime),
 	/* JOEUSER can't whisper anyone, even though it appears to
 	 * them as if they can.  They can't speak either, see handleinput().
 	 */
-	CMD_DECL(CMD_WHISPER, 0, 2, whisper),
-	CMD_DECL(CMD_WHO, 0, 2, wholist),
-	CMD_DECL(CMD_WHO2, 0, 2, wholist2),
-	CMD_DECL(CMD_WRAP, 0, 2, playerwrap),
+	CMD_TEXT(CMD_WHISPER, JOEUSER, whisper),
+	CMD_TEXT(CMD_WHO, JOEUSER, wholist),
+	CMD_TEXT(CMD_WHO2, JOEUSER, wholist2),
+	CMD_TEXT(CMD_WRAP, JOEUSER, playerwrap),
 	/* JOEUSER can't yell, but thinks they can.
 	 */
-	CMD_DECL(CMD_YELL, 0, 2, yell),
-	{ 0, 0, 0, 0, NULL, NULL }
+	CMD_TEXT(CMD_YELL, JOEUSER, yell),
+	{ 0, 0, 0, 0, { NULL }, NULL }
 };
 // clang-format on
 
@@ -1856,7 +1823,7 @@ restore_default_commands(struct splayer *pplayer)
 		}
 		/* it is conceivable that there may be multiple static contexts
 		 */
-		if (default_parser_context.index) {
+		if (default_parser_context.commands) {
 			main_parser_context = &default_parser_context;
 		} else {
 			/* handlecommand() will install it
@@ -1961,11 +1928,11 @@ install_parser_from_file(struct splayer *pplayer, char *filename)
 		}
 
 		/* is the command name known? */
-		for (commp = newctxp->commands; commp->func; commp++) {
+		for (commp = newctxp->commands; commp->name; commp++) {
 			if (!strncmp(commp->name, command, PARSE_KEY_MAX))
 				break; /* found it */
 		}
-		if (!commp->func) { /* invalid command name */
+		if (!commp->name) { /* invalid command name */
 			snprintf(sendbuf, sendbufsz,
 			    ">> unknown command %s\r\n", command);
 			sendtoplayer(pplayer, sendbuf);
@@ -2038,11 +2005,8 @@ handlecommand(struct splayer *pplayer, char *command)
 			/* done only once */
 			default_parser_entries = parser_count_table_entries(
 			    default_parse_table);
-			if (!parser_init_context(&default_parser_context,
-				default_parse_table, commands, false)) {
-				logmsg("can't allocate parse context");
-				exit(ENOMEM);
-			}
+			(void)parser_init_compiled(&default_parser_context,
+			    default_parse_table, cmdtab_match, commands);
 			main_parser_context = &default_parser_context;
 		}
 
@@ -2088,3 +2052,94 @@ handlecommand(struct splayer *pplayer, char *command)
 		}
 	}
 }
+
+#ifdef TESTCOMMANDS
+#include <sys/socket.h>
+
+#include <assert.h>
+
+#include "event.h"
+#include "servsock_ssl.h"
+
+/* from lorien.c */
+size_t MAXCONN = 64;
+char *logfile = "testcommands.log";
+time_t lorien_boot_time;
+
+/* a player on one end of a socketpair, the test reads the other end */
+static struct splayer *
+testplayer(const char *name, int seclevel, int *peer)
+{
+	struct splayer *pplayer;
+	int sv[2];
+
+	assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+	assert((pplayer = calloc(1, sizeof(*pplayer))));
+	playerinit(pplayer, timer_now(), "localhost", "127.0.0.1");
+	assert((pplayer->h = servsock_inherit(sv[0], false, false)));
+	strlcpy(pplayer->name, name, sizeof(pplayer->name));
+	pplayer->seclevel = seclevel;
+	pplayer->chnl = channel_getmain();
+	assert(player_restore(pplayer) != -1);
+
+	*peer = sv[1];
+	return pplayer;
+}
+
+/* what a player has been sent since the last call */
+static char *
+heard(struct splayer *pplayer, int peer)
+{
+	static char buf[BUFSIZE];
+	ssize_t n;
+
+	(void)flushtosock_ssl(pplayer->h);
+	n = recv(peer, buf, sizeof(buf) - 1, MSG_DONTWAIT);
+	buf[(n > 0) ? n : 0] = '\0';
+	return buf;
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct splayer *alice, *bob, *op;
+	int a, b, o;
+	char line[64];
+
+	log_alloc_buffers();
+	channel_init();
+	assert(event_init() == 0);
+
+	alice = testplayer("alice", BABYCO, &a);
+	bob = testplayer("bob", BABYCO, &b);
+	op = testplayer("op", SUPREME, &o);
+
+	printf("channel change test...");
+	fflush(stdout);
+	assert(change_channel(bob, "hall") == PARSE_OK);
+	(void)heard(alice, a);
+	(void)heard(bob, b);
+	(void)heard(op, o);
+
+	/* the others in the channel hear about it, the one joining doesn't */
+	assert(change_channel(alice, "hall") == PARSE_OK);
+	assert(alice->chnl == bob->chnl);
+	assert(!strstr(heard(alice, a), "has joined"));
+	assert(strstr(heard(bob, b), "alice has joined"));
+	assert(!strstr(heard(op, o), "has joined"));
+
+	/* nor when they're put there by someone else */
+	assert(change_channel(alice, DEFCHAN) == PARSE_OK);
+	(void)heard(alice, a);
+	(void)heard(bob, b);
+	snprintf(line, sizeof(line), "%d hall", player_getline(alice));
+	assert(change_channel(op, line) == PARSE_OK);
+	assert(alice->chnl == bob->chnl);
+	assert(!strstr(heard(alice, a), "has joined"));
+	assert(strstr(heard(bob, b), "alice has joined"));
+	assert(strstr(heard(op, o), "placed on channel"));
+	printf(" passed\n");
+
+	return 0;
+}
+#endif
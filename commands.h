@@ -34,6 +34,9 @@
 #include "lorien.h"
 #include "parse.h"
 
+extern struct parse_key default_parse_table[];
+
+struct parse_key *cmdtab_match(const char *s, size_t *matched);
 void handlecommand(struct splayer *pplayer, char *command);
 parse_error install_parser_from_file(struct splayer *pplayer, char *filename);
 parse_error restore_default_commands(struct splayer *pplayer);
@@ -0,0 +1,735 @@
+/*
+ * Copyright 2025 Jillian Alana Bolton
+ *
+ * The BSD 2-Clause License
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *
+ *     2. Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* event.c - readiness notification for the server's main loop
+ *
+ * The main loop used to rebuild an fd_set from the player list and call
+ * select(2) on every pass, which costs O(connected) per wakeup and limits
+ * the server to FD_SETSIZE lines.  Instead, each fd is registered here once
+ * with a handler, and event_wait() calls the handlers of the fds that are
+ * ready.
+ *
+ * On Linux, epoll(7) is used unless NO_EPOLL is defined.  Elsewhere, the
+ * interest set is kept as a pair of fd_sets that are updated incrementally
+ * and handed to select(2), which is still limited to FD_SETSIZE.
+ *
+ * Each thread that calls event_init() gets a loop of its own, and the other
+ * functions work on the calling thread's loop.  See shard.c.
+ *
+ * With event_setbackend("io_uring"), output to plain sockets is collected
+ * by event_send() while the handlers run, and the whole pass's worth is sent
+ * with one io_uring_enter(2) per EVENT_RING sends, e.g., a yell to a
+ * thousand players is one system call instead of a thousand send(2)s.
+ * Readiness still comes from epoll, because the handlers rely on it being
+ * level-triggered.  If the kernel doesn't have io_uring or won't let us use
+ * it, event_init() quietly does without.
+ *
+ * Readiness is level-triggered, so a handler that stops reading before it
+ * has drained its fd (e.g., because the player is leaving) is simply called
+ * again on the next pass.
+ */
+
+#include <errno.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "event.h"
+#include "platform.h"
+
+#if defined(__linux__) && !defined(NO_EPOLL)
+#define EVENT_EPOLL 1
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#if __has_include(<linux/io_uring.h>) && defined(__NR_io_uring_setup)
+#define EVENT_URING 1
+#include <sys/mman.h>
+#include <sys/socket.h>
+
+#include <linux/io_uring.h>
+#include <stdint.h>
+#include <unistd.h>
+#endif
+#endif
+
+struct event_slot {
+	event_handler func;
+	void *arg;
+	int events;
+	int nsends; /* sends waiting for event_flush() */
+};
+
+/* output queued by event_send() */
+struct event_pending {
+	int fd; /* -1 if dropped by event_unsend() */
+	int res;
+	const char *buf;
+	size_t len;
+	event_sent func;
+	void *arg;
+};
+
+#ifdef EVENT_URING
+#define EVENT_RING 1024 /* most sends handed to one io_uring_enter(2) */
+
+struct event_ring {
+	int fd;
+	unsigned int entries;
+	unsigned int *sqhead, *sqtail, *sqmask, *sqarray;
+	unsigned int *cqhead, *cqtail, *cqmask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sqmap, *cqmap;
+	size_t sqsize, cqsize, sqesize;
+};
+#endif
+
+#ifdef EVENT_EPOLL
+#define EVENT_BATCH 256 /* most events collected by one epoll_wait() */
+#endif
+
+struct event_base {
+	struct event_slot *slots; /* indexed by fd */
+	int nslots;
+	int highfd;
+#ifdef EVENT_EPOLL
+	int epfd;
+	struct epoll_event ready[EVENT_BATCH];
+	int nready;   /* events collected by the current event_wait() */
+	int curready; /* the event being dispatched */
+#else
+	fd_set readset;
+	fd_set writeset;
+#endif
+#ifdef EVENT_URING
+	struct event_ring ring; /* ring.fd is -1 if io_uring isn't used */
+#endif
+	struct event_pending *sends;
+	int nsends;
+	int maxsends;
+};
+
+/* each thread that runs an event loop has its own, see event_init() */
+static _Thread_local struct event_base *base;
+
+static bool wanturing; /* see event_setbackend() */
+
+#ifdef EVENT_EPOLL
+static unsigned int
+event_epollmask(int events)
+{
+	unsigned int mask = 0;
+
+	if (events & EVENT_READ)
+		mask |= EPOLLIN;
+	if (events & EVENT_WRITE)
+		mask |= EPOLLOUT;
+	return mask;
+}
+#endif
+
+static int
+event_grow(int fd)
+{
+	struct event_slot *tmp;
+	int n = (base->nslots) ? base->nslots : 64;
+
+	while (n <= fd)
+		n *= 2;
+
+	tmp = realloc(base->slots, n * sizeof(*base->slots));
+	if (!tmp) {
+		errno = ENOMEM;
+		return -1;
+	}
+	memset(&tmp[base->nslots], 0, (n - base->nslots) * sizeof(*tmp));
+	base->slots = tmp;
+	base->nslots = n;
+	return 0;
+}
+
+static bool
+event_registered(int fd)
+{
+	return base && (fd >= 0) && (fd < base->nslots) &&
+	    base->slots[fd].func;
+}
+
+#ifdef EVENT_EPOLL
+#define EVENT_DEFAULT "epoll"
+#else
+#define EVENT_DEFAULT "select"
+#endif
+
+const char *
+event_backend(void)
+{
+#ifdef EVENT_URING
+	if (base && (base->ring.fd != -1))
+		return EVENT_DEFAULT "+io_uring";
+#endif
+	return EVENT_DEFAULT;
+}
+
+/* Chooses the backend for the loops that event_init() sets up from now on:
+ * "io_uring" if the kernel has it, or the default.
+ */
+int
+event_setbackend(const char *name)
+{
+	if (!strcmp(name, "io_uring"))
+		wanturing = true;
+	else if (!strcmp(name, EVENT_DEFAULT))
+		wanturing = false;
+	else {
+		errno = EINVAL;
+		return -1;
+	}
+
+	errno = 0;
+	return 0;
+}
+
+#ifdef EVENT_URING
+static void
+event_ringfree(struct event_ring *r)
+{
+	if (r->sqes && (r->sqes != MAP_FAILED))
+		munmap(r->sqes, r->sqesize);
+	if (r->cqmap && (r->cqmap != MAP_FAILED) && (r->cqmap != r->sqmap))
+		munmap(r->cqmap, r->cqsize);
+	if (r->sqmap && (r->sqmap != MAP_FAILED))
+		munmap(r->sqmap, r->sqsize);
+	if (r->fd != -1)
+		close(r->fd);
+	memset(r, 0, sizeof(*r));
+	r->fd = -1;
+}
+
+/* true if the kernel can do IORING_OP_SEND */
+static bool
+event_ringprobe(int fd)
+{
+	struct io_uring_probe *probe;
+	size_t size;
+	bool ok;
+
+	size = sizeof(*probe) + 256 * sizeof(struct io_uring_probe_op);
+	probe = calloc(1, size);
+	if (!probe)
+		return false;
+
+	ok = (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe,
+		  256) == 0) &&
+	    (probe->last_op >= IORING_OP_SEND) &&
+	    (probe->ops[IORING_OP_SEND].flags & IO_URING_OP_SUPPORTED);
+	free(probe);
+	return ok;
+}
+
+static int
+event_ringinit(struct event_ring *r)
+{
+	struct io_uring_params p = { 0 };
+
+	memset(r, 0, sizeof(*r));
+	r->fd = syscall(__NR_io_uring_setup, EVENT_RING, &p);
+	if (r->fd == -1)
+		return -1;
+
+	if (!(p.features & IORING_FEAT_NODROP) || !event_ringprobe(r->fd)) {
+		event_ringfree(r);
+		errno = ENOSYS;
+		return -1;
+	}
+
+	r->sqsize = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	r->cqsize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (r->cqsize > r->sqsize)
+			r->sqsize = r->cqsize;
+		r->cqsize = r->sqsize;
+	}
+
+	r->sqmap = mmap(NULL, r->sqsize, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	if (r->sqmap == MAP_FAILED)
+		goto fail;
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		r->cqmap = r->sqmap;
+	else {
+		r->cqmap = mmap(NULL, r->cqsize, PROT_READ | PROT_WRITE,
+		    MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+		if (r->cqmap == MAP_FAILED)
+			goto fail;
+	}
+
+	r->sqesize = p.sq_entries * sizeof(struct io_uring_sqe);
+	r->sqes = mmap(NULL, r->sqesize, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+	if (r->sqes == MAP_FAILED)
+		goto fail;
+
+	r->entries = p.sq_entries;
+	r->sqhead = (unsigned int *)((char *)r->sqmap + p.sq_off.head);
+	r->sqtail = (unsigned int *)((char *)r->sqmap + p.sq_off.tail);
+	r->sqmask = (unsigned int *)((char *)r->sqmap + p.sq_off.ring_mask);
+	r->sqarray = (unsigned int *)((char *)r->sqmap + p.sq_off.array);
+	r->cqhead = (unsigned int *)((char *)r->cqmap + p.cq_off.head);
+	r->cqtail = (unsigned int *)((char *)r->cqmap + p.cq_off.tail);
+	r->cqmask = (unsigned int *)((char *)r->cqmap + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *)((char *)r->cqmap + p.cq_off.cqes);
+	return 0;
+
+fail:
+	event_ringfree(r);
+	return -1;
+}
+
+/* Hands up to EVENT_RING of the pending sends to the kernel, starting at
+ * *next, and collects their results.  MSG_DONTWAIT makes each one finish
+ * during the submission, with -EAGAIN if the socket is full, so nothing
+ * is left in flight when this returns.
+ */
+static int
+event_ringsend(struct event_ring *r, int *next)
+{
+	struct event_pending *s;
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe *cqe;
+	unsigned int tail, head, n = 0, done = 0;
+	long rc;
+	int e;
+
+	tail = *r->sqtail;
+	for (; (n < r->entries) && (*next < base->nsends); (*next)++) {
+		s = &base->sends[*next];
+		if (s->fd == -1)
+			continue;
+
+		sqe = &r->sqes[tail & *r->sqmask];
+		memset(sqe, 0, sizeof(*sqe));
+		sqe->opcode = IORING_OP_SEND;
+		sqe->fd = s->fd;
+		sqe->addr = (uintptr_t)s->buf;
+		sqe->len = (s->len > INT_MAX) ? INT_MAX : s->len;
+		sqe->msg_flags = MSG_NOSIGNAL | MSG_DONTWAIT;
+		sqe->user_data = *next;
+		r->sqarray[tail & *r->sqmask] = tail & *r->sqmask;
+		tail++;
+		n++;
+	}
+	__atomic_store_n(r->sqtail, tail, __ATOMIC_RELEASE);
+
+	while (done < n) {
+		rc = syscall(__NR_io_uring_enter, r->fd,
+		    tail - __atomic_load_n(r->sqhead, __ATOMIC_ACQUIRE),
+		    n - done, IORING_ENTER_GETEVENTS, NULL, 0);
+		e = errno;
+
+		head = *r->cqhead;
+		while (head != __atomic_load_n(r->cqtail, __ATOMIC_ACQUIRE)) {
+			cqe = &r->cqes[head & *r->cqmask];
+			base->sends[cqe->user_data].res = cqe->res;
+			head++;
+			done++;
+		}
+		__atomic_store_n(r->cqhead, head, __ATOMIC_RELEASE);
+
+		if ((rc == -1) && (e != EINTR)) {
+			errno = e;
+			return -1;
+		}
+	}
+	return 0;
+}
+#endif
+
+/* Sends what event_send() collected and tells each sender how it went.
+ * event_wait() does this at the start of each pass, and a thread that is
+ * about to give up its loop does it last, see shard_stop().
+ */
+void
+event_flush(void)
+{
+	struct event_pending *s;
+	int i, fd, first, next = 0;
+
+	while (next < base->nsends) {
+		first = next;
+#ifdef EVENT_URING
+		if ((base->ring.fd != -1) &&
+		    (event_ringsend(&base->ring, &next) == -1)) {
+			/* the ring can't be trusted with more, do without */
+			event_ringfree(&base->ring);
+			next = base->nsends;
+		}
+#else
+		next = base->nsends;
+#endif
+
+		for (i = first; i < next; i++) {
+			s = &base->sends[i];
+			if (s->fd == -1)
+				continue;
+			fd = s->fd;
+			s->fd = -1;
+			base->slots[fd].nsends--;
+			s->func(fd, s->res, s->arg);
+		}
+	}
+	base->nsends = 0;
+}
+
+/* Sets up an event loop for the calling thread.  The other functions work
+ * on the calling thread's loop.
+ */
+int
+event_init(void)
+{
+	struct event_base *b;
+
+	if (base) {
+		errno = 0;
+		return 0;
+	}
+
+	b = calloc(1, sizeof(*b));
+	if (!b) {
+		errno = ENOMEM;
+		return -1;
+	}
+	b->highfd = -1;
+
+#ifdef EVENT_EPOLL
+	b->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (b->epfd == -1) {
+		free(b);
+		return -1;
+	}
+#else
+	FD_ZERO(&b->readset);
+	FD_ZERO(&b->writeset);
+#endif
+#ifdef EVENT_URING
+	if (!wanturing || (event_ringinit(&b->ring) == -1))
+		b->ring.fd = -1;
+#endif
+	base = b;
+	errno = 0;
+	return 0;
+}
+
+/* the largest number of fds the backend can watch */
+int
+event_maxfds(void)
+{
+#ifdef EVENT_EPOLL
+	return INT_MAX;
+#else
+	return FD_SETSIZE;
+#endif
+}
+
+/* the highest fd that is registered, or -1 */
+int
+event_highfd(void)
+{
+	return (base) ? base->highfd : -1;
+}
+
+int
+event_add(int fd, int events, event_handler func, void *arg)
+{
+	if ((fd < 0) || !func) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (!base) {
+		errno = ENXIO;
+		return -1;
+	}
+
+	if (fd >= event_maxfds()) {
+		errno = EMFILE;
+		return -1;
+	}
+
+	if ((fd >= base->nslots) && (event_grow(fd) == -1))
+		return -1;
+
+	if (base->slots[fd].func) {
+		errno = EEXIST;
+		return -1;
+	}
+
+#ifdef EVENT_EPOLL
+	struct epoll_event ev = { 0 };
+
+	ev.events = event_epollmask(events);
+	ev.data.fd = fd;
+	if (epoll_ctl(base->epfd, EPOLL_CTL_ADD, fd, &ev) == -1)
+		return -1;
+#else
+	if (events & EVENT_READ)
+		FD_SET(fd, &base->readset);
+	if (events & EVENT_WRITE)
+		FD_SET(fd, &base->writeset);
+#endif
+
+	base->slots[fd].func = func;
+	base->slots[fd].arg = arg;
+	base->slots[fd].events = events;
+	if (fd > base->highfd)
+		base->highfd = fd;
+
+	errno = 0;
+	return 0;
+}
+
+int
+event_mod(int fd, int events)
+{
+	if (!event_registered(fd)) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	if (base->slots[fd].events == events)
+		return 0;
+
+#ifdef EVENT_EPOLL
+	struct epoll_event ev = { 0 };
+
+	ev.events = event_epollmask(events);
+	ev.data.fd = fd;
+	if (epoll_ctl(base->epfd, EPOLL_CTL_MOD, fd, &ev) == -1)
+		return -1;
+#else
+	FD_CLR(fd, &base->readset);
+	FD_CLR(fd, &base->writeset);
+	if (events & EVENT_READ)
+		FD_SET(fd, &base->readset);
+	if (events & EVENT_WRITE)
+		FD_SET(fd, &base->writeset);
+#endif
+
+	base->slots[fd].events = events;
+	errno = 0;
+	return 0;
+}
+
+/* true if event_send() will take output for the fd */
+bool
+event_cansend(int fd)
+{
+#ifdef EVENT_URING
+	return event_registered(fd) && (base->ring.fd != -1);
+#else
+	return false;
+#endif
+}
+
+/* Queues a send(2) of buf for the end of the pass.  The caller must keep buf
+ * as it is until func is called with the number of bytes sent, or with
+ * -errno, which is -EAGAIN if the socket was full.
+ */
+int
+event_send(int fd, const char *buf, size_t len, event_sent func, void *arg)
+{
+	struct event_pending *tmp;
+	int n;
+
+	if (!event_cansend(fd)) {
+		errno = ENOTSUP;
+		return -1;
+	}
+
+	if (base->nsends == base->maxsends) {
+		n = (base->maxsends) ? base->maxsends * 2 : 64;
+		tmp = realloc(base->sends, n * sizeof(*tmp));
+		if (!tmp) {
+			errno = ENOMEM;
+			return -1;
+		}
+		base->sends = tmp;
+		base->maxsends = n;
+	}
+
+	base->sends[base->nsends++] = (struct event_pending) { .fd = fd,
+		.res = -EAGAIN,
+		.buf = buf,
+		.len = len,
+		.func = func,
+		.arg = arg };
+	base->slots[fd].nsends++;
+
+	errno = 0;
+	return 0;
+}
+
+/* Forgets the fd's sends that haven't gone out, without calling back. */
+void
+event_unsend(int fd)
+{
+	int i;
+
+	if (!event_registered(fd) || !base->slots[fd].nsends)
+		return;
+
+	for (i = 0; i < base->nsends; i++)
+		if (base->sends[i].fd == fd)
+			base->sends[i].fd = -1;
+	base->slots[fd].nsends = 0;
+}
+
+/* Must be called before the fd is closed, so that the fd can be reused. */
+int
+event_del(int fd)
+{
+	if (!event_registered(fd)) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	event_unsend(fd);
+
+#ifdef EVENT_EPOLL
+	(void)epoll_ctl(base->epfd, EPOLL_CTL_DEL, fd, NULL);
+
+	/* don't dispatch events already collected for this fd, they would go
+	 * to whoever reuses the fd number
+	 */
+	for (int i = base->curready + 1; i < base->nready; i++)
+		if (base->ready[i].data.fd == fd)
+			base->ready[i].data.fd = -1;
+#else
+	FD_CLR(fd, &base->readset);
+	FD_CLR(fd, &base->writeset);
+#endif
+
+	memset(&base->slots[fd], 0, sizeof(base->slots[fd]));
+	while ((base->highfd >= 0) && !base->slots[base->highfd].func)
+		base->highfd--;
+
+	errno = 0;
+	return 0;
+}
+
+/* Waits up to timeout milliseconds (forever if -1) and calls the handlers
+ * for each ready fd.  Returns the number of ready fds, or -1 with errno set.
+ */
+int
+event_wait(int timeout)
+{
+	int fd, events, n;
+
+	if (!base) {
+		errno = ENXIO;
+		return -1;
+	}
+
+	/* what the last pass had to say */
+	if (base->nsends)
+		event_flush();
+
+#ifdef EVENT_EPOLL
+	struct epoll_event *ev;
+
+	base->nready = epoll_wait(base->epfd, base->ready, EVENT_BATCH,
+	    timeout);
+	if (base->nready == -1) {
+		base->nready = 0;
+		return -1;
+	}
+
+	for (base->curready = 0; base->curready < base->nready;
+	     base->curready++) {
+		ev = &base->ready[base->curready];
+		fd = ev->data.fd;
+		if (!event_registered(fd))
+			continue;
+
+		events = 0;
+		if (ev->events & EPOLLIN)
+			events |= EVENT_READ;
+		if (ev->events & EPOLLOUT)
+			events |= EVENT_WRITE;
+		/* let the handler discover the error or hangup */
+		if (ev->events & (EPOLLERR | EPOLLHUP))
+			events |= base->slots[fd].events;
+
+		events &= base->slots[fd].events;
+		if (events)
+			base->slots[fd].func(fd, events, base->slots[fd].arg);
+	}
+
+	n = base->nready;
+	base->nready = base->curready = 0;
+#else
+	fd_set r = base->readset, w = base->writeset;
+	struct timeval tv, *tvp = NULL;
+	int top = base->highfd, left;
+
+	if (timeout >= 0) {
+		tv.tv_sec = timeout / 1000;
+		tv.tv_usec = (timeout % 1000) * 1000;
+		tvp = &tv;
+	}
+
+	n = select(top + 1, &r, &w, (fd_set *)0, tvp);
+	if (n == -1)
+		return -1;
+
+	for (fd = 0, left = n; (fd <= top) && (left > 0); fd++) {
+		events = 0;
+		if (FD_ISSET(fd, &r))
+			events |= EVENT_READ;
+		if (FD_ISSET(fd, &w))
+			events |= EVENT_WRITE;
+		if (!events)
+			continue;
+
+		left--;
+		if (!event_registered(fd))
+			continue; /* removed by an earlier handler */
+
+		events &= base->slots[fd].events;
+		if (events)
+			base->slots[fd].func(fd, events, base->slots[fd].arg);
+	}
+#endif
+
+	errno = 0;
+	return n;
+}
@@ -0,0 +1,69 @@
+/*
+ * Copyright 2025 Jillian Alana Bolton
+ *
+ * The BSD 2-Clause License
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *
+ *     2. Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* event.h - readiness notification for the server's main loop
+ */
+
+#ifndef _EVENT_H_
+#define _EVENT_H_
+
+#include <sys/types.h>
+
+#include <stdbool.h>
+
+/* which readiness a caller is interested in, or was notified of */
+#define EVENT_READ  0x01
+#define EVENT_WRITE 0x02
+
+/* called with the fd, the events that are ready, and the argument given to
+ * event_add().  The handler may event_add(), event_mod() or event_del() any
+ * fd, including its own.
+ */
+typedef void (*event_handler)(int fd, int events, void *arg);
+
+/* called with the result of an event_send(), see there */
+typedef void (*event_sent)(int fd, int result, void *arg);
+
+int event_add(int fd, int events, event_handler func, void *arg);
+const char *event_backend(void);
+bool event_cansend(int fd);
+int event_del(int fd);
+void event_flush(void);
+int event_highfd(void);
+int event_init(void);
+int event_maxfds(void);
+int event_mod(int fd, int events);
+int event_send(int fd, const char *buf, size_t len, event_sent func,
+    void *arg);
+int event_setbackend(const char *name);
+void event_unsend(int fd);
+int event_wait(int timeout);
+
+#endif
@@ -31,6 +31,7 @@
  * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include "event.h"
 #include "newplayer.h"
 #include "platform.h"
 
@@ -80,12 +81,15 @@ getdtablesize()
 int
 setdtablesize(int newfdmax)
 {
-	if (newfdmax > FD_SETSIZE)
-		newfdmax = FD_SETSIZE;
+	if (newfdmax > event_maxfds())
+		newfdmax = event_maxfds();
 
 #ifdef RLIMIT_NOFILE
 	struct rlimit maxdescs;
 	getrlimit(RLIMIT_NOFILE, &maxdescs);
+	if ((maxdescs.rlim_max != RLIM_INFINITY) &&
+	    (newfdmax > maxdescs.rlim_max))
+		newfdmax = maxdescs.rlim_max;
 	maxdescs.rlim_cur = newfdmax;
 	setrlimit(RLIMIT_NOFILE, &maxdescs);
 #elif defined(_MSC_VER)
@@ -104,10 +108,9 @@ gettablesize()
 int
 settablesize(size_t size)
 {
-	fd_set fds;
 	int max;
 
-	max = setfds(&fds, false);
+	max = event_highfd() + 1;
 
 	if (size < max)
 		size = max;
@@ -0,0 +1,483 @@
+/*
+ * Copyright 2025 Jillian Alana Bolton
+ *
+ * The BSD 2-Clause License
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *
+ *     2. Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* loadgen.c - connects a crowd to a running server, e.g., to see how it
+ * copes when everyone reconnects at once after a netsplit or a restart
+ *
+ * All the connections are started at the same time.  For each, the time
+ * from connect(2) until the first byte of the welcome arrives is its setup
+ * latency.  The connections are held open until every one of them has
+ * been welcomed, has failed, or has timed out.
+ *
+ * With -y, the first connection then yells that many lines, and the time
+ * until every other connection has all of them measures fan-out
+ * throughput.  -s connects with TLS, and -p names the server's process to
+ * report the CPU time it spent (Linux only), e.g., to compare the server
+ * with and without kernel TLS (lorien -T ktls=0).
+ */
+
+#ifdef __linux__
+#define _GNU_SOURCE /* memmem(3) */
+#endif
+
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include <netinet/in.h>
+
+#include <arpa/inet.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <time.h>
+#include <unistd.h>
+
+const char usage[] = "usage: loadgen [-n connections] [-t seconds] "
+		     "[-h host] [-s] [-y lines [-p pid]] port\n";
+
+#define LAST_LINE "loadgen-end"
+
+struct conn {
+	int sock;
+	SSL *ssl; /* with -s */
+	bool handshaken;
+	struct timespec start;
+	double latency; /* milliseconds, or -1 until welcomed */
+	size_t got;	/* bytes received during the fan-out */
+	bool done;	/* LAST_LINE has arrived */
+	char tail[sizeof(LAST_LINE)]; /* the end of the last read */
+};
+
+static double
+ms_since(struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1000.0 +
+	    (now.tv_nsec - start->tv_nsec) / 1000000.0;
+}
+
+static int
+cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return (x > y) - (x < y);
+}
+
+static void
+raise_fd_limit(int want)
+{
+	struct rlimit rl;
+
+	if (getrlimit(RLIMIT_NOFILE, &rl) == -1)
+		return;
+	if (rl.rlim_cur < (rlim_t)want + 16) {
+		rl.rlim_cur = (rl.rlim_max < (rlim_t)want + 16) ?
+		    rl.rlim_max :
+		    (rlim_t)want + 16;
+		(void)setrlimit(RLIMIT_NOFILE, &rl);
+	}
+}
+
+/* milliseconds of CPU the process has used, or -1 */
+static double
+cpu_ms(int pid)
+{
+	char path[64], buf[1024], *p;
+	unsigned long utime, stime;
+	FILE *f;
+
+	snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+	f = fopen(path, "r");
+	if (!f)
+		return -1;
+	p = fgets(buf, sizeof(buf), f);
+	fclose(f);
+	if (!p || !(p = strrchr(buf, ')')))
+		return -1;
+	/* after the name: state, then 10 fields, then utime and stime */
+	if (sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+		&utime, &stime) != 2)
+		return -1;
+	return (utime + stime) * 1000.0 / sysconf(_SC_CLK_TCK);
+}
+
+/* Returns what the SSL call wants to wait for, or 0 if the connection is
+ * broken.
+ */
+static short
+ssl_wants(SSL *ssl, int rc)
+{
+	switch (SSL_get_error(ssl, rc)) {
+	case SSL_ERROR_WANT_READ:
+		return POLLIN;
+	case SSL_ERROR_WANT_WRITE:
+		return POLLOUT;
+	default:
+		return 0;
+	}
+}
+
+/* Like recv(2), finishing the TLS handshake first if need be.  If it would
+ * block, errno is EAGAIN and *events is what to poll for.
+ */
+static ssize_t
+conn_read(struct conn *c, char *buf, size_t size, short *events)
+{
+	ssize_t rc;
+
+	*events = POLLIN;
+	if (!c->ssl)
+		return recv(c->sock, buf, size, 0);
+
+	if (!c->handshaken) {
+		rc = SSL_do_handshake(c->ssl);
+		if (rc != 1) {
+			*events = ssl_wants(c->ssl, rc);
+			errno = (*events) ? EAGAIN : ECONNRESET;
+			return -1;
+		}
+		c->handshaken = true;
+	}
+
+	rc = SSL_read(c->ssl, buf, (int)size);
+	if (rc > 0)
+		return rc;
+	if (SSL_get_error(c->ssl, rc) == SSL_ERROR_ZERO_RETURN)
+		return 0;
+	*events = ssl_wants(c->ssl, rc);
+	errno = (*events) ? EAGAIN : ECONNRESET;
+	return -1;
+}
+
+/* sends all of it, waiting for the socket as long as it takes */
+static void
+conn_write(struct conn *c, const char *buf, size_t len)
+{
+	struct pollfd pfd = { c->sock, POLLOUT, 0 };
+	ssize_t rc;
+
+	while (len) {
+		if (c->ssl) {
+			rc = SSL_write(c->ssl, buf, (int)len);
+			if (rc <= 0) {
+				pfd.events = ssl_wants(c->ssl, (int)rc);
+				if (!pfd.events)
+					errx(EX_IOERR, "SSL_write failed");
+				(void)poll(&pfd, 1, 100);
+				continue;
+			}
+		} else {
+			rc = send(c->sock, buf, len, 0);
+			if (rc == -1) {
+				if ((errno != EAGAIN) && (errno != EINTR))
+					err(EX_IOERR, "send");
+				pfd.events = POLLOUT;
+				(void)poll(&pfd, 1, 100);
+				continue;
+			}
+		}
+		buf += rc;
+		len -= rc;
+	}
+}
+
+/* reads what has arrived, watching for LAST_LINE */
+static void
+conn_drain(struct conn *c, short *events)
+{
+	char buf[sizeof(c->tail) + 16384], *data = &buf[sizeof(c->tail)];
+	size_t keep = sizeof(c->tail) - 1;
+	ssize_t rc;
+
+	memcpy(buf, c->tail, sizeof(c->tail));
+	while ((rc = conn_read(c, data, sizeof(buf) - sizeof(c->tail),
+		    events)) > 0) {
+		c->got += rc;
+		if (memmem(&buf[1], keep + rc, LAST_LINE, keep))
+			c->done = true;
+		memmove(&buf[1], &data[rc - keep], keep);
+	}
+	memcpy(c->tail, buf, sizeof(c->tail));
+	if ((rc == 0) || (errno != EAGAIN))
+		errx(EX_IOERR, "a connection was closed during the fan-out");
+}
+
+/* the first connection yells, and everyone else listens */
+static int
+fanout(struct conn *c, struct pollfd *pfd, int n, int lines, int timeout,
+    int pid)
+{
+	struct timespec begin;
+	char line[64];
+	double cpu = -1, wall;
+	size_t bytes = 0;
+	int sent = 0, left = n - 1, i, j;
+
+	for (i = 0; i < n; i++) {
+		if (c[i].latency < 0)
+			errx(EX_UNAVAILABLE, "not everyone was welcomed");
+		pfd[i].fd = c[i].sock;
+		pfd[i].events = POLLIN;
+	}
+
+	/* the rest of the welcome */
+	conn_write(&c[0], "/n loadgen\r\n", 12);
+	clock_gettime(CLOCK_MONOTONIC, &begin);
+	while (ms_since(&begin) < 500) {
+		if (poll(pfd, n, 100) <= 0)
+			continue;
+		for (i = 0; i < n; i++)
+			if (pfd[i].revents)
+				conn_drain(&c[i], &pfd[i].events);
+	}
+	for (i = 0; i < n; i++)
+		c[i].got = 0;
+
+	if (pid)
+		cpu = cpu_ms(pid);
+	clock_gettime(CLOCK_MONOTONIC, &begin);
+	while (left > 0) {
+		if (ms_since(&begin) > timeout * 1000.0)
+			break;
+
+		/* a few at a time, so the yeller's own echo is read too */
+		for (j = 0; (j < 64) && (sent <= lines); j++, sent++) {
+			if (sent < lines)
+				snprintf(line, sizeof(line), "/y loadgen %d\r\n",
+				    sent);
+			else
+				snprintf(line, sizeof(line),
+				    "/y " LAST_LINE "\r\n");
+			conn_write(&c[0], line, strlen(line));
+		}
+
+		if (poll(pfd, n, 100) == -1) {
+			if (errno == EINTR)
+				continue;
+			err(EX_OSERR, "poll");
+		}
+		for (i = 0; i < n; i++) {
+			if ((pfd[i].fd == -1) || !pfd[i].revents)
+				continue;
+			conn_drain(&c[i], &pfd[i].events);
+			if (c[i].done && (i > 0)) {
+				pfd[i].fd = -1;
+				left--;
+			}
+		}
+	}
+	wall = ms_since(&begin);
+	if (pid && (cpu >= 0))
+		cpu = cpu_ms(pid) - cpu;
+
+	for (i = 1; i < n; i++)
+		bytes += c[i].got;
+	printf("fan-out of %d lines to %d connections in %.0f ms: "
+	       "%.1f MB/s, %.0f lines/s, %d incomplete\n",
+	    lines, n - 1, wall, bytes / wall / 1000.0,
+	    (double)lines * (n - 1) * 1000.0 / wall, left);
+	if (pid && (cpu >= 0))
+		printf("server cpu %.0f ms\n", cpu);
+	else if (pid)
+		printf("can't see the server's cpu time\n");
+	return (left == 0) ? 0 : 1;
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct sockaddr_in saddr = { 0 };
+	struct pollfd *pfd;
+	struct conn *c;
+	struct hostent *he;
+	struct timespec begin;
+	SSL_CTX *ctx = NULL;
+	double *lat, wall;
+	char *host = "127.0.0.1", buf[4096];
+	int n = 1000, timeout = 30, port, ch, i, left, rc;
+	int welcomed = 0, refused = 0, closed = 0, timedout = 0;
+	int lines = 0, pid = 0;
+	bool tls = false;
+	short events;
+
+	while ((ch = getopt(argc, argv, "h:n:p:st:y:")) != -1) {
+		switch (ch) {
+		case 'h':
+			host = optarg;
+			break;
+		case 'n':
+			n = atoi(optarg);
+			break;
+		case 'p':
+			pid = atoi(optarg);
+			break;
+		case 's':
+			tls = true;
+			break;
+		case 't':
+			timeout = atoi(optarg);
+			break;
+		case 'y':
+			lines = atoi(optarg);
+			break;
+		default:
+			errx(EX_USAGE, usage);
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if ((argc != 1) || (n < 1) || (timeout < 1) || (lines < 0) ||
+	    (lines && (n < 2)) || !(port = atoi(argv[0])))
+		errx(EX_USAGE, usage);
+
+	saddr.sin_family = AF_INET;
+	saddr.sin_port = htons((unsigned short)port);
+	if (inet_pton(AF_INET, host, &saddr.sin_addr) != 1) {
+		he = gethostbyname(host);
+		if (!he)
+			errx(EX_NOHOST, "unknown host %s", host);
+		memcpy(&saddr.sin_addr, he->h_addr, sizeof(saddr.sin_addr));
+	}
+
+	if (tls) {
+		ctx = SSL_CTX_new(TLS_client_method());
+		if (!ctx)
+			errx(EX_SOFTWARE, "can't create SSL context");
+		SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE);
+	}
+
+	raise_fd_limit(n);
+	c = calloc(n, sizeof(*c));
+	pfd = calloc(n, sizeof(*pfd));
+	lat = calloc(n, sizeof(*lat));
+	if (!c || !pfd || !lat)
+		err(EX_OSERR, "calloc");
+
+	clock_gettime(CLOCK_MONOTONIC, &begin);
+	for (i = 0; i < n; i++) {
+		c[i].latency = -1;
+		c[i].sock = socket(AF_INET, SOCK_STREAM, 0);
+		if (c[i].sock == -1)
+			err(EX_OSERR, "socket (after %d connections)", i);
+		(void)fcntl(c[i].sock, F_SETFL, O_NONBLOCK);
+
+		clock_gettime(CLOCK_MONOTONIC, &c[i].start);
+		if ((connect(c[i].sock, (struct sockaddr *)&saddr,
+			 sizeof(saddr)) == -1) &&
+		    (errno != EINPROGRESS)) {
+			refused++;
+			close(c[i].sock);
+			c[i].sock = -1;
+		} else if (tls) {
+			c[i].ssl = SSL_new(ctx);
+			if (!c[i].ssl)
+				errx(EX_SOFTWARE, "SSL_new failed");
+			SSL_set_fd(c[i].ssl, c[i].sock);
+			SSL_set_connect_state(c[i].ssl);
+		}
+		pfd[i].fd = c[i].sock;
+		pfd[i].events = (tls) ? POLLOUT : POLLIN;
+	}
+
+	for (left = n - refused; left > 0;) {
+		if (ms_since(&begin) > timeout * 1000.0)
+			break;
+		if (poll(pfd, n, 100) == -1) {
+			if (errno == EINTR)
+				continue;
+			err(EX_OSERR, "poll");
+		}
+
+		for (i = 0; i < n; i++) {
+			if ((pfd[i].fd == -1) || !pfd[i].revents)
+				continue;
+
+			rc = conn_read(&c[i], buf, sizeof(buf), &events);
+			if (rc > 0) {
+				c[i].latency = ms_since(&c[i].start);
+				lat[welcomed++] = c[i].latency;
+			} else if ((rc == -1) && (errno == EAGAIN)) {
+				pfd[i].events = events;
+				continue;
+			} else if ((rc == -1) &&
+			    ((errno == ECONNREFUSED) || (errno == ECONNRESET)))
+				refused++;
+			else
+				closed++;
+
+			/* hold the connection open, but stop watching it */
+			pfd[i].fd = -1;
+			left--;
+		}
+	}
+	wall = ms_since(&begin);
+	timedout = left;
+
+	printf("%d connections in %.0f ms: %d welcomed, %d refused or reset, "
+	       "%d closed, %d timed out\n",
+	    n, wall, welcomed, refused, closed, timedout);
+
+	if (welcomed) {
+		qsort(lat, welcomed, sizeof(*lat), cmp_double);
+		printf("setup latency ms: min %.1f median %.1f p90 %.1f "
+		       "p99 %.1f max %.1f\n",
+		    lat[0], lat[welcomed / 2], lat[(welcomed * 9) / 10],
+		    lat[(welcomed * 99) / 100], lat[welcomed - 1]);
+	}
+
+	rc = (welcomed == n) ? 0 : 1;
+	if (lines && (rc == 0))
+		rc = fanout(c, pfd, n, lines, timeout, pid);
+
+	for (i = 0; i < n; i++) {
+		if (c[i].ssl)
+			SSL_free(c[i].ssl);
+		if (c[i].sock != -1)
+			close(c[i].sock);
+	}
+	if (ctx)
+		SSL_CTX_free(ctx);
+
+	return rc;
+}
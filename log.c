@@ -49,6 +49,9 @@
 #include "log.h"
 #include "lorien.h"
 #include "platform.h"
+#include "timer.h"
+
+#define LOG_FLUSH 1000 /* ms between writes to the log */
 
 char *sendbuf;
 char *recvbuf;
@@ -56,6 +59,7 @@ static char *logbuf;
 const size_t sendbufsz = BUFSIZE;
 const size_t recvbufsz = BUFSIZE;
 const size_t logbufsz = BUFSIZE;
+static struct timer flusher;
 
 void
 log_alloc_buffers(void)
@@ -71,11 +75,12 @@ log_alloc_buffers(void)
 		err(EX_UNAVAILABLE, "cannot allocate logbuf");
 }
 
-static char errbuf[BUFSIZE];
-
+/* log_error() and log_msg() can be called from any thread */
 void
 log_error(const char *prefix, int err, const char *file, int lineno)
 {
+	char errbuf[BUFSIZE];
+
 	if (err == 0)
 		return;
 
@@ -87,20 +92,38 @@ void
 log_msg(const char *what, const char *file, int line)
 {
 	char *buf;
-	int bufsz = logbufsz;
-	time_t tim = time(NULL);
+	char logline[BUFSIZE];
+	int bufsz = sizeof(logline);
+	time_t tim = timer_now();
 
-	buf = ctime_r(&tim, logbuf);
+	buf = ctime_r(&tim, logline);
 	buf = strchr(buf, '\n');
 	if (!buf)
 		buf = strchr(buf, '\0');
 	assert(buf);
 
-	bufsz -= strnlen(logbuf, bufsz);
+	bufsz -= strnlen(logline, bufsz);
 	snprintf(buf, bufsz, " [%s:%d] %s", file, line, what);
 
-	fprintf(stderr, "%s\n", logbuf);
+	fprintf(stderr, "%s\n", logline);
+}
+
+static void
+log_flush(void *arg)
+{
+	(void)arg;
 	fflush(stderr);
+	timer_set(&flusher, LOG_FLUSH, log_flush, NULL);
+}
+
+/* The log is written once a second, or when the buffer fills, instead of a
+ * line at a time.  Called when stderr has just been opened as the log.
+ */
+void
+log_buffer(void)
+{
+	(void)setvbuf(stderr, NULL, _IOFBF, BUFSIZ);
+	timer_set(&flusher, LOG_FLUSH, log_flush, NULL);
 }
 
 int
@@ -116,6 +139,7 @@ purgelog(const char *who)
 #endif
 
 	err_set_file(stderr);
+	log_buffer();
 
 	snprintf(logbuf, logbufsz, "%s purged the log", who);
 	logmsg(logbuf);
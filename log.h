@@ -42,6 +42,7 @@ extern const size_t recvbufsz;
 #define logmsg(s)      log_msg(s, __FILE__, __LINE__)
 
 void log_alloc_buffers(void);
+void log_buffer(void);
 void log_error(const char *prefix, int err, const char *file, int lineno);
 void log_msg(const char *what, const char *file, int line);
 int purgelog(const char *who);
@@ -49,11 +49,16 @@
 #include <time.h>
 
 #include "chat.h"
+#include "event.h"
 #include "log.h"
 #include "lorien.h"
+#include "newplayer.h"
 #include "platform.h"
 #include "security.h"
 #include "servsock_ssl.h"
+#include "shard.h"
+#include "tls.h"
+#include "upgrade.h"
 
 time_t lorien_boot_time = 0;
 
@@ -61,6 +66,7 @@ int handleargs(int argc, char **argv);
 
 static int port = 0;
 static int sslport = 0;
+static int nshards = 0;
 
 static struct servsock_handle *handle;
 static struct servsock_handle *sslhandle;
@@ -74,8 +80,9 @@ main(int argc, char **argv)
 	log_alloc_buffers();
 
 	handleargs(argc - 1, argv + 1);
+	upgrade_init(argv, handle, sslhandle);
 
-	doit(handle, sslhandle);
+	doit(handle, sslhandle, nshards);
 
 	return 0;
 }
@@ -84,6 +91,7 @@ int
 handleargs(int argc, char **argv)
 {
 	int fdaemon = 0;
+	int upgradefd = -1;
 	int childid;
 	int i;
 
@@ -100,6 +108,42 @@ handleargs(int argc, char **argv)
 				err(EX_DATAERR, "missing log file name");
 			}
 			logfile = argv[i];
+		} else if (!strcmp(argv[i], "-q")) {
+			char *hi;
+			size_t lo;
+
+			if (++i >= argc) {
+				errno = EINVAL;
+				err(EX_DATAERR, "missing queue watermarks");
+			}
+			lo = strtoul(argv[i], &hi, 10);
+			if ((*hi++ != ',') ||
+			    (servsock_setwatermarks(lo, strtoul(hi, NULL, 10)) ==
+				-1))
+				err(EX_DATAERR, "bad queue watermarks %s",
+				    argv[i]);
+		} else if (!strcmp(argv[i], "-b")) {
+			if (++i >= argc) {
+				errno = EINVAL;
+				err(EX_DATAERR, "missing listen backlog");
+			}
+			if (servsock_setbacklog(atoi(argv[i])) == -1)
+				err(EX_DATAERR, "bad listen backlog %s", argv[i]);
+		} else if (!strcmp(argv[i], "-i")) {
+			if (++i >= argc) {
+				errno = EINVAL;
+				err(EX_DATAERR, "missing idle limit");
+			}
+			if (player_setidlelimit(atoi(argv[i])) == -1)
+				err(EX_DATAERR, "bad idle limit %s", argv[i]);
+		} else if (!strcmp(argv[i], "-e")) {
+			if (++i >= argc) {
+				errno = EINVAL;
+				err(EX_DATAERR, "missing event backend");
+			}
+			if (event_setbackend(argv[i]) == -1)
+				err(EX_DATAERR, "unknown event backend %s",
+				    argv[i]);
 		} else if (!strcmp(argv[i], "-s")) {
 			if (++i >= argc) {
 				errno = EINVAL;
@@ -109,6 +153,33 @@ handleargs(int argc, char **argv)
 
 			if (!sslport)
 				err(EX_DATAERR, "bad ssl port %s", argv[i]);
+		} else if (!strcmp(argv[i], "-T")) {
+			if (++i >= argc) {
+				errno = EINVAL;
+				err(EX_DATAERR, "missing TLS setting");
+			}
+			if (tls_set(argv[i]) == -1)
+				err(EX_DATAERR, "bad TLS setting %s", argv[i]);
+		} else if (!strcmp(argv[i], "-U")) {
+			/* the server before an upgrade started us, see
+			 * upgrade.c
+			 */
+			if (++i >= argc) {
+				errno = EINVAL;
+				err(EX_DATAERR, "missing upgrade socket");
+			}
+			upgradefd = atoi(argv[i]);
+		} else if (!strcmp(argv[i], "-t")) {
+			if (++i >= argc) {
+				errno = EINVAL;
+				err(EX_DATAERR, "missing thread count");
+			}
+			nshards = atoi(argv[i]);
+			if ((nshards < 1) || (nshards > SHARD_MAX)) {
+				errno = EINVAL;
+				err(EX_DATAERR, "bad thread count %s (1-%d)",
+				    argv[i], SHARD_MAX);
+			}
 		} else if ((port = atoi(argv[i]))) {
 			port = atoi(argv[i]);
 			if (!port)
@@ -141,7 +212,11 @@ handleargs(int argc, char **argv)
 		exit(2);
 	}
 
-	if (port) {
+	/* the old server's listening sockets, instead of binding */
+	if (upgradefd != -1)
+		upgrade_listeners(upgradefd, &handle, &sslhandle);
+
+	if (port && !handle) {
 		printf("Establishing socket on %s on port %d...\n", sendbuf,
 		    port);
 		handle = getsock_ssl(sendbuf, port, false);
@@ -150,7 +225,7 @@ handleargs(int argc, char **argv)
 		printf("Socket established on port %d.\n", port);
 	}
 
-	if (sslport) {
+	if (sslport && !sslhandle) {
 		printf("Establishing socket on %s on port +%d...\n", sendbuf,
 		    sslport);
 		sslhandle = getsock_ssl(sendbuf, sslport, true);
@@ -163,9 +238,10 @@ handleargs(int argc, char **argv)
 	if (freopen(logfile, "a", stderr) == NULL)
 		err(EX_OSERR, "unable to open logfile %s", logfile);
 	err_set_file(stderr);
+	log_buffer();
 
 #ifndef _MSC_VER
-	if (fdaemon) {
+	if (fdaemon && (upgradefd == -1)) {
 		switch (childid = fork()) {
 		case -1:
 			fprintf(stdout, "ERROR starting daemon. exitting.\n");
@@ -50,6 +50,7 @@ Dave Mott          (Energizer Rabbit)
 #include <time.h>
 
 #include "db.h"
+#include "timer.h"
 #include "utility.h"
 
 struct servsock_handle;
@@ -193,8 +194,10 @@ enum player_privs {
 #define MESSAGE 1
 #define COMMAND 2
 
-#define USAGE                                                    \
-	"USAGE: lorien [-l file] [-d] [-s sslport] portnumber\n" \
+#define USAGE                                                      \
+	"USAGE: lorien [-l file] [-d] [-b backlog] [-e io_uring]"  \
+	" [-i minutes] [-q lowat,hiwat] [-s sslport]"              \
+	" [-T name=value] [-t threads] portnumber\n"               \
 	"usually just: lorien -d 2525\n"
 
 extern time_t lorien_boot_time;
@@ -207,6 +210,21 @@ extern time_t lorien_boot_time;
 #define INFORMATIONAL (struct channel *)-6
 #define DEPARTURE     (struct channel *)-5
 
+/* A reference to a player that doesn't dangle when they leave: it stops
+ * resolving once their line is reused.  See player_deref().
+ */
+struct player_handle {
+	int line;
+	unsigned int gen;
+};
+
+/* players gagged by, or gagging, a player; sorted, see isgagged() */
+struct gagset {
+	struct player_handle *handles;
+	unsigned int count;
+	unsigned int size;
+};
+
 struct splayer {
 	int seclevel; /* how powerful are they? */
 	int hilite;   /* a mask.  */
@@ -226,14 +244,20 @@ struct splayer {
 	time_t playerwhen; /* creation date */
 	time_t idle;	   /* number of seconds since player did anything */
 	struct channel *chnl;
+	LIST_ENTRY(splayer) chanentries; /* members of chnl */
 	SLIST_ENTRY(splayer) entries;
-	fd_set gags;
+	TAILQ_ENTRY(splayer) reapq; /* see player_leave() */
+	struct gagset gags;	    /* players this one has gagged */
+	struct gagset gaggedby;	    /* players who have gagged this one */
 	int spamming;	    /* if the player is probably an e-mail spambot */
 	char pbuf[BUFSIZE]; /* player buffer for accumulating text in char mode
 			     */
-	struct splayer *dotspeeddial; /* last person .p'd to */
-	struct servsock_handle *h;    /* line number is h->sock */
-	int port;		      /* remote port number */
+	size_t pblen;	    /* bytes in pbuf, see frameinput() */
+	struct player_handle dotspeeddial; /* last person .p'd to */
+	struct servsock_handle *h;	   /* line number is h->sock */
+	int port;			   /* remote port number */
+	unsigned int gen; /* generation of the line, see player_handle */
+	struct timer idler; /* see player_idle() */
 };
 
 #endif
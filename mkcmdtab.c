@@ -0,0 +1,199 @@
+/*
+ * Copyright 2008-2025, Bolton-Dormer Research Partnership
+ *
+ * The BSD 2-Clause License
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *
+ *     2. Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* mkcmdtab.c - writes cmdtab.c, the matcher for the default command table
+ *
+ * parser_search_table() finds a command with a fuzzy trie match: as much of
+ * the input as is the start of some token, then the token that is exactly
+ * that much, or else the first one in byte order that starts with it.  The
+ * default table is known when lorien is built, so this builds its trie
+ * here and writes it out as code instead: a label for each node, a switch
+ * on the byte that leads to the ones below, and what a match that stops
+ * there returns.
+ *
+ * usage: mkcmdtab > cmdtab.c
+ */
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char *tokens[] = {
+#define PARSE_KEY(token, cmd) token,
+#include "cmdtab.h"
+#undef PARSE_KEY
+};
+
+#define NTOKENS (sizeof(tokens) / sizeof(tokens[0]))
+
+/* each node is the start of a token */
+struct node {
+	const char *token;
+	size_t depth;
+};
+
+static struct node *nodes;
+static size_t nnodes;
+
+static int
+nodecmp(const void *a, const void *b)
+{
+	const struct node *na = a, *nb = b;
+	size_t len = (na->depth < nb->depth) ? na->depth : nb->depth;
+	int rc = memcmp(na->token, nb->token, len);
+
+	if (rc)
+		return rc;
+	return (na->depth > nb->depth) - (na->depth < nb->depth);
+}
+
+/* the node for the first depth bytes of s, or -1 */
+static int
+findnode(const char *s, size_t depth)
+{
+	struct node key = { s, depth };
+	struct node *n;
+
+	n = bsearch(&key, nodes, nnodes, sizeof(*nodes), nodecmp);
+	return n ? n - nodes : -1;
+}
+
+/* the token a match that stops at n returns, as the trie would have it */
+static int
+result(struct node *n)
+{
+	int best = -1;
+	size_t i;
+
+	for (i = 0; i < NTOKENS; i++) {
+		if ((strlen(tokens[i]) < n->depth) ||
+		    memcmp(tokens[i], n->token, n->depth))
+			continue;
+		/* strcmp() puts n's own token first, if there is one, and
+		 * the first of two that are the same stays
+		 */
+		if ((best == -1) || (strcmp(tokens[i], tokens[best]) < 0))
+			best = i;
+	}
+	return best;
+}
+
+static void
+putbyte(unsigned char c)
+{
+	if ((c == '\'') || (c == '\\'))
+		printf("'\\%c'", c);
+	else if (isprint(c))
+		printf("'%c'", c);
+	else
+		printf("'\\%03o'", c);
+}
+
+int
+main(void)
+{
+	struct node *n;
+	size_t i, j, k, len;
+	int child, nchildren;
+
+	for (i = 0; i < NTOKENS; i++)
+		nnodes += strlen(tokens[i]) + 1;
+	if (!(nodes = calloc(nnodes, sizeof(*nodes)))) {
+		perror("mkcmdtab");
+		return 1;
+	}
+
+	/* every start of every token, once */
+	for (i = 0, k = 0; i < NTOKENS; i++) {
+		len = strlen(tokens[i]);
+		for (j = 0; j <= len; j++) {
+			nodes[k].token = tokens[i];
+			nodes[k++].depth = j;
+		}
+	}
+	qsort(nodes, nnodes, sizeof(*nodes), nodecmp);
+	for (i = 1, k = 1; i < nnodes; i++)
+		if (nodecmp(&nodes[i], &nodes[k - 1]))
+			nodes[k++] = nodes[i];
+	nnodes = k;
+
+	printf("/* cmdtab.c - made by mkcmdtab from cmdtab.h, do not edit */\n"
+	       "\n"
+	       "#include <stddef.h>\n"
+	       "\n"
+	       "#include \"commands.h\"\n"
+	       "\n"
+	       "/* what a fuzzy trie match finds in default_parse_table */\n"
+	       "struct parse_key *\n"
+	       "cmdtab_match(const char *s, size_t *matched)\n"
+	       "{\n");
+
+	for (i = 0; i < nnodes; i++) {
+		n = &nodes[i];
+		if (i)
+			printf("n%zu:\n", i);
+
+		/* the nodes a byte below this one sort right after it */
+		nchildren = 0;
+		for (j = i + 1; j < nnodes; j++) {
+			if (nodes[j].depth <= n->depth ||
+			    memcmp(nodes[j].token, n->token, n->depth))
+				break;
+			if (nodes[j].depth == n->depth + 1)
+				nchildren++;
+		}
+		if (nchildren)
+			printf("\tswitch (s[%zu]) {\n", n->depth);
+		for (j = i + 1; nchildren && (j < nnodes); j++) {
+			if (nodes[j].depth <= n->depth ||
+			    memcmp(nodes[j].token, n->token, n->depth))
+				break;
+			if (nodes[j].depth != n->depth + 1)
+				continue;
+			child = findnode(nodes[j].token, nodes[j].depth);
+			printf("\tcase ");
+			putbyte(nodes[j].token[n->depth]);
+			printf(":\n\t\tgoto n%d;\n", child);
+		}
+		if (nchildren)
+			printf("\t}\n");
+
+		printf("\t*matched = %zu;\n", n->depth);
+		if (n->depth)
+			printf("\treturn &default_parse_table[%d];\n",
+			    result(n));
+		else
+			printf("\treturn NULL;\n");
+	}
+	printf("}\n");
+
+	return 0;
+}
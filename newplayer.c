@@ -45,26 +45,42 @@ Dave Mott          (Energizer Rabbit)
 
 #include <sys/queue.h>
 
-#include <assert.h>
-#include <err.h>
-#include <iconv.h>
-#include <sysexits.h>
-
 #include "ban.h"
 #include "channel.h"
 #include "commands.h"
+#include "event.h"
 #include "log.h"
 #include "lorien.h"
 #include "newplayer.h"
 #include "parse.h"
 #include "platform.h"
+#include "resolver.h"
 #include "servsock_ssl.h"
+#include "shard.h"
+#include "timer.h"
+#include "utf8.h"
 
 #define level(p, w) \
 	((PLAYER_HAS(SHOW, p) || w->seclevel >= p->seclevel) ? p->seclevel : 1)
 
 SLIST_HEAD(playerlist, splayer) playerhead = SLIST_HEAD_INITIALIZER(playerhead);
 
+/* players marked LEAVING that have not been removed yet */
+TAILQ_HEAD(reaplist, splayer) reaphead = TAILQ_HEAD_INITIALIZER(reaphead);
+
+/* players indexed by line number, see player_lookup() */
+struct player_slot {
+	struct splayer *player;
+	unsigned int gen; /* bumped each time the line is reused */
+};
+
+static struct player_slot *linetab;
+static int nlines;
+
+static void player_event(struct servsock_handle *h, int what, char *text,
+    size_t len, int err, void *arg);
+static void player_ready(int fd, int events, void *arg);
+
 int numconnect; /* number of people connected */
 
 char *player_flags_names[16] = { "Showlevel", "Verified", "Whisper Beeps",
@@ -91,10 +107,126 @@ char *player_privs_names[16] = {
 	NULL,
 };
 
+/* Where ph is in the set, or where it belongs if it is not there.  Sets
+ * are sorted by line, then generation.
+ */
+static unsigned int
+gagset_search(struct gagset *gs, struct player_handle ph, bool *found)
+{
+	unsigned int lo = 0, hi = gs->count, mid;
+	struct player_handle *cur;
+
+	*found = false;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		cur = &gs->handles[mid];
+		if ((cur->line < ph.line) ||
+		    ((cur->line == ph.line) && (cur->gen < ph.gen))) {
+			lo = mid + 1;
+		} else if ((cur->line == ph.line) && (cur->gen == ph.gen)) {
+			*found = true;
+			return mid;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+static int
+gagset_add(struct gagset *gs, struct player_handle ph)
+{
+	struct player_handle *tmp;
+	unsigned int i, n;
+	bool found;
+
+	i = gagset_search(gs, ph, &found);
+	if (found)
+		return 0;
+
+	if (gs->count == gs->size) {
+		n = (gs->size) ? gs->size * 2 : 4;
+		tmp = realloc(gs->handles, n * sizeof(*tmp));
+		if (!tmp) {
+			errno = ENOMEM;
+			return -1;
+		}
+		gs->handles = tmp;
+		gs->size = n;
+	}
+
+	memmove(&gs->handles[i + 1], &gs->handles[i],
+	    (gs->count - i) * sizeof(*gs->handles));
+	gs->handles[i] = ph;
+	gs->count++;
+	return 0;
+}
+
+static void
+gagset_del(struct gagset *gs, struct player_handle ph)
+{
+	unsigned int i;
+	bool found;
+
+	i = gagset_search(gs, ph, &found);
+	if (!found)
+		return;
+
+	gs->count--;
+	memmove(&gs->handles[i], &gs->handles[i + 1],
+	    (gs->count - i) * sizeof(*gs->handles));
+}
+
+static void
+gagset_free(struct gagset *gs)
+{
+	free(gs->handles);
+	memset(gs, 0, sizeof(*gs));
+}
+
+/* The recipient's gag set is what's searched when speech is delivered.  The
+ * target's gaggedby set is the reverse index, so that when the target leaves
+ * only the players who gagged them need to be visited.
+ */
+int
+player_gag(struct splayer *pplayer, struct splayer *target)
+{
+	if (gagset_add(&pplayer->gags, player_handle(target)) == -1)
+		return -1;
+
+	if (gagset_add(&target->gaggedby, player_handle(pplayer)) == -1) {
+		gagset_del(&pplayer->gags, player_handle(target));
+		return -1;
+	}
+
+	return 0;
+}
+
 void
 player_removegag(struct splayer *pplayer, struct splayer *target)
 {
-	FD_CLR(player_getline(target), &pplayer->gags);
+	gagset_del(&pplayer->gags, player_handle(target));
+	gagset_del(&target->gaggedby, player_handle(pplayer));
+}
+
+/* forget every gag to or from a player who is leaving */
+static void
+player_dropgags(struct splayer *pplayer)
+{
+	struct player_handle me = player_handle(pplayer);
+	struct splayer *other;
+	unsigned int i;
+
+	for (i = 0; i < pplayer->gaggedby.count; i++)
+		if ((other = player_deref(pplayer->gaggedby.handles[i])))
+			gagset_del(&other->gags, me);
+
+	for (i = 0; i < pplayer->gags.count; i++)
+		if ((other = player_deref(pplayer->gags.handles[i])))
+			gagset_del(&other->gaggedby, me);
+
+	gagset_free(&pplayer->gags);
+	gagset_free(&pplayer->gaggedby);
 }
 
 int
@@ -126,11 +258,12 @@ playerinit(struct splayer *who, time_t when, char *where, char *numwhere)
 	who->idle = when;
 	who->cameon = when;
 	who->privs = CANDEFAULT;
-	who->dotspeeddial = 0;
+	memset(&who->dotspeeddial, 0, sizeof(who->dotspeeddial));
 	who->wrap = 80;
 	who->spamming = 0;
-	FD_ZERO(&who->gags);
-	memset(who->pbuf, 0, sizeof(who->pbuf));
+	memset(&who->gags, 0, sizeof(who->gags));
+	memset(&who->gaggedby, 0, sizeof(who->gaggedby));
+	who->pblen = 0;
 }
 
 int
@@ -141,22 +274,137 @@ player_getline(struct splayer *pplayer)
 	return pplayer->h->sock;
 }
 
-int
-newplayer(struct servsock_handle *ssh)
+static int
+linetab_insert(struct splayer *pplayer)
 {
-	struct servsock_handle *h;
-	struct splayer *buf, tmpbuf = { 0 };
-	time_t tmptime;
-	int err = 0, rc;
+	struct player_slot *tmp;
+	int line = player_getline(pplayer);
+	int n = (nlines) ? nlines : 64;
+
+	if (line >= nlines) {
+		while (n <= line)
+			n *= 2;
+		tmp = realloc(linetab, n * sizeof(*linetab));
+		if (!tmp) {
+			errno = ENOMEM;
+			return -1;
+		}
+		memset(&tmp[nlines], 0, (n - nlines) * sizeof(*tmp));
+		linetab = tmp;
+		nlines = n;
+	}
 
-	h = acceptcon_ssl(ssh, tmpbuf.host, sizeof(tmpbuf.host), tmpbuf.numhost,
-	    sizeof(tmpbuf.numhost), &tmpbuf.port);
-	if (!h) {
-		err = errno;
-		logerror("acceptcon_ssl() failed", err);
-		errno = err;
+	/* generation 0 is never used, so a zeroed handle refers to nobody */
+	if (!++linetab[line].gen)
+		linetab[line].gen++;
+	linetab[line].player = pplayer;
+	pplayer->gen = linetab[line].gen;
+	return 0;
+}
+
+struct player_handle
+player_handle(struct splayer *pplayer)
+{
+	struct player_handle ph = { 0 };
+
+	if (pplayer) {
+		ph.line = player_getline(pplayer);
+		ph.gen = pplayer->gen;
+	}
+	return ph;
+}
+
+/* the player the handle refers to, or NULL if they have left */
+struct splayer *
+player_deref(struct player_handle ph)
+{
+	if ((ph.line < 0) || (ph.line >= nlines) ||
+	    (linetab[ph.line].gen != ph.gen))
+		return NULL;
+
+	return linetab[ph.line].player;
+}
+
+#ifndef SKIP_HOSTLOOKUP
+/* The answer to the lookup started by player_admit().  Sites can be banned
+ * by name, so the ban list is checked again.
+ */
+static void
+player_resolved(const char *host, void *arg)
+{
+	struct splayer *pplayer = arg;
+
+	if (!host)
+		return;
+
+	/* "doing" starts out as where they are on from */
+	if (!strcmp(pplayer->onfrom, pplayer->host))
+		strlcpy(pplayer->onfrom, host, sizeof(pplayer->onfrom));
+	strlcpy(pplayer->host, host, sizeof(pplayer->host));
+
+	snprintf(sendbuf, sendbufsz, "line %d is on from %s",
+	    player_getline(pplayer), pplayer->host);
+	logmsg(sendbuf);
+
+	if (ban_findsite(pplayer->host)) {
+		snprintf(sendbuf, sendbufsz,
+		    ">> Your site is presently blocked.\r\n");
+		(void)outtosock_ssl(pplayer->h, sendbuf);
+		player_leave(pplayer);
+	}
+}
+#endif
+
+static time_t idlelimit; /* seconds, 0 if players can idle forever */
+
+/* -i, 0 turns it off */
+int
+player_setidlelimit(int minutes)
+{
+	if (minutes < 0) {
+		errno = EINVAL;
 		return -1;
 	}
+	idlelimit = (time_t)minutes * 60;
+	return 0;
+}
+
+/* Runs when a player could have been idle for too long.  Input doesn't move
+ * the timer, so if they did something since, it's set again for when they
+ * next could be.
+ */
+static void
+player_idle(void *arg)
+{
+	struct splayer *pplayer = arg;
+	time_t idle = timer_now() - pplayer->idle;
+
+	if (!idlelimit || PLAYER_HAS(LEAVING, pplayer))
+		return;
+
+	if (idle < idlelimit) {
+		timer_set(&pplayer->idler, (idlelimit - idle) * 1000,
+		    player_idle, pplayer);
+		return;
+	}
+
+	snprintf(sendbuf, sendbufsz, "line %d was idle too long",
+	    player_getline(pplayer));
+	logmsg(sendbuf);
+	snprintf(sendbuf, sendbufsz, ">> You have been idle too long.\r\n");
+	(void)outtosock_ssl(pplayer->h, sendbuf);
+	player_leave(pplayer);
+}
+
+/* Makes a player of a connection that has been accepted and, for TLS, has
+ * finished its handshake.
+ */
+static int
+player_admit(struct servsock_handle *h, char *host, char *numhost, int port)
+{
+	struct splayer *buf;
+	time_t tmptime;
+	int err = 0, rc;
 
 	/* create a new player struct(record) */
 	buf = (struct splayer *)calloc(1, sizeof(struct splayer));
@@ -173,10 +421,20 @@ newplayer(struct servsock_handle *ssh)
 		return -1;
 	}
 
-	tmptime = time((time_t *)0);
-	playerinit(buf, tmptime, tmpbuf.host, tmpbuf.numhost);
+	tmptime = timer_now();
+	playerinit(buf, tmptime, host, numhost);
+	buf->port = port;
 	buf->h = h;
 
+	if (linetab_insert(buf) == -1) {
+		err = errno;
+		logerror("can't index player", err);
+		(void)closesock_ssl(h);
+		free(buf);
+		errno = err;
+		return -1;
+	}
+
 	snprintf(sendbuf, sendbufsz, "Someone came on from %s on line %d",
 	    buf->host, buf->h->sock);
 	logmsg(sendbuf);
@@ -184,6 +442,23 @@ newplayer(struct servsock_handle *ssh)
 	/* welcome our new arrival */
 
 	numconnect++;
+	rc = 0;
+	if (shard_count() && h->shard) {
+		/* a TLS connection was handed off for its handshake */
+		shard_sethandler(h, player_event, buf);
+	} else if (shard_count()) {
+		rc = shard_adopt(h, player_event, buf);
+	} else {
+		rc = event_add(h->sock, EVENT_READ, player_ready, buf);
+	}
+	if (rc == -1) {
+		err = errno;
+		logerror("can't watch connection", err);
+		removeplayer(buf);
+		errno = err;
+		return -1;
+	}
+
 	rc = welcomeplayer(buf);
 	if (rc < 0) {
 		err = errno;
@@ -194,164 +469,602 @@ newplayer(struct servsock_handle *ssh)
 	}
 
 	SLIST_INSERT_HEAD(&playerhead, buf, entries);
+	player_idle(buf);
+
+#ifndef SKIP_HOSTLOOKUP
+	/* they are known by their address until the lookup is answered */
+	if (resolver_lookup(buf->numhost, player_resolved, buf) == -1)
+		logerror("can't look up host name", errno);
+#endif
 
 	errno = 0;
 	return player_getline(buf);
 }
 
+/* Brings back a player that the server handed over when it was upgraded,
+ * see upgrade.c.  The record is filled in and h is the connection.  gen is
+ * the line's generation before, so that handles to the player still work.
+ */
+int
+player_restore(struct splayer *pplayer)
+{
+	unsigned int gen = pplayer->gen;
+	int line = player_getline(pplayer);
+	int err, rc;
+
+	if (linetab_insert(pplayer) == -1)
+		return -1;
+	if (gen)
+		linetab[line].gen = pplayer->gen = gen;
+
+	if (shard_count())
+		rc = shard_adopt(pplayer->h, player_event, pplayer);
+	else
+		rc = event_add(line, EVENT_READ, player_ready, pplayer);
+	if (rc == -1) {
+		err = errno;
+		linetab[line].player = NULL;
+		errno = err;
+		return -1;
+	}
+
+	numconnect++;
+	SLIST_INSERT_HEAD(&playerhead, pplayer, entries);
+	if (pplayer->chnl)
+		channel_join(pplayer->chnl, pplayer);
+	player_idle(pplayer);
+
+#ifndef SKIP_HOSTLOOKUP
+	/* the lookup wasn't answered before the upgrade */
+	if (!strcmp(pplayer->host, pplayer->numhost) &&
+	    (resolver_lookup(pplayer->numhost, player_resolved, pplayer) == -1))
+		logerror("can't look up host name", errno);
+#endif
+
+	errno = 0;
+	return line;
+}
+
+/* Calls func for each player who isn't leaving, until it returns non-zero,
+ * and returns what it returned.
+ */
+int
+player_walk(int (*func)(struct splayer *pplayer, void *arg), void *arg)
+{
+	struct splayer *pplayer;
+	int rc;
+
+	SLIST_FOREACH(pplayer, &playerhead, entries) {
+		if (PLAYER_HAS(LEAVING, pplayer))
+			continue;
+		if ((rc = func(pplayer, arg)))
+			return rc;
+	}
+	return 0;
+}
+
+/* A TLS connection isn't a player until its handshake is done.  Until then
+ * it waits here, and is dropped if it takes too long, see handshake_expire().
+ */
+struct handshake {
+	TAILQ_ENTRY(handshake) entries;
+	struct servsock_handle *h;
+	struct timer timeout;
+	int port;
+	char host[MAX_NAME];
+	char numhost[MAX_NAME];
+};
+
+TAILQ_HEAD(handshakelist, handshake) handshakehead =
+    TAILQ_HEAD_INITIALIZER(handshakehead);
+
+static void
+handshake_drop(struct handshake *hs)
+{
+	TAILQ_REMOVE(&handshakehead, hs, entries);
+	timer_cancel(&hs->timeout);
+	(void)event_del(hs->h->sock);
+	(void)closesock_ssl(hs->h);
+	free(hs);
+}
+
+static void
+handshake_ready(int fd, int events, void *arg)
+{
+	struct handshake *hs = arg;
+	struct servsock_handle *h = hs->h;
+	int e;
+
+	if (handshake_ssl(h) == -1) {
+		e = errno;
+		if (e != EAGAIN) {
+			snprintf(sendbuf, sendbufsz,
+			    "TLS handshake from %s failed", hs->numhost);
+			logerror(sendbuf, e);
+			handshake_drop(hs);
+		}
+		return;
+	}
+
+	/* the player's own handler takes over the socket */
+	TAILQ_REMOVE(&handshakehead, hs, entries);
+	timer_cancel(&hs->timeout);
+	(void)event_del(fd);
+	if (player_admit(h, hs->host, hs->numhost, hs->port) == -1)
+		logerror("cannot add player", errno);
+	free(hs);
+}
+
+/* the same, when a shard does the handshake */
+static void
+handshake_event(struct servsock_handle *h, int what, char *text, size_t len,
+    int err, void *arg)
+{
+	struct handshake *hs = arg;
+
+	if (what == SHARD_GONE) {
+		snprintf(sendbuf, sendbufsz, "TLS handshake from %s failed",
+		    hs->numhost);
+		logerror(sendbuf, err);
+		handshake_drop(hs);
+		return;
+	}
+
+	if (what != SHARD_READY)
+		return;
+
+	TAILQ_REMOVE(&handshakehead, hs, entries);
+	timer_cancel(&hs->timeout);
+	if (player_admit(h, hs->host, hs->numhost, hs->port) == -1)
+		logerror("cannot add player", errno);
+	free(hs);
+}
+
+/* a TLS client that is taking too long to connect */
+static void
+handshake_expire(void *arg)
+{
+	struct handshake *hs = arg;
+
+	snprintf(sendbuf, sendbufsz, "TLS handshake from %s timed out",
+	    hs->numhost);
+	logmsg(sendbuf);
+	handshake_drop(hs);
+}
+
+int
+newplayer(struct servsock_handle *ssh)
+{
+	struct servsock_handle *h;
+	struct handshake *hs, tmp = { 0 };
+	int err = 0, rc;
+
+	h = acceptcon_ssl(ssh, tmp.host, sizeof(tmp.host), tmp.numhost,
+	    sizeof(tmp.numhost), &tmp.port);
+	if (!h) {
+		err = errno;
+		/* an empty backlog, or a refusal that admit_check() logged */
+		if ((err != EAGAIN) && (err != EWOULDBLOCK) &&
+		    (err != ECONNREFUSED))
+			logerror("acceptcon_ssl() failed", err);
+		errno = err;
+		return -1;
+	}
+
+	if (!h->handshaking)
+		return player_admit(h, tmp.host, tmp.numhost, tmp.port);
+
+	hs = malloc(sizeof(*hs));
+	if (!hs) {
+		(void)closesock_ssl(h);
+		errno = ENOMEM;
+		return -1;
+	}
+	*hs = tmp;
+	hs->h = h;
+
+	if (shard_count())
+		rc = shard_adopt(h, handshake_event, hs);
+	else
+		rc = event_add(h->sock, EVENT_READ, handshake_ready, hs);
+	if (rc == -1) {
+		err = errno;
+		logerror("can't watch connection", err);
+		(void)closesock_ssl(h);
+		free(hs);
+		errno = err;
+		return -1;
+	}
+	TAILQ_INSERT_TAIL(&handshakehead, hs, entries);
+	timer_set(&hs->timeout, SERVSOCK_HANDSHAKE_TIMEOUT * 1000,
+	    handshake_expire, hs);
+
+	errno = 0;
+	return 0;
+}
+
+/* The shards have stopped, so the main thread watches every socket now.  A
+ * handshake that a shard finished is admitted when its report is passed on,
+ * see shard_stop().
+ */
+static void
+player_reclaim(void)
+{
+	struct servsock_handle *h;
+	struct splayer *pplayer;
+	struct handshake *hs;
+
+	SLIST_FOREACH(pplayer, &playerhead, entries) {
+		h = pplayer->h;
+		h->shard = NULL;
+		if (PLAYER_HAS(LEAVING, pplayer))
+			continue;
+		/* output the shard couldn't send yet waits for writability */
+		if ((event_add(h->sock, EVENT_READ, player_ready, pplayer) ==
+			-1) ||
+		    (flushtosock_ssl(h) == -1))
+			player_leave(pplayer);
+	}
+
+	TAILQ_FOREACH(hs, &handshakehead, entries) {
+		hs->h->shard = NULL;
+		/* one that fails here is dropped by handshake_expire() */
+		if (hs->h->handshaking &&
+		    (event_add(hs->h->sock, EVENT_READ, handshake_ready, hs) ==
+			-1))
+			logerror("can't take back a handshake", errno);
+	}
+}
+
+/* Serves every connection from the main thread from now on, e.g., before an
+ * upgrade (see upgrade.c).
+ */
 void
-sendall(char *message, struct channel *channel, struct splayer *who)
+player_unshard(void)
+{
+	shard_stop(player_reclaim);
+}
+
+/* A message to many players is formatted once for each wrap column in use,
+ * and each player's output queue shares that copy.
+ */
+#define BROADCAST_WIDTHS 4
+
+struct broadcast {
+	char *text;
+	struct splayer *sender; /* for gag checks, NULL if not from a player */
+	struct servsock_msg *plain;
+	struct {
+		int width;
+		struct servsock_msg *msg;
+	} wrapped[BROADCAST_WIDTHS];
+	int nwrapped;
+};
+
+/* returns a reference that the caller must drop */
+static struct servsock_msg *
+broadcast_getmsg(struct broadcast *bc, struct splayer *who)
+{
+	struct servsock_msg *msg;
+	int i;
+
+	if (!PLAYER_HAS(WRAP, who)) {
+		if (!bc->plain)
+			bc->plain = servsock_msg_new(bc->text);
+		return (bc->plain) ? servsock_msg_ref(bc->plain) : NULL;
+	}
+
+	for (i = 0; i < bc->nwrapped; i++)
+		if (bc->wrapped[i].width == who->wrap)
+			return servsock_msg_ref(bc->wrapped[i].msg);
+
+	msg = servsock_msg_new(wrap(bc->text, who->wrap));
+	if (msg && (bc->nwrapped < BROADCAST_WIDTHS)) {
+		bc->wrapped[bc->nwrapped].width = who->wrap;
+		bc->wrapped[bc->nwrapped++].msg = servsock_msg_ref(msg);
+	}
+	return msg;
+}
+
+static void
+broadcast_send(struct broadcast *bc, struct splayer *who)
+{
+	struct servsock_msg *msg;
+	int e;
+
+	if (PLAYER_HAS(LEAVING, who))
+		return;
+
+	if (bc->sender && isgagged(who, bc->sender))
+		return; /* do not alert gagged player */
+
+	msg = broadcast_getmsg(bc, who);
+	if (!msg || (outmsgtosock_ssl(who->h, msg) == -1)) {
+		e = errno;
+		logerror("outmsgtosock_ssl() failed", e);
+		player_leave(who);
+	}
+	servsock_msg_unref(msg);
+}
+
+static void
+broadcast_done(struct broadcast *bc)
+{
+	int i;
+
+	servsock_msg_unref(bc->plain);
+	for (i = 0; i < bc->nwrapped; i++)
+		servsock_msg_unref(bc->wrapped[i].msg);
+}
+
+static void
+broadcast(struct broadcast *bc, struct channel *channel, struct splayer *who)
 {
 	struct splayer *buf;
 
+	if ((channel != ALL) && (channel != INFORMATIONAL) &&
+	    (channel != ARRIVAL) && (channel != YELL) &&
+	    (channel != DEPARTURE)) {
+		/* a real channel, only its members need to be visited */
+		if (channel)
+			LIST_FOREACH(buf, &channel->members, chanentries)
+				broadcast_send(bc, buf);
+		return;
+	}
+
 	SLIST_FOREACH(buf, &playerhead, entries) {
 		if (channel == ALL)
-			sendtoplayer(buf, message);
+			broadcast_send(bc, buf);
 		else if (channel == INFORMATIONAL) {
 			if (PLAYER_HAS(INFO, buf))
-				sendtoplayer(buf, message);
+				broadcast_send(bc, buf);
 		} else if (channel == ARRIVAL) {
 			if (PLAYER_HAS(MSG, buf))
-				sendtoplayer(buf, message);
+				broadcast_send(bc, buf);
 		} else if (channel == YELL) {
 			if (!PLAYER_HAS(HUSH, buf))
-				sendtoplayer(buf, message);
+				broadcast_send(bc, buf);
 		} else if (channel == DEPARTURE) {
-			/* Un-gag the leaving player for the player we
-			 * are processing. */
-			player_removegag(buf, who);
-			if (buf->dotspeeddial == who)
-				buf->dotspeeddial = NULL;
-
 			if (PLAYER_HAS(MSG, buf))
-				sendtoplayer(buf, message);
-		} else if (buf->chnl == channel)
-			sendtoplayer(buf, message);
+				broadcast_send(bc, buf);
+		}
 	}
 }
 
+/* for messages that aren't speech, see deliver() for speech */
+void
+sendall(char *message, struct channel *channel, struct splayer *who)
+{
+	struct broadcast bc = { 0 };
+
+	bc.text = message;
+	broadcast(&bc, channel, who);
+	broadcast_done(&bc);
+}
+
+/* Speech to the sender's channel by default.  The caller sets the target
+ * for SPEECH_PRIVATE.
+ */
+void
+envelope_init(struct envelope *env, struct splayer *sender, speechmode mode,
+    char *text)
+{
+	memset(env, 0, sizeof(*env));
+	env->sender = player_handle(sender);
+	env->mode = mode;
+	env->channel = sender->chnl;
+	env->text = text;
+}
+
+/* Delivers speech to everyone who should hear it and hasn't gagged the
+ * sender.
+ */
 int
-setfds(fd_set *needread, bool removeplayers)
+deliver(struct envelope *env)
 {
-	struct splayer *curr;
-	int max = 0;
+	struct broadcast bc = { 0 };
+	struct splayer *target;
 
-again:
-	SLIST_FOREACH(curr, &playerhead, entries) {
-		if (removeplayers && PLAYER_HAS(LEAVING, curr)) {
-			removeplayer(curr);
-			goto again;
+	bc.sender = player_deref(env->sender);
+	if (!bc.sender) {
+		errno = ENOENT;
+		return -1;
+	}
+	bc.text = env->text;
+
+	switch (env->mode) {
+	case SPEECH_PRIVATE:
+		target = player_deref(env->target);
+		if (!target) {
+			errno = ENOENT;
+			return -1;
 		}
-		if (curr->h->sock > max)
-			max = curr->h->sock;
-		FD_SET(curr->h->sock, needread);
+		broadcast_send(&bc, target);
+		break;
+	case SPEECH_YELL:
+		broadcast(&bc, YELL, NULL);
+		break;
+	case SPEECH_NORMAL:
+	default:
+		broadcast(&bc, env->channel, NULL);
 	}
 
-	return max;
+	broadcast_done(&bc);
+	errno = 0;
+	return 0;
 }
 
+/* handles one line of input from a player, or forced on them */
 void
-processinput(struct splayer *pplayer)
+processinput(struct splayer *pplayer, char *line)
 {
-	time_t tmptime;
-	char *myptr = pplayer->pbuf;
-	char *line;
 	char buf[OBUFSIZE];
 
-	tmptime = time((time_t *)0);
-	pplayer->idle = tmptime;
-
-	while ((line = strtok(myptr, "\r\n"))) {
-		myptr = (char *)0;
-
-		if (!(pplayer->privs & CANPLAY)) {
-			snprintf(buf, sizeof(buf), "spammer %s: %s",
-			    pplayer->host, line);
-			handlecommand(pplayer, line);
-			if (!(pplayer->privs & CANPLAY))
-				logmsg(buf);
-			continue;
-		}
+	pplayer->idle = timer_now();
 
+	if (!(pplayer->privs & CANPLAY)) {
+		snprintf(buf, sizeof(buf), "spammer %s: %s", pplayer->host,
+		    line);
 		handlecommand(pplayer, line);
+		if (!(pplayer->privs & CANPLAY))
+			logmsg(buf);
+		return;
 	}
+
+	handlecommand(pplayer, line);
 }
 
-int
-defrag(struct splayer *pplayer, int inbytes, char *recvbuf, size_t recvbufsz)
+/* Appends what a player sent to their partial line in pbuf, and passes each
+ * complete line to processinput().  Only the bytes that just arrived are
+ * scanned for newlines, and only a trailing partial line is moved to the
+ * front of pbuf afterwards.  A line that doesn't fit in pbuf is handled in
+ * pieces.  All of the state is in the player, so this is reentrant.
+ *
+ * cleanupbuf() has already turned CRs into LFs, and empty lines are
+ * dropped, so CRLF, LF and CR line endings all work.
+ */
+static void
+frameinput(struct splayer *pplayer, const char *in, size_t inlen)
 {
-	char *iptr;
-	char *bufptr;
+	char *pbuf = pplayer->pbuf;
+	const size_t pbsz = sizeof(pplayer->pbuf) - 1; /* room for a NUL */
+	size_t n, start, scan;
 	char *eol;
-	int pbsz = sizeof(pplayer->pbuf);
-	int pblen;
-
-	iptr = recvbuf;
-
-	while (inbytes > 0) {
-		bufptr = strchr(pplayer->pbuf, (char)0);
-		pblen = bufptr - pplayer->pbuf;
-
-		int copied = strlcat(bufptr, iptr, pbsz - pblen);
-
-		inbytes -= copied;
-		pblen += copied;
-		iptr += copied;
-		eol = strrchr(pplayer->pbuf, '\n');
-		if (eol || (pblen >= pbsz)) {
-			if (eol) {
-				*eol++ = (char)0;
-				pblen = pblen - (eol - pplayer->pbuf);
-			} else
-				pblen = 0;
-
-			processinput(pplayer);
-			if (PLAYER_HAS(LEAVING, pplayer)) {
-				snprintf(sendbuf, sendbufsz,
-				    "player %d is leaving",
-				    player_getline(pplayer));
-				logmsg(sendbuf);
-				break;
-			}
 
-			if (eol) {
-				memmove(pplayer->pbuf, eol, pblen);
-				memset(&pplayer->pbuf[pblen], 0, pbsz - pblen);
-			} else
-				memset(pplayer->pbuf, 0, pbsz);
+	while (inlen > 0) {
+		n = pbsz - pplayer->pblen;
+		if (n > inlen)
+			n = inlen;
+		memcpy(&pbuf[pplayer->pblen], in, n);
+		scan = pplayer->pblen;
+		pplayer->pblen += n;
+		in += n;
+		inlen -= n;
+
+		start = 0;
+		while ((eol = memchr(&pbuf[scan], '\n', pplayer->pblen - scan))) {
+			*eol = (char)0;
+			if (eol != &pbuf[start])
+				processinput(pplayer, &pbuf[start]);
+			if (PLAYER_HAS(LEAVING, pplayer))
+				goto leaving;
+			start = scan = (eol - pbuf) + 1;
+		}
+
+		if (start) {
+			pplayer->pblen -= start;
+			memmove(pbuf, &pbuf[start], pplayer->pblen);
+		} else if (pplayer->pblen == pbsz) {
+			pbuf[pbsz] = (char)0;
+			pplayer->pblen = 0;
+			processinput(pplayer, pbuf);
+			if (PLAYER_HAS(LEAVING, pplayer))
+				goto leaving;
 		}
 	}
-	return inbytes;
+	return;
+
+leaving:
+	snprintf(sendbuf, sendbufsz, "player %d is leaving",
+	    player_getline(pplayer));
+	logmsg(sendbuf);
 }
 
 void
-handleinput(fd_set needread)
+handleinput(struct splayer *pplayer)
 {
-	struct splayer *pplayer;
 	int inbytes;
 
-	SLIST_FOREACH(pplayer, &playerhead, entries) {
-		if (!FD_ISSET(pplayer->h->sock, &needread))
-			continue;
+	do {
+		inbytes = recvfromplayer(pplayer);
 
+		if (inbytes == -1) {
+			player_leave(pplayer);
+			break;
+		}
+
+		frameinput(pplayer, recvbuf, inbytes);
 		if (PLAYER_HAS(LEAVING, pplayer))
-			continue;
+			break;
+		/* stop reading until they catch up on their output, but not
+		 * with input that TLS has taken from the socket
+		 */
+	} while ((inbytes > 0) &&
+	    (!pplayer->h->throttled || pendingsock_ssl(pplayer->h)));
+}
+
+/* the event handler for a player's socket */
+static void
+player_ready(int fd, int events, void *arg)
+{
+	struct splayer *pplayer = arg;
 
-		do {
-			inbytes = recvfromplayer(pplayer);
+	if (PLAYER_HAS(LEAVING, pplayer))
+		return;
 
-			if (inbytes == -1) {
-				PLAYER_SET(LEAVING, pplayer);
-				continue;
-			}
+	/* TLS stalled a read until the socket was writable, or a write until
+	 * it was readable.  Now both can be retried.
+	 */
+	if (pplayer->h->sslwant) {
+		pplayer->h->sslwant = 0;
+		events = EVENT_READ | EVENT_WRITE;
+	}
 
-			defrag(pplayer, inbytes, recvbuf, recvbufsz);
-			if (PLAYER_HAS(LEAVING, pplayer)) {
-				PLAYER_SET(LEAVING, pplayer);
-				break;
-			}
-		} while (inbytes > 0);
+	if ((events & EVENT_WRITE) && (flushtosock_ssl(pplayer->h) == -1)) {
+		player_leave(pplayer);
+		return;
+	}
+
+	if (events & EVENT_READ)
+		handleinput(pplayer);
+}
+
+/* the shard handler for a player's connection, see shard.c */
+static void
+player_event(struct servsock_handle *h, int what, char *text, size_t len,
+    int err, void *arg)
+{
+	struct splayer *pplayer = arg;
+
+	if (PLAYER_HAS(LEAVING, pplayer))
+		return;
+
+	if (what == SHARD_GONE) {
+		player_leave(pplayer);
+		return;
 	}
+
+	if (what != SHARD_INPUT)
+		return;
+
+	/* the shard checked the text, but doesn't know who can use caps */
+	if (!(pplayer->privs & CANCAPS))
+		utf8_sanitize(text, len, true);
+	frameinput(pplayer, text, len);
+}
+
+/* Marks a player to be removed by player_reap() once the current event has
+ * been handled.  Removing them right away could free a player that a caller
+ * further up the stack is still using, e.g., while sendall() walks the list.
+ */
+void
+player_leave(struct splayer *pplayer)
+{
+	if (PLAYER_HAS(LEAVING, pplayer))
+		return;
+
+	PLAYER_SET(LEAVING, pplayer);
+	TAILQ_INSERT_TAIL(&reaphead, pplayer, reapq);
+}
+
+void
+player_reap(void)
+{
+	struct splayer *pplayer;
+
+	/* removeplayer() can cause more players to leave */
+	while ((pplayer = TAILQ_FIRST(&reaphead)))
+		removeplayer(pplayer);
 }
 
 void
@@ -359,8 +1072,11 @@ removeplayer(struct splayer *player)
 {
 	int count;
 
+	if (PLAYER_HAS(LEAVING, player))
+		TAILQ_REMOVE(&reaphead, player, reapq);
+
 	if (player->chnl) {
-		count = channel_deref(player->chnl);
+		count = channel_leave(player->chnl, player);
 
 		if ((count <= 0) && !channel_persists(player->chnl))
 			channel_del(player->chnl);
@@ -379,6 +1095,12 @@ removeplayer(struct splayer *player)
 			sendall(sendbuf, DEPARTURE, player);
 	}
 
+	player_dropgags(player);
+	resolver_cancel(player);
+	timer_cancel(&player->idler);
+	(void)event_del(player->h->sock);
+	if (linetab[player->h->sock].player == player)
+		linetab[player->h->sock].player = NULL;
 	closesock_ssl(player->h);
 
 	struct splayer *curr, *prev = NULL;
@@ -409,7 +1131,7 @@ kill_all_players(struct splayer *pplayer, char *buf)
 
 	SLIST_FOREACH(curr, &playerhead, entries)
 		if (curr->seclevel < SUPREME)
-			PLAYER_SET(LEAVING, curr);
+			player_leave(curr);
 
 	return PARSE_OK;
 }
@@ -596,94 +1318,14 @@ wholist3(struct splayer *pplayer)
 	return PARSE_OK;
 }
 
-// clang-format off
-static char badchars[] = {
-	0x01, /* SOH */
-	0x02, /* STX */
-	0x03, /* ETX aka ^D aka EOF */
-	0x04, /* EOT */
-	0x05, /* ENQ */
-	0x06, /* ACK */
-	0x07, /* BEL */
-	0x08, /* BS */
-	/* 0x09, HT */
-	/* 0x0a, LF */
-	0x0b, /* VT */
-	0x0c, /* FF */
-	/* 0x0d, CR */
-	0x0e, /* SO */
-	0x0f, /* SI */
-	0x10, /* DLE */
-	0x11, /* DC1 aka ^Q */
-	0x12, /* DC2 */
-	0x13, /* DC3 aka ^S */
-	0x14, /* DC4 */
-	0x15, /* NAK */
-	0x16, /* SYN */
-	0x17, /* ETB */
-	0x18, /* CAN */
-	0x19, /* EM */
-	0x1a, /* SUB */
-	0x1b, /* ESC */
-	0x1c, /* FS */
-	0x1d, /* GS */
-	0x1e, /* RS */
-	0x1f, /* US */
-	0x00  /* Terminate the string */
-};
-// clang-format on
-
 int
 cleanupbuf(char *inbuf, size_t inbufsz, bool removecaps)
 {
-	iconv_t cd;
-	size_t rc;
-	char buf[2 * inbufsz];
-	size_t ileft = strnlen(inbuf, inbufsz - 1);
-	size_t oleft = sizeof(buf) - 1;
-	char *op = buf;
-	char *ip = inbuf;
-
-	memset(buf, 0, sizeof(buf));
-
-	cd = iconv_open("UTF-8", "UTF-8");
-	if (cd == (iconv_t)-1)
-		err(EX_SOFTWARE, "iconv_open");
-
-	while (ileft && oleft) {
-		rc = iconv(cd, &ip, &ileft, &op, &oleft);
-		if (rc == (size_t)-1) {
-			assert(errno != E2BIG);
-			if (errno == EINVAL || errno == EILSEQ) {
-				if (oleft) {
-					*op = '.';
-					op++;
-				}
-				ileft--;
-				ip++;
-			}
-		}
-	}
-
-	/* strip bad characters */
-	op = buf;
-	while (op)
-		if ((op = strpbrk(op, badchars)))
-			*op = '.';
-
-	op = buf;
-	while (op)
-		if ((op = strchr(op, '\r')))
-			*op = '\n';
+	size_t len = strnlen(inbuf, inbufsz - 1);
 
-	if (removecaps)
-		for (size_t i = 0; i < strnlen(buf, sizeof(buf)); ++i)
-			if (isascii(buf[i]))
-				buf[i] = tolower(buf[i]);
-
-	rc = strlcpy(inbuf, buf, inbufsz);
-	iconv_close(cd);
-	return rc;
+	inbuf[len] = (char)0;
+	utf8_sanitize(inbuf, len, removecaps);
+	return len;
 }
 
 int
@@ -706,11 +1348,12 @@ recvfromplayer(struct splayer *who)
 int
 isgagged(struct splayer *who, struct splayer *sender)
 {
-	int line = player_getline(sender);
-	if ((line < 1) || (line >= MAXCONN))
-		return 0;
-	else
-		return (FD_ISSET(line, &who->gags));
+	bool found = false;
+
+	if (who->gags.count)
+		(void)gagset_search(&who->gags, player_handle(sender), &found);
+
+	return found;
 }
 
 char *
@@ -756,33 +1399,18 @@ wrap(char *s, int w)
 int
 sendtoplayer(struct splayer *who, char *message)
 {
-	int line;
-	int end = 1;
 	int e;
 
 	if (PLAYER_HAS(LEAVING, who))
 		return 0;
 
-	if (message[0] == '(') {
-		struct splayer *sender;
-
-		while (!isdigit(message[end]) && message[end])
-			end++;
-		line = atoi(&message[end]);
-		sender = player_lookup(line);
-		if (!sender)
-			return 0;
-		if (isgagged(who, sender))
-			return 0; /* do not alert gagged player */
-	}
-
 	if (outtosock_ssl(who->h,
 		PLAYER_HAS(WRAP, who) ? wrap(message, who->wrap) : message) ==
 	    -1) {
 		e = errno;
 		logerror("outtosock_ssl() failed", e);
 		errno = e;
-		PLAYER_SET(LEAVING, who);
+		player_leave(who);
 		return -1;
 	}
 	return 0;
@@ -835,17 +1463,10 @@ welcomeplayer(struct splayer *pplayer)
 struct splayer *
 player_lookup(int linenum)
 {
-	struct splayer *tmp;
-
-	if (linenum == 0)
+	if ((linenum <= 0) || (linenum >= nlines))
 		return (struct splayer *)0;
 
-	SLIST_FOREACH(tmp, &playerhead, entries) {
-		if (tmp->h->sock == linenum)
-			return tmp;
-	}
-
-	return (struct splayer *)0;
+	return linetab[linenum].player;
 }
 
 struct splayer *
@@ -43,26 +43,48 @@ extern int numconnect;
 
 struct servsock_handle;
 
-void handleinput(fd_set needread);
+/* speech from a player, see deliver() */
+struct envelope {
+	struct player_handle sender;
+	speechmode mode;
+	struct channel *channel;     /* for SPEECH_NORMAL */
+	struct player_handle target; /* for SPEECH_PRIVATE */
+	char *text;		     /* formatted for the recipients */
+};
+
+void handleinput(struct splayer *pplayer);
+int deliver(struct envelope *env);
+void envelope_init(struct envelope *env, struct splayer *sender,
+    speechmode mode, char *text);
 char *idlet(time_t idle);
 void initplayerstruct(void);
 int isgagged(struct splayer *recipient, struct splayer *sender);
 parse_error kill_all_players(struct splayer *pplayer, char *buf);
 int newplayer(struct servsock_handle *ssh);
 int numconnected();
+struct splayer *player_deref(struct player_handle ph);
 struct splayer *player_find(const char *name);
+int player_gag(struct splayer *pplayer, struct splayer *target);
+struct player_handle player_handle(struct splayer *pplayer);
+void player_leave(struct splayer *pplayer);
 struct splayer *player_lookup(int linenum);
+void player_reap(void);
+int player_restore(struct splayer *pplayer);
+void player_removegag(struct splayer *pplayer, struct splayer *target);
+int player_setidlelimit(int minutes);
+void player_unshard(void);
+int player_walk(int (*func)(struct splayer *pplayer, void *arg), void *arg);
 void playerinit(struct splayer *who, time_t when, char *where, char *numwhere);
-void processinput(struct splayer *pplayer);
+void processinput(struct splayer *pplayer, char *line);
 int recvfromplayer(struct splayer *who);
 void removeplayer(struct splayer *player);
 void sendall(char *message, struct channel *channel, struct splayer *who);
 int sendtoplayer(struct splayer *who, char *message);
-int setfds(fd_set *needread, bool removeplayers);
 int setname(struct splayer *pplayer, char *name); // BUG:set_name() vs
 						  // setname()?
 int welcomeplayer(struct splayer *pplayer);
 parse_error wholist(struct splayer *pplayer, char *instring);
 parse_error wholist2(struct splayer *pplayer, char *instring);
 parse_error wholist3(struct splayer *pplayer);
+char *wrap(char *s, int w);
 int player_getline(struct splayer *pplayer);
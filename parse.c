@@ -60,6 +60,9 @@ parser_search_table(struct parse_context *context, char *pattern,
 {
 	trie *leaf;
 
+	if (context->match)
+		return context->match(pattern, matched);
+
 	leaf = trie_match(context->index, (unsigned char *)pattern,
 	    strlen(pattern), matched, trie_match_fuzzy);
 
@@ -89,6 +92,7 @@ parser_new_dyncontext(struct command *commands)
 
 	if (ctxp) {
 		if ((ctxp->index = trie_new())) {
+			ctxp->match = NULL;
 			ctxp->numentries = 0;
 			ctxp->isdynamic = true;
 			ctxp->commands = commands;
@@ -159,12 +163,34 @@ parser_init_context(struct parse_context *context, struct parse_key *table,
 	}
 
 	context->numentries = parser_count_table_entries(table);
+	context->match = NULL;
 	context->commands = commands;
 	context->isdynamic = isdynamic;
 
 	return 1;
 }
 
+/* a context for a table that's known when lorien is built, such as
+ * default_parse_table, which mkcmdtab made match() for.  there's nothing
+ * to allocate, so it can't fail.
+ */
+int
+parser_init_compiled(struct parse_context *context, struct parse_key *table,
+    struct parse_key *(*match)(const char *buf, size_t *matched),
+    struct command *commands)
+{
+	if (!(context && table && match && commands))
+		return 0;
+
+	context->index = NULL;
+	context->match = match;
+	context->numentries = parser_count_table_entries(table);
+	context->commands = commands;
+	context->isdynamic = false;
+
+	return 1;
+}
+
 int
 parser_execute(struct splayer *pplayer, char *buf,
     struct parse_context *context)
@@ -188,9 +214,12 @@ parser_execute(struct splayer *pplayer, char *buf,
 			/* redirect to channel */
 			buf++; /* skip the '>' */
 		}
+		struct envelope env;
+
 		snprintf(sendbuf, sendbufsz, "(%d, %s) %s\r\n",
 		    player_getline(pplayer), pplayer->name, buf);
-		sendall(sendbuf, pplayer->chnl, 0);
+		envelope_init(&env, pplayer, SPEECH_NORMAL, sendbuf);
+		deliver(&env);
 		return PARSE_OK;
 	}
 
@@ -204,31 +233,25 @@ parser_execute(struct splayer *pplayer, char *buf,
 		return PARSERR_SUPPRESS;
 	}
 
-	char (*p)(struct splayer *pplayer);
-	char (*p2)(struct splayer *pplayer, char *buf);
-	char (*p3)(struct splayer *pplayer, char *buf, speechmode mode);
+	struct command *cmd = &context->commands[entry->cmd];
 
-	p = (void *)context->commands[entry->cmd].func;
-	p2 = (void *)context->commands[entry->cmd].func;
-	p3 = (void *)context->commands[entry->cmd].func;
-
-	switch (context->commands[entry->cmd].class) {
+	switch (cmd->class) {
 	case cmd_class_0:
-		switch (context->commands[entry->cmd].numargs) {
+		switch (cmd->numargs) {
 		case 2:
-			rc = (parse_error)p2(pplayer, buf + matched);
+			rc = cmd->func.text(pplayer, buf + matched);
 			break;
 		case 1:
-			rc = (parse_error)p(pplayer);
+			rc = cmd->func.bare(pplayer);
 			break;
 		default:
 			rc = PARSERR_NUMARGS;
 		}
 		break;
 	case cmd_class_1:
-		switch (context->commands[entry->cmd].numargs) {
+		switch (cmd->numargs) {
 		case 3:
-			rc = (parse_error)p3(pplayer, buf + matched,
+			rc = cmd->func.speech(pplayer, buf + matched,
 			    SPEECH_NORMAL);
 			break;
 		default:
@@ -243,3 +266,195 @@ parser_execute(struct splayer *pplayer, char *buf,
 
 	return (rc == PARSERR_SUPPRESS) ? PARSE_OK : rc;
 }
+
+#ifdef TESTPARSE
+#include <assert.h>
+#include <time.h>
+
+/* the table commands.c makes, without the rest of commands.c */
+struct parse_key default_parse_table[] = {
+#define PARSE_KEY(token, cmd) { token, cmd },
+#include "cmdtab.h"
+#undef PARSE_KEY
+	{ "", 0 },
+};
+
+static struct command testcommands[CMD_ZZZMAXPLUS1 + 1];
+static int ncalls;
+
+int
+sendtoplayer(struct splayer *who, char *buf)
+{
+	return 0;
+}
+
+parse_error
+yell(struct splayer *pplayer, char *buf)
+{
+	return PARSE_OK;
+}
+
+void
+envelope_init(struct envelope *env, struct splayer *sender, speechmode mode,
+    char *text)
+{
+}
+
+int
+deliver(struct envelope *env)
+{
+	return 0;
+}
+
+int
+player_getline(struct splayer *pplayer)
+{
+	return 0;
+}
+
+static parse_error
+count_text(struct splayer *pplayer, char *buf)
+{
+	ncalls++;
+	return PARSE_OK;
+}
+
+static parse_error
+count_speech(struct splayer *pplayer, char *buf, speechmode mode)
+{
+	ncalls++;
+	return PARSE_OK;
+}
+
+/* both contexts find the same entry and stop in the same place */
+static void
+same(struct parse_context *a, struct parse_context *b, char *s)
+{
+	struct parse_key *ka, *kb;
+	size_t ma = 0, mb = 0;
+
+	ka = parser_search_table(a, s, &ma);
+	kb = parser_search_table(b, s, &mb);
+	if ((ka != kb) || (ma != mb))
+		printf("\n|%s|: trie %s %zu, compiled %s %zu\n", s,
+		    ka ? ka->token : "none", ma, kb ? kb->token : "none", mb);
+	assert(ka == kb);
+	assert(ma == mb);
+}
+
+static double
+elapsed(struct timespec *t0)
+{
+	struct timespec t1;
+
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	return (t1.tv_sec - t0->tv_sec) + (t1.tv_nsec - t0->tv_nsec) / 1e9;
+}
+
+/* ns for each command, from the line to the handler */
+static double
+dispatch(struct parse_context *ctx, struct splayer *pplayer, int rounds)
+{
+	char lines[CMD_ZZZMAXPLUS1 * 2][PARSE_KEY_MAX + 8];
+	struct timespec t0;
+	struct parse_key *k;
+	int i, n = 0;
+
+	/* each token in the table, with something after */
+	for (k = default_parse_table; k->token[0]; k++) {
+		if (n == sizeof(lines) / sizeof(lines[0]))
+			break;
+		snprintf(lines[n++], sizeof(lines[0]), "%.*s two",
+		    PARSE_KEY_MAX, k->token);
+	}
+
+	ncalls = 0;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (i = 0; i < rounds * n; i++)
+		parser_execute(pplayer, lines[i % n], ctx);
+	assert(ncalls == rounds * n);
+	return elapsed(&t0) * 1e9 / (rounds * n);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct parse_context trie_ctx, compiled_ctx;
+	struct splayer player;
+	struct parse_key *k;
+	char buf[PARSE_KEY_MAX + 8];
+	size_t i, len;
+	int c, n;
+
+	for (c = 0; c < CMD_ZZZMAXPLUS1; c++) {
+		testcommands[c].cmd = c;
+		testcommands[c].seclevel = JOEUSER;
+		testcommands[c].name = "test";
+		if (c == CMD_STAGEPOSE) {
+			testcommands[c].class = cmd_class_1;
+			testcommands[c].numargs = 3;
+			testcommands[c].func.speech = count_speech;
+		} else {
+			testcommands[c].class = cmd_class_0;
+			testcommands[c].numargs = 2;
+			testcommands[c].func.text = count_text;
+		}
+	}
+
+	printf("parse context test...");
+	fflush(stdout);
+	assert(parser_init_context(&trie_ctx, default_parse_table, testcommands,
+	    false));
+	assert(parser_init_compiled(&compiled_ctx, default_parse_table,
+	    cmdtab_match, testcommands));
+	assert(trie_ctx.numentries == compiled_ctx.numentries);
+	printf(" passed\n");
+
+	/* every abbreviation of every command, alone and followed by
+	 * something
+	 */
+	printf("compiled table matches trie test...");
+	fflush(stdout);
+	for (k = default_parse_table; k->token[0]; k++) {
+		len = strlen(k->token);
+		for (i = 0; i <= len; i++) {
+			memcpy(buf, k->token, i);
+			buf[i] = '\0';
+			same(&trie_ctx, &compiled_ctx, buf);
+			strlcpy(buf + i, "x", sizeof(buf) - i);
+			same(&trie_ctx, &compiled_ctx, buf);
+			strlcpy(buf + i, " arg", sizeof(buf) - i);
+			same(&trie_ctx, &compiled_ctx, buf);
+			strlcpy(buf + i, "\377", sizeof(buf) - i);
+			same(&trie_ctx, &compiled_ctx, buf);
+		}
+	}
+	printf(" passed\n");
+
+	/* strings of the bytes commands are made of */
+	printf("compiled table matches trie on random input test...");
+	fflush(stdout);
+	srandom(25);
+	for (n = 0; n < 200000; n++) {
+		len = random() % 12;
+		for (i = 0; i < len; i++) {
+			k = &default_parse_table[random() %
+			    parser_count_table_entries(default_parse_table)];
+			buf[i] = k->token[random() % strlen(k->token)];
+		}
+		buf[len] = '\0';
+		same(&trie_ctx, &compiled_ctx, buf);
+	}
+	printf(" passed\n");
+
+	memset(&player, 0, sizeof(player));
+	player.seclevel = JOEUSER;
+	printf("dispatch: trie %.0f ns, compiled %.0f ns a command\n",
+	    dispatch(&trie_ctx, &player, 20000),
+	    dispatch(&compiled_ctx, &player, 20000));
+
+	trie_collapse(trie_ctx.index, false);
+	printf("all tests passed\n");
+	return 0;
+}
+#endif
@@ -87,6 +87,7 @@
 enum {
 	CMD_ADDCHANNEL,
 	CMD_ADDPLAYER,
+	CMD_ADMIT,
 	CMD_BANADD,
 	CMD_BANDEL,
 	CMD_BANLIST,
@@ -131,6 +132,7 @@ enum {
 	CMD_SHUTDOWN,
 	CMD_STAGEPOSE,
 	CMD_TUNE,
+	CMD_UPGRADE,
 	CMD_UPTIME,
 	CMD_WHISPER,
 	CMD_WHO,
@@ -158,21 +160,35 @@ typedef enum parse_errors {
 	PARSERR_NOCLASS = -5 /* the class of the selected command is unknown */
 } parse_error;
 
+/* the handlers, one type for each class and number of arguments.  they
+ * return PARSERR codes from the enumeration, or PARSERR_SUPPRESS if they
+ * handled the error themselves.
+ */
+typedef parse_error (*cmd_bare)(struct splayer *pplayer);
+typedef parse_error (*cmd_text)(struct splayer *pplayer, char *buf);
+typedef parse_error (*cmd_speech)(struct splayer *pplayer, char *buf,
+    speechmode mode);
+
 struct command {
 	int cmd;   /* from the enum above */
-	int class; /* only supported is 0:  arg1=player, arg2=buffer */
+	int class; /* cmd_class_0 or cmd_class_1 */
 	int numargs;
 	int seclevel; /* minimum seclevel required to invoke command */
-	parse_error (
-	    *func)(); /* the handler, returns PARSERR codes from enumeration or
-			 PARSE_SUPPRESS if it handled error itself */
-	char *name;   /* for matching while dynamically defining parse tables */
+	union {
+		cmd_bare bare;	   /* class 0, 1 argument */
+		cmd_text text;	   /* class 0, 2 arguments */
+		cmd_speech speech; /* class 1, 3 arguments */
+	} func;
+	char *name; /* for matching while dynamically defining parse tables */
 };
 
-#define CMD_DECLS(cmd, class, num, lev, func) \
-	{ cmd, class, num, lev, func, #cmd }
-#define CMD_DECL(cmd, class, num, func) \
-	{ cmd, class, num, JOEUSER, (void *)func, #cmd }
+/* the handler has to be of the type for the class */
+#define CMD_BARE(cmd, lev, func) \
+	{ cmd, cmd_class_0, 1, lev, { .bare = func }, #cmd }
+#define CMD_TEXT(cmd, lev, func) \
+	{ cmd, cmd_class_0, 2, lev, { .text = func }, #cmd }
+#define CMD_SPEECH(cmd, lev, func) \
+	{ cmd, cmd_class_1, 3, lev, { .speech = func }, #cmd }
 
 enum { PARSE_KEY_MAX = 50 };
 
@@ -181,11 +197,13 @@ struct parse_key { /* maps text tokens to commands */
 	int cmd; /* from the enum above */
 };
 
+/* a table is found with index, or, if it was compiled in, with match */
 struct parse_context {
 	bool isdynamic;
 	size_t numentries;
 	/*     struct parse_key *table; */
 	trie *index;
+	struct parse_key *(*match)(const char *buf, size_t *matched);
 	struct command *commands;
 };
 
@@ -206,6 +224,11 @@ int parser_collapse_dyncontext(struct parse_context *context);
 int parser_init_context(struct parse_context *context, struct parse_key *table,
     struct command *commands, bool isdynamic);
 
+int parser_init_compiled(struct parse_context *context,
+    struct parse_key *table,
+    struct parse_key *(*match)(const char *buf, size_t *matched),
+    struct command *commands);
+
 int parser_count_table_entries(struct parse_key *table);
 
 struct parse_key *parser_search_table(struct parse_context *, char *pattern,
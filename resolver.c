@@ -0,0 +1,262 @@
+/*
+ * Copyright 2025 Jillian Alana Bolton
+ *
+ * The BSD 2-Clause License
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *
+ *     2. Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* resolver.c - reverse DNS lookups that don't stop the server
+ *
+ * getnameinfo(3) can block for as long as the DNS server takes to answer,
+ * or time out.  Lookups are therefore handed to a thread, which does them
+ * one at a time and wakes the event loop through a pipe when each is done.
+ * The callback is then called from the event loop, so it runs on the main
+ * thread like everything else.
+ *
+ * Answers, including failures, are kept for a while in a small cache that
+ * is indexed by address.  Each address has one slot, so a new address can
+ * push out an old one.
+ *
+ * The worker only touches a request's queue links and its answer.  The
+ * list of outstanding requests, and their callbacks, belong to the main
+ * thread, so resolver_cancel() doesn't need the lock.
+ */
+
+#include <sys/queue.h>
+#include <sys/socket.h>
+
+#include <netinet/in.h>
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "event.h"
+#include "platform.h"
+#include "resolver.h"
+
+struct resolver_req {
+	STAILQ_ENTRY(resolver_req) queue; /* pending or done, under the lock */
+	LIST_ENTRY(resolver_req) entries; /* outstanding, main thread only */
+	struct in_addr addr;
+	resolver_callback func; /* NULL if cancelled */
+	void *arg;
+	bool found;
+	char host[NI_MAXHOST];
+};
+
+struct resolver_entry {
+	struct in_addr addr;
+	time_t expires; /* 0 if the slot is empty */
+	bool found;
+	char host[NI_MAXHOST];
+};
+
+STAILQ_HEAD(resolver_queue, resolver_req);
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wakeup = PTHREAD_COND_INITIALIZER;
+static struct resolver_queue pendingq = STAILQ_HEAD_INITIALIZER(pendingq);
+static struct resolver_queue doneq = STAILQ_HEAD_INITIALIZER(doneq);
+
+static LIST_HEAD(resolver_list, resolver_req) outstanding =
+    LIST_HEAD_INITIALIZER(outstanding);
+static struct resolver_entry cache[RESOLVER_CACHE];
+static int notify[2] = { -1, -1 }; /* the worker writes, the loop reads */
+
+static struct resolver_entry *
+resolver_slot(struct in_addr addr)
+{
+	uint32_t h = addr.s_addr;
+
+	/* mix the octets, neighbours shouldn't share a slot */
+	h ^= h >> 16;
+	h *= 0x45d9f3b;
+	h ^= h >> 16;
+	return &cache[h & (RESOLVER_CACHE - 1)];
+}
+
+static void *
+resolver_worker(void *unused)
+{
+	struct resolver_req *req;
+	struct sockaddr_in sin;
+	char c = 0;
+
+	for (;;) {
+		pthread_mutex_lock(&lock);
+		while (!(req = STAILQ_FIRST(&pendingq)))
+			pthread_cond_wait(&wakeup, &lock);
+		STAILQ_REMOVE_HEAD(&pendingq, queue);
+		pthread_mutex_unlock(&lock);
+
+		memset(&sin, 0, sizeof(sin));
+		sin.sin_family = AF_INET;
+		sin.sin_addr = req->addr;
+		req->found = !getnameinfo((struct sockaddr *)&sin, sizeof(sin),
+		    req->host, sizeof(req->host), NULL, 0, NI_NAMEREQD);
+
+		pthread_mutex_lock(&lock);
+		STAILQ_INSERT_TAIL(&doneq, req, queue);
+		pthread_mutex_unlock(&lock);
+
+		/* if the pipe is full, the loop has been woken already */
+		(void)write(notify[1], &c, 1);
+	}
+	return NULL; /* NOTREACHED */
+}
+
+/* the event handler for the pipe, calls back for finished lookups */
+static void
+resolver_ready(int fd, int events, void *arg)
+{
+	struct resolver_queue done = STAILQ_HEAD_INITIALIZER(done);
+	struct resolver_entry *slot;
+	struct resolver_req *req;
+	char buf[64];
+
+	while (read(fd, buf, sizeof(buf)) > 0)
+		continue;
+
+	pthread_mutex_lock(&lock);
+	STAILQ_CONCAT(&done, &doneq);
+	pthread_mutex_unlock(&lock);
+
+	while ((req = STAILQ_FIRST(&done))) {
+		STAILQ_REMOVE_HEAD(&done, queue);
+		LIST_REMOVE(req, entries);
+
+		slot = resolver_slot(req->addr);
+		slot->addr = req->addr;
+		slot->found = req->found;
+		slot->expires = time(NULL) +
+		    ((req->found) ? RESOLVER_TTL : RESOLVER_NEGATIVE_TTL);
+		strlcpy(slot->host, req->host, sizeof(slot->host));
+
+		if (req->func)
+			req->func((req->found) ? req->host : NULL, req->arg);
+		free(req);
+	}
+}
+
+int
+resolver_init(void)
+{
+	pthread_t tid;
+	int rc;
+
+	if (notify[0] != -1)
+		return 0;
+
+	if (pipe(notify) == -1)
+		return -1;
+
+	if ((fcntl(notify[0], F_SETFL, O_NONBLOCK) == -1) ||
+	    (fcntl(notify[1], F_SETFL, O_NONBLOCK) == -1) ||
+	    (event_add(notify[0], EVENT_READ, resolver_ready, NULL) == -1))
+		goto fail;
+
+	rc = pthread_create(&tid, NULL, resolver_worker, NULL);
+	if (rc != 0) {
+		(void)event_del(notify[0]);
+		errno = rc;
+		goto fail;
+	}
+	pthread_detach(tid);
+	return 0;
+
+fail:
+	rc = errno;
+	close(notify[0]);
+	close(notify[1]);
+	notify[0] = notify[1] = -1;
+	errno = rc;
+	return -1;
+}
+
+/* Looks up the name of a numeric IPv4 address, and calls func with it.  If
+ * the answer is in the cache, func is called before this returns.
+ */
+int
+resolver_lookup(const char *numhost, resolver_callback func, void *arg)
+{
+	struct resolver_entry *slot;
+	struct resolver_req *req;
+	struct in_addr addr;
+
+	if (inet_pton(AF_INET, numhost, &addr) != 1) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	slot = resolver_slot(addr);
+	if (slot->expires && (slot->addr.s_addr == addr.s_addr) &&
+	    (slot->expires > time(NULL))) {
+		func((slot->found) ? slot->host : NULL, arg);
+		return 0;
+	}
+
+	if (notify[0] == -1) {
+		errno = ENXIO;
+		return -1;
+	}
+
+	req = calloc(1, sizeof(*req));
+	if (!req) {
+		errno = ENOMEM;
+		return -1;
+	}
+	req->addr = addr;
+	req->func = func;
+	req->arg = arg;
+	LIST_INSERT_HEAD(&outstanding, req, entries);
+
+	pthread_mutex_lock(&lock);
+	STAILQ_INSERT_TAIL(&pendingq, req, queue);
+	pthread_cond_signal(&wakeup);
+	pthread_mutex_unlock(&lock);
+	return 0;
+}
+
+/* Forgets the callbacks for arg, e.g., because the player has left.  The
+ * lookups still finish, and their answers are still cached.
+ */
+void
+resolver_cancel(void *arg)
+{
+	struct resolver_req *req;
+
+	LIST_FOREACH(req, &outstanding, entries)
+		if (req->arg == arg)
+			req->func = NULL;
+}
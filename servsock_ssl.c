@@ -31,20 +31,24 @@
  * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
-#include <sys/time.h>
+#ifdef __linux__
+#define _GNU_SOURCE /* accept4(2) */
+#endif
 
 #include <netinet/tcp.h>
 
-#include <assert.h>
 #include <err.h>
 #include <sysexits.h>
 #include <unistd.h>
 
+#include "admit.h"
 #include "ban.h"
+#include "event.h"
 #include "log.h"
 #include "lorien.h"
 #include "platform.h"
 #include "servsock_ssl.h"
+#include "tls.h"
 #include "utility.h"
 
 #ifndef FNDELAY
@@ -55,6 +59,19 @@
 #define INADDR_NONE (int)-1
 #endif
 
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+#define SERVSOCK_CHUNK 4096 /* smallest allocation for queued output */
+
+static size_t lowat = SERVSOCK_LOWAT;
+static size_t hiwat = SERVSOCK_HIWAT;
+static int backlog = SERVSOCK_BACKLOG;
+
+static void servsock_dropqueue(struct servsock_handle *ssh);
+static void servsock_setevents(struct servsock_handle *ssh);
+
 static int
 decode_ssl_error(struct servsock_handle *ssh, int code)
 {
@@ -78,6 +95,13 @@ decode_ssl_error(struct servsock_handle *ssh, int code)
 		err = EAGAIN;
 		break;
 	case SSL_ERROR_SYSCALL:
+		/* the client hung up, which is no reason for the session cache
+		 * to forget its session
+		 */
+		if (SSL_is_init_finished(ssh->ssl))
+			SSL_set_shutdown(ssh->ssl,
+			    SSL_SENT_SHUTDOWN | SSL_RECEIVED_SHUTDOWN);
+		/* FALLTHROUGH */
 	case SSL_ERROR_SSL:
 		ssh->no_shutdown = true;
 		err = ENOTCONN;
@@ -89,15 +113,50 @@ decode_ssl_error(struct servsock_handle *ssh, int code)
 }
 
 static void
-alarmhandler(int s)
+pipehandler(int s)
 {
 	return;
 }
 
+/* the TLS side of a listening socket */
 static void
-pipehandler(int s)
+servsock_tlsctx(struct servsock_handle *ssh)
 {
-	return;
+	int rc;
+	struct sigaction newaction = { 0 };
+
+	ssh->use_ssl = true;
+
+	ssh->ctx = SSL_CTX_new(TLS_server_method());
+	if (!ssh->ctx)
+		err(EX_CANTCREAT, "can't create SSL context");
+
+	rc = SSL_CTX_set_min_proto_version(ssh->ctx, TLS1_2_VERSION);
+	if (!rc)
+		err(EX_SOFTWARE, "can't set minimum TLS version 1.2");
+
+	rc = SSL_CTX_use_certificate_file(ssh->ctx, "cert.pem",
+	    SSL_FILETYPE_PEM);
+	if (rc <= 0)
+		err(EX_NOINPUT, "can't open cert.pem");
+
+	rc = SSL_CTX_use_PrivateKey_file(ssh->ctx, "key.pem",
+	    SSL_FILETYPE_PEM);
+	if (rc <= 0)
+		err(EX_NOINPUT, "can't open key.pem");
+
+	if (tls_setup(ssh->ctx) == -1)
+		errx(EX_CONFIG, "bad TLS settings");
+
+	/* flushtosock_ssl() sends what it can and resumes later */
+	SSL_CTX_set_mode(ssh->ctx,
+	    SSL_MODE_ENABLE_PARTIAL_WRITE |
+		SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+
+	newaction.sa_handler = pipehandler;
+	rc = sigaction(SIGPIPE, &newaction, NULL);
+	if (rc != 0)
+		logerror("sigaction (SIGPIPE) failed", errno);
 }
 
 struct servsock_handle *
@@ -155,38 +214,16 @@ getsock_ssl(char *address, int port, bool use_ssl)
 		sizeof(struct sockaddr_in)) == -1)
 		err(EX_CANTCREAT, "Unable to bind port %d", port);
 
-	if (listen(ssh->sock, 5) == -1)
+	if (listen(ssh->sock, backlog) == -1)
 		err(EX_SOFTWARE, "listen() failed");
 
-	if (use_ssl) {
-		int rc;
-		struct sigaction newaction = { 0 };
-
-		ssh->use_ssl = use_ssl;
-
-		ssh->ctx = SSL_CTX_new(TLS_server_method());
-		if (!ssh->ctx)
-			err(EX_CANTCREAT, "can't create SSL context");
-
-		rc = SSL_CTX_set_min_proto_version(ssh->ctx, TLS1_2_VERSION);
-		if (!rc)
-			err(EX_SOFTWARE, "can't set minimum TLS version 1.2");
-
-		rc = SSL_CTX_use_certificate_file(ssh->ctx, "cert.pem",
-		    SSL_FILETYPE_PEM);
-		if (rc <= 0)
-			err(EX_NOINPUT, "can't open cert.pem");
+	/* so that acceptcon_ssl() can drain the backlog, see newplayer() */
+	if (fcntl(ssh->sock, F_SETFL, fcntl(ssh->sock, F_GETFL) | O_NONBLOCK) ==
+	    -1)
+		err(EX_OSERR, "can't make listening socket non-blocking");
 
-		rc = SSL_CTX_use_PrivateKey_file(ssh->ctx, "key.pem",
-		    SSL_FILETYPE_PEM);
-		if (rc <= 0)
-			err(EX_NOINPUT, "can't open key.pem");
-
-		newaction.sa_handler = pipehandler;
-		rc = sigaction(SIGPIPE, &newaction, NULL);
-		if (rc != 0)
-			logerror("sigaction (SIGPIPE) failed", errno);
-	}
+	if (use_ssl)
+		servsock_tlsctx(ssh);
 	return ssh;
 }
 
@@ -196,35 +233,58 @@ acceptcon_ssl(struct servsock_handle *ssh, char *from, int len, char *from2,
 {
 	int ns, e = 0;
 	socklen_t length = sizeof(struct sockaddr_in);
-	char *buf;
-	struct hostent *tmphost = NULL;
 	struct sockaddr_in saddr;
 	struct servsock_handle *ssc;
 
+	/* output is queued and flushed when the socket is writable, and the
+	 * TLS handshake is driven by the event loop, see handshake_ssl()
+	 */
+#ifdef SOCK_NONBLOCK
+	ns = accept4(ssh->sock, (struct sockaddr *)&saddr, &length,
+	    SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+	ns = accept(ssh->sock, (struct sockaddr *)&saddr, &length);
+#endif
+	if (ns == -1) {
+		e = errno;
+		/* the backlog is empty */
+		if ((e != EAGAIN) && (e != EWOULDBLOCK))
+			logerror("accept() failed", e);
+		errno = e;
+		return NULL;
+	}
+
+	/* nothing has been spent on it yet, and nothing will be */
+	if (!admit_check(saddr.sin_addr)) {
+		close(ns);
+		errno = ECONNREFUSED;
+		return NULL;
+	}
+
 	ssc = calloc(1, sizeof(*ssc));
 	if (!ssc) {
 		e = ENOMEM;
 		logerror("calloc failed", e);
-		errno = e;
-		return NULL;
+		goto close_sock;
 	}
+	STAILQ_INIT(&ssc->outq);
 
-	ns = accept(ssh->sock, (struct sockaddr *)&saddr, &length);
-	if (ns == -1) {
+#ifndef SOCK_NONBLOCK
+	if (fcntl(ns, F_SETFL, fcntl(ns, F_GETFL) | O_NONBLOCK) == -1) {
 		e = errno;
-		logerror("accept() failed", e);
-		goto free_ssc;
+		logerror("can't make socket non-blocking", e);
+		goto close_sock;
 	}
+	(void)fcntl(ns, F_SETFD, FD_CLOEXEC);
+#endif
 
 	int so_true = 1;
-	struct protoent *pptr = getprotobyname("tcp");
-	int p_proto = (pptr) ? pptr->p_proto : 6; /* tcp should be 6... */
 
-	setsockopt(ns, p_proto, TCP_NODELAY, &so_true, sizeof(so_true));
+	setsockopt(ns, IPPROTO_TCP, TCP_NODELAY, &so_true, sizeof(so_true));
 
 	ssc->sock = ns;
+
 	if (ssh->use_ssl) {
-		int rc;
 		ssc->use_ssl = true;
 		ssc->ssl = SSL_new(ssh->ctx);
 
@@ -235,46 +295,34 @@ acceptcon_ssl(struct servsock_handle *ssh, char *from, int len, char *from2,
 		}
 
 		SSL_set_fd(ssc->ssl, ns);
-		rc = SSL_accept(ssc->ssl);
-		if (rc <= 0) {
-			e = decode_ssl_error(ssc, rc);
-			logerror("SSL_accept failed", e);
-			goto close_sock;
-		}
+		SSL_set_accept_state(ssc->ssl);
+		ssc->handshaking = true;
 	}
 
-	/* If the socket number is less than MAXCONN, it is representable in the
-	 * fd_set, and we can pass that to select(2). Otherwise, close the
-	 * connection.
+	/* If the socket number is less than MAXCONN, the event loop can watch
+	 * it (see event_maxfds()). Otherwise, close the connection.
 	 */
 	if (ns >= MAXCONN) {
 		snprintf(sendbuf, sendbufsz,
 		    ">> All %lu connections are full.\r\n", MAXCONN);
-		outtosock_ssl(ssc, sendbuf);
+		/* a TLS client can't read anything before the handshake */
+		if (!ssc->handshaking)
+			outtosock_ssl(ssc, sendbuf);
 		logerror(sendbuf, EMFILE);
 		goto close_ssc;
 	}
 
-#ifndef SKIP_HOSTLOOKUP
-	tmphost = gethostbyaddr((char *)&(saddr.sin_addr),
-	    sizeof(struct in_addr), AF_INET);
-#endif
+	/* the host name is looked up later, see resolver_lookup() */
 	strncpy(from2, inet_ntoa(saddr.sin_addr), len2);
 	from2[len2 - 1] = (char)0;
-	if (tmphost == (struct hostent *)0) {
-		logmsg("unable to get host adress");
-		(void)strncpy(from, from2, len);
-	} else {
-		buf = tmphost->h_name;
-		if (buf != (char *)0) {
-			(void)strlcpy(from, buf, len);
-		} else
-			(void)strlcpy(from, from2, len);
-	}
-	from[len - 1] = (char)0;
-	if (ban_findsite(from2) || ban_findsite(from)) {
+	(void)strlcpy(from, from2, len);
+	if (ban_findsite(from2)) {
 		int rc;
 
+		/* a banned site doesn't get a TLS handshake, just a close */
+		if (ssc->handshaking)
+			goto close_ssc;
+
 		snprintf(sendbuf, sendbufsz,
 		    ">> Your site is presently blocked.\r\n");
 		rc = outtosock_ssl(ssc, sendbuf);
@@ -290,56 +338,90 @@ acceptcon_ssl(struct servsock_handle *ssh, char *from, int len, char *from2,
 	return ssc;
 
 close_ssc:
-	if (ssh->use_ssl) {
-		if (!ssh->no_shutdown)
+	servsock_dropqueue(ssc);
+	if (ssc->use_ssl) {
+		if (!ssc->no_shutdown && !ssc->handshaking)
 			SSL_shutdown(ssc->ssl);
 		SSL_free(ssc->ssl);
 	}
 close_sock:
 	close(ns);
-free_ssc:
 	free(ssc);
 
 	errno = e;
 	return NULL;
 }
 
+/* Advances the TLS handshake of an accepted connection.  Returns 0 once it
+ * is done, or -1 with errno EAGAIN if it is waiting on the client, in which
+ * case the socket is watched for what it needs.
+ */
 int
-infromsock_ssl(struct servsock_handle *ssh, char *buffer, int size)
+handshake_ssl(struct servsock_handle *ssh)
 {
-	int numchars, rc;
-	struct itimerval it_one_millisecond = { { 0, 0 }, { 0, 1000 } };
-	struct itimerval it_disabled = { 0 };
+	int rc, e;
 
-	if (ssh->ssl) {
-		int rc;
-		struct sigaction oldaction = { 0 }, newaction = { 0 };
+	if (!ssh->handshaking) {
+		errno = 0;
+		return 0;
+	}
 
-		newaction.sa_handler = alarmhandler;
-		rc = sigaction(SIGALRM, &newaction, &oldaction);
-		if (rc != 0)
-			logerror("sigaction (SIGALRM) failed", errno);
+	ERR_clear_error();
+	rc = SSL_accept(ssh->ssl);
+	if (rc == 1) {
+		ssh->handshaking = false;
+		ssh->sslwant = 0;
+		ssh->ktls = tls_ktls(ssh->ssl);
+		servsock_setevents(ssh);
+		errno = 0;
+		return 0;
+	}
 
-		ERR_clear_error();
-		rc = setitimer(ITIMER_REAL, &it_one_millisecond, NULL);
-		assert(!rc);
-		numchars = SSL_read(ssh->ssl, buffer, size - 1);
-		rc = setitimer(ITIMER_REAL, &it_disabled, NULL);
-		assert(!rc);
+	e = decode_ssl_error(ssh, rc);
+	if (e == EAGAIN) {
+		ssh->sslwant =
+		    (SSL_get_error(ssh->ssl, rc) == SSL_ERROR_WANT_WRITE) ?
+		    EVENT_WRITE :
+		    EVENT_READ;
+		servsock_setevents(ssh);
+	}
+	errno = e;
+	return -1;
+}
 
-		rc = sigaction(SIGALRM, &oldaction, &newaction);
-		if (rc != 0)
-			logerror("sigaction (SIGALRM) failed", errno);
+int
+infromsock_ssl(struct servsock_handle *ssh, char *buffer, int size)
+{
+	int numchars, rc, n, e;
 
+	if (ssh->ssl) {
+		ERR_clear_error();
+		numchars = SSL_read(ssh->ssl, buffer, size - 1);
 		if (numchars <= 0) {
-			rc = decode_ssl_error(ssh, numchars);
-			if (rc == EAGAIN)
-				numchars = 0;
-			else {
-				logerror("SSL error %d on SSL_read", rc);
-				errno = rc;
+			rc = SSL_get_error(ssh->ssl, numchars);
+			e = decode_ssl_error(ssh, numchars);
+			if (e != EAGAIN) {
+				logerror("SSL_read(3) failed", e);
+				errno = e;
 				return -1;
 			}
+
+			/* e.g., a key update, retried by the event handler */
+			if (rc == SSL_ERROR_WANT_WRITE) {
+				ssh->sslwant = EVENT_WRITE;
+				servsock_setevents(ssh);
+			}
+			numchars = 0;
+			goto out;
+		}
+
+		/* take what TLS has already decrypted, it won't be signaled */
+		while ((numchars < size - 1) && (SSL_pending(ssh->ssl) > 0)) {
+			n = SSL_read(ssh->ssl, &buffer[numchars],
+			    size - 1 - numchars);
+			if (n <= 0)
+				break;
+			numchars += n;
 		}
 	} else {
 		numchars = recv(ssh->sock, buffer, size - 1, MSG_DONTWAIT);
@@ -376,74 +458,487 @@ out:
 	return numchars;
 }
 
+/* TLS has decrypted input that infromsock_ssl() hasn't returned yet.  It's
+ * already out of the socket, so no event will say it's there.
+ */
+bool
+pendingsock_ssl(struct servsock_handle *ssh)
+{
+	return ssh->ssl && (SSL_pending(ssh->ssl) > 0);
+}
+
+/* Sends what the socket will take of the last words (e.g., the reason for
+ * the disconnection) and discards the rest.
+ */
+static void
+servsock_dropqueue(struct servsock_handle *ssh)
+{
+	struct servsock_chunk *chunk;
+
+	/* it hasn't gone out yet, so it can go out now */
+	if (ssh->sending) {
+		event_unsend(ssh->sock);
+		ssh->sending = 0;
+	}
+
+	if (ssh->outqlen)
+		(void)flushtosock_ssl(ssh);
+
+	while ((chunk = STAILQ_FIRST(&ssh->outq))) {
+		STAILQ_REMOVE_HEAD(&ssh->outq, entries);
+		servsock_msg_unref(chunk->msg);
+		free(chunk);
+	}
+	ssh->outqlen = 0;
+}
+
+/* for the listening sockets that getsock_ssl() opens from now on */
 int
-outtosock_ssl(struct servsock_handle *ssh, char *buffer)
+servsock_setbacklog(int newbacklog)
 {
-	int length, numsent, e, retries = 10;
+	if (newbacklog < 1) {
+		errno = EINVAL;
+		return -1;
+	}
 
-	length = strlen(buffer);
-	if (length == 0) {
-		logmsg("not sending 0 length buffer");
-		errno = 0;
+	backlog = newbacklog;
+	errno = 0;
+	return 0;
+}
+
+int
+servsock_setwatermarks(size_t newlowat, size_t newhiwat)
+{
+	if (!newhiwat || (newlowat > newhiwat)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	lowat = newlowat;
+	hiwat = newhiwat;
+	errno = 0;
+	return 0;
+}
+
+struct servsock_msg *
+servsock_msg_new(const char *text)
+{
+	struct servsock_msg *msg;
+	size_t len = strlen(text);
+
+	msg = malloc(sizeof(*msg) + len + 1);
+	if (!msg) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	atomic_init(&msg->refcnt, 1);
+	msg->len = len;
+	memcpy(msg->data, text, len + 1);
+	return msg;
+}
+
+struct servsock_msg *
+servsock_msg_ref(struct servsock_msg *msg)
+{
+	atomic_fetch_add_explicit(&msg->refcnt, 1, memory_order_relaxed);
+	return msg;
+}
+
+void
+servsock_msg_unref(struct servsock_msg *msg)
+{
+	if (msg && (atomic_fetch_sub_explicit(&msg->refcnt, 1,
+			memory_order_acq_rel) <= 1))
+		free(msg);
+}
+
+/* Watch for writability while there is output queued, and for readability
+ * unless the queue is over the high watermark.
+ */
+static void
+servsock_setevents(struct servsock_handle *ssh)
+{
+	int events = 0;
+
+	/* TLS needs the socket to itself until it has what it wants */
+	if (ssh->sslwant) {
+		(void)event_mod(ssh->sock, ssh->sslwant);
+		return;
+	}
+
+	if (ssh->throttled && (ssh->outqlen <= lowat))
+		ssh->throttled = false;
+	else if (!ssh->throttled && (ssh->outqlen > hiwat))
+		ssh->throttled = true;
+
+	if (!ssh->throttled)
+		events |= EVENT_READ;
+	if (ssh->outqlen && !ssh->sending)
+		events |= EVENT_WRITE;
+
+	/* fails harmlessly if the socket isn't being watched yet */
+	(void)event_mod(ssh->sock, events);
+}
+
+/* Copies the text to the end of the queue, or refers to msg instead if the
+ * text doesn't fit in the space left in the last chunk.
+ */
+static int
+servsock_enqueue(struct servsock_handle *ssh, struct servsock_msg *msg,
+    char *buffer, size_t length)
+{
+	struct servsock_chunk *chunk = STAILQ_LAST(&ssh->outq, servsock_chunk,
+	    entries);
+	size_t n;
+
+	/* an SSL_write() that has to be repeated must see the same data */
+	if (chunk && !chunk->msg && (chunk->len < chunk->size) &&
+	    !(ssh->sslwrite && (chunk == STAILQ_FIRST(&ssh->outq)))) {
+		n = chunk->size - chunk->len;
+		if (msg && (n < length))
+			n = 0; /* don't split what we can share */
+		else if (n > length)
+			n = length;
+		memcpy(&chunk->data[chunk->len], buffer, n);
+		chunk->len += n;
+		ssh->outqlen += n;
+		buffer += n;
+		length -= n;
+	}
+
+	if (!length)
 		return 0;
+
+	if (msg) {
+		chunk = malloc(sizeof(*chunk));
+		if (!chunk) {
+			errno = ENOMEM;
+			return -1;
+		}
+		chunk->msg = servsock_msg_ref(msg);
+		chunk->data = buffer;
+		chunk->size = chunk->len = length;
+	} else {
+		n = (length > SERVSOCK_CHUNK) ? length : SERVSOCK_CHUNK;
+		chunk = malloc(sizeof(*chunk) + n);
+		if (!chunk) {
+			errno = ENOMEM;
+			return -1;
+		}
+		chunk->msg = NULL;
+		chunk->data = chunk->buf;
+		chunk->size = n;
+		chunk->len = length;
+		memcpy(chunk->data, buffer, length);
 	}
+	chunk->off = 0;
+	STAILQ_INSERT_TAIL(&ssh->outq, chunk, entries);
+	ssh->outqlen += length;
+	return 0;
+}
 
-	if (ssh->use_ssl) {
-	sslretry:
+/* Returns the number of bytes sent, 0 if the socket would block, or -1 if
+ * the connection is broken.
+ */
+static int
+servsock_send(struct servsock_handle *ssh, char *data, size_t length)
+{
+	int numsent, e;
+
+	if (ssh->use_ssl && !ssh->ktls) {
+		if (ssh->sslwrite)
+			length = ssh->sslwrite;
 		ERR_clear_error();
-		numsent = SSL_write(ssh->ssl, buffer, length);
-		if (numsent <= -1) {
+		numsent = SSL_write(ssh->ssl, data, (int)length);
+		if (numsent <= 0) {
 			e = decode_ssl_error(ssh, numsent);
 			if (e == EAGAIN) {
-				if (--retries > 0) {
-					goto sslretry;
-				}
-				logerror("retries exhausted", e);
-				errno = 0;
+				ssh->sslwrite = (int)length;
+				/* e.g., a key update, retried by the event
+				 * handler once the socket is readable
+				 */
+				if (SSL_get_error(ssh->ssl, numsent) ==
+				    SSL_ERROR_WANT_READ)
+					ssh->sslwant = EVENT_READ;
 				return 0;
 			}
 			logerror("SSL_write(3) failed", e);
 			errno = e;
 			return -1;
 		}
-	} else {
-	sockretry:
-		numsent = send(ssh->sock, buffer, length, 0x0);
-		if (numsent <= -1) {
+		ssh->sslwrite = 0;
+		return numsent;
+	}
+
+	/* plain, or the kernel makes the TLS records (see tls.c) */
+	do
+		numsent = send(ssh->sock, data, length, MSG_NOSIGNAL);
+	while ((numsent == -1) && (errno == EINTR));
+
+	if (numsent == -1) {
+		e = errno;
+		if ((e == EAGAIN) || (e == EWOULDBLOCK))
+			return 0;
+		logerror("send(2) failed", e);
+		errno = e;
+		return -1;
+	}
+	return numsent;
+}
+
+/* Removes the first numsent bytes of chunk, the head of the queue. */
+static void
+servsock_consume(struct servsock_handle *ssh, struct servsock_chunk *chunk,
+    size_t numsent)
+{
+	chunk->off += numsent;
+	ssh->outqlen -= numsent;
+	if (chunk->off == chunk->len) {
+		STAILQ_REMOVE_HEAD(&ssh->outq, entries);
+		servsock_msg_unref(chunk->msg);
+		free(chunk);
+	}
+}
+
+/* The event loop sent the head of the queue along with everyone else's
+ * output.  If the socket took all of it, the next chunk goes with the next
+ * batch.  Otherwise, the rest goes out when the socket is writable, and so
+ * does the news if the connection is broken.
+ */
+static void
+servsock_sent(int fd, int result, void *arg)
+{
+	struct servsock_handle *ssh = arg;
+	struct servsock_chunk *chunk;
+	bool all = (result > 0) && ((size_t)result == ssh->sending);
+
+	ssh->sending = 0;
+	if (result > 0)
+		servsock_consume(ssh, STAILQ_FIRST(&ssh->outq), result);
+
+	chunk = STAILQ_FIRST(&ssh->outq);
+	if (all && chunk &&
+	    (event_send(fd, &chunk->data[chunk->off], chunk->len - chunk->off,
+		 servsock_sent, ssh) == 0))
+		ssh->sending = chunk->len - chunk->off;
+	servsock_setevents(ssh);
+}
+
+/* Sends as much queued output as the socket will take without blocking.
+ * Returns 0 if the rest can wait for the socket to become writable, or -1
+ * if the connection is broken.
+ */
+int
+flushtosock_ssl(struct servsock_handle *ssh)
+{
+	struct servsock_chunk *chunk;
+	int numsent, e = 0;
+
+	/* the rest waits for the event_send() to finish */
+	if (ssh->sending) {
+		errno = 0;
+		return 0;
+	}
+
+	while ((chunk = STAILQ_FIRST(&ssh->outq))) {
+		numsent = servsock_send(ssh, &chunk->data[chunk->off],
+		    chunk->len - chunk->off);
+		if (numsent == -1) {
 			e = errno;
-			if (e == EAGAIN) {
-				if (--retries > 0)
-					goto sockretry;
-				logerror("retries exhausted", e);
-				errno = 0;
-				return 0;
-			}
-			logerror("send(2) failed", e);
+			break;
+		}
+		if (numsent == 0)
+			break;
+
+		servsock_consume(ssh, chunk, numsent);
+	}
+
+	servsock_setevents(ssh);
+	errno = e;
+	return (e) ? -1 : 0;
+}
+
+/* Sends the text, or queues what the socket won't take.  If msg is given,
+ * the text is msg's and the queue may hold a reference to it instead of a
+ * copy.  Nothing is dropped: if the peer can't keep up, the connection is
+ * closed once its queue is too long.
+ */
+static int
+servsock_out(struct servsock_handle *ssh, struct servsock_msg *msg,
+    char *buffer, size_t length)
+{
+	struct servsock_chunk *chunk;
+	int numsent, e;
+
+	if (length == 0) {
+		logmsg("not sending 0 length buffer");
+		errno = 0;
+		return 0;
+	}
+
+	if (ssh->outqlen + length > hiwat * SERVSOCK_QUEUE_LIMIT) {
+		e = ENOBUFS;
+		logerror("output queue overflow", e);
+		errno = e;
+		return -1;
+	}
+
+	/* queue it, and let the event loop send it with the rest of the
+	 * pass's output
+	 */
+	if (!ssh->outqlen && (!ssh->use_ssl || ssh->ktls) &&
+	    event_cansend(ssh->sock)) {
+		if (servsock_enqueue(ssh, msg, buffer, length) == -1) {
+			e = errno;
+			logerror("can't queue output", e);
 			errno = e;
 			return -1;
 		}
+
+		chunk = STAILQ_FIRST(&ssh->outq);
+		if (event_send(ssh->sock, chunk->data, chunk->len, servsock_sent,
+			ssh) == 0)
+			ssh->sending = chunk->len;
+		servsock_setevents(ssh);
+		errno = 0;
+		return 0;
 	}
 
-	if (numsent < length) {
-		if (ssh->use_ssl)
-			logmsg("SSL_write() garbled lost characters");
-		else
-			logmsg("send() garbled lost characters");
+	/* if output is already queued, the socket isn't writable yet */
+	if (!ssh->outqlen) {
+		numsent = servsock_send(ssh, buffer, length);
+		if (numsent == -1)
+			return -1;
+
+		buffer += numsent;
+		length -= numsent;
+		if (!length) {
+			errno = 0;
+			return 0;
+		}
+	}
+
+	if (servsock_enqueue(ssh, msg, buffer, length) == -1) {
+		e = errno;
+		logerror("can't queue output", e);
+		errno = e;
+		return -1;
 	}
 
+	servsock_setevents(ssh);
 	errno = 0;
 	return 0;
 }
 
+/* A connection that a shard serves is only written to by the shard, so the
+ * text is passed on to it.
+ */
 int
-closesock_ssl(struct servsock_handle *ssh)
+outtosock_ssl(struct servsock_handle *ssh, char *buffer)
+{
+	struct servsock_msg *msg;
+	int rc;
+
+	if (!ssh->shard)
+		return servsock_out(ssh, NULL, buffer, strlen(buffer));
+
+	if (!*buffer) {
+		errno = 0;
+		return 0;
+	}
+
+	msg = servsock_msg_new(buffer);
+	if (!msg)
+		return -1;
+	rc = shard_send(ssh, msg);
+	servsock_msg_unref(msg);
+	return rc;
+}
+
+int
+outmsgtosock_ssl(struct servsock_handle *ssh, struct servsock_msg *msg)
+{
+	if (ssh->shard)
+		return shard_send(ssh, msg);
+	return servsock_out(ssh, msg, msg->data, msg->len);
+}
+
+/* outmsgtosock_ssl() for the thread that serves the connection */
+int
+servsock_sendmsg(struct servsock_handle *ssh, struct servsock_msg *msg)
+{
+	return servsock_out(ssh, msg, msg->data, msg->len);
+}
+
+/* closesock_ssl() for the thread that serves the connection, except that
+ * the handle isn't freed
+ */
+void
+servsock_close(struct servsock_handle *ssh)
 {
+	servsock_dropqueue(ssh);
 	if (ssh->use_ssl) {
-		if (!ssh->no_shutdown)
+		if (!ssh->no_shutdown && !ssh->handshaking)
 			SSL_shutdown(ssh->ssl);
 		SSL_free(ssh->ssl);
 	}
 	close(ssh->sock);
+}
+
+int
+closesock_ssl(struct servsock_handle *ssh)
+{
+	/* the shard frees it, see shard_close() */
+	if (ssh->shard)
+		return shard_close(ssh);
+
+	servsock_close(ssh);
 	free(ssh);
 	return 0;
 }
+
+/* Makes a handle of a socket that the server handed over when it was
+ * upgraded, see upgrade.c.  A listening socket is set up as getsock_ssl()
+ * would, but it is already bound.  A connection is plain, since TLS ones
+ * aren't handed over.
+ */
+struct servsock_handle *
+servsock_inherit(int sock, bool listening, bool use_ssl)
+{
+	struct servsock_handle *ssh;
+
+	ssh = calloc(1, sizeof(*ssh));
+	if (!ssh)
+		return NULL;
+	STAILQ_INIT(&ssh->outq);
+	ssh->sock = sock;
+
+	if (fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK) == -1) {
+		free(ssh);
+		return NULL;
+	}
+
+	if (listening) {
+		/* -b may be different this time */
+		(void)listen(sock, backlog);
+		if (use_ssl)
+			servsock_tlsctx(ssh);
+	}
+	return ssh;
+}
+
+/* Copies the output that hasn't been sent yet, all ssh->outqlen bytes of it,
+ * to buf.
+ */
+void
+servsock_copyqueue(struct servsock_handle *ssh, char *buf)
+{
+	struct servsock_chunk *chunk;
+	size_t n;
+
+	STAILQ_FOREACH(chunk, &ssh->outq, entries) {
+		n = chunk->len - chunk->off;
+		memcpy(buf, &chunk->data[chunk->off], n);
+		buf += n;
+	}
+}
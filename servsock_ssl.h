@@ -31,10 +31,58 @@
  * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <sys/queue.h>
+#include <sys/socket.h>
+
 #include <openssl/err.h>
 #include <openssl/ssl.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 
+#include "shard.h"
+
+/* default output queue watermarks, in bytes.  Reads from a connection are
+ * paused when its queue grows past the high watermark, and resumed when it
+ * drains to the low watermark.  A connection whose queue would grow past
+ * SERVSOCK_QUEUE_LIMIT high watermarks is dropped.
+ */
+#define SERVSOCK_LOWAT	     (16 * 1024)
+#define SERVSOCK_HIWAT	     (64 * 1024)
+#define SERVSOCK_QUEUE_LIMIT 16
+
+/* default listen(2) backlog, which the kernel may cap.  It has to hold
+ * everyone who reconnects at once, e.g., after a netsplit.
+ */
+#define SERVSOCK_BACKLOG SOMAXCONN
+
+/* most connections accepted per wakeup of a listening socket, so that the
+ * players already on aren't starved during a storm
+ */
+#define SERVSOCK_ACCEPT_BATCH 256
+
+/* seconds a client has to finish the TLS handshake */
+#define SERVSOCK_HANDSHAKE_TIMEOUT 10
+
+/* text that is queued for several connections at once, e.g., a yell.  With
+ * shards, the connections may be served by different threads.
+ */
+struct servsock_msg {
+	atomic_int refcnt;
+	size_t len;
+	char data[];
+};
+
+/* a piece of output that has not been sent yet */
+struct servsock_chunk {
+	STAILQ_ENTRY(servsock_chunk) entries;
+	struct servsock_msg *msg; /* data is msg's, or NULL if it's buf */
+	char *data;
+	size_t size; /* bytes allocated for data */
+	size_t len;  /* bytes of data */
+	size_t off;  /* bytes of data already sent */
+	char buf[];
+};
+
 struct servsock_handle {
 	int sock;
 	bool no_shutdown;
@@ -43,6 +91,19 @@ struct servsock_handle {
 	SSL_CTX *ctx;
 	BIO *ib;
 	BIO *ob;
+	STAILQ_HEAD(servsock_outq, servsock_chunk) outq;
+	size_t outqlen;	 /* bytes in outq */
+	int sslwrite;	 /* length of an SSL_write() to repeat, or 0 */
+	bool throttled;	 /* outq is over the high watermark */
+	size_t sending;	 /* bytes of outq's head in an event_send() */
+	bool handshaking; /* TLS handshake not finished, see handshake_ssl() */
+	int sslwant;	  /* the event TLS is waiting for, or 0 */
+	bool ktls;	  /* the kernel encrypts what's sent, see tls.c */
+	struct shard *shard; /* the thread serving it, or NULL, see shard.c */
+	shard_handler func;  /* main thread only */
+	void *arg;	     /* main thread only */
+	bool closing;	     /* main thread only, shard_close() was called */
+	bool gone;	     /* shard only, the main thread was told it failed */
 };
 
 struct servsock_handle *getsock_ssl(char *address, int port, bool use_ssl);
@@ -50,8 +111,35 @@ struct servsock_handle *getsock_ssl(char *address, int port, bool use_ssl);
 struct servsock_handle *acceptcon_ssl(struct servsock_handle *ssh, char *from,
     int len, char *from2, int len2, int *port);
 
+int handshake_ssl(struct servsock_handle *ssh);
+
 int infromsock_ssl(struct servsock_handle *ssh, char *buffer, int size);
 
+bool pendingsock_ssl(struct servsock_handle *ssh);
+
 int outtosock_ssl(struct servsock_handle *ssh, char *buffer);
 
+int outmsgtosock_ssl(struct servsock_handle *ssh, struct servsock_msg *msg);
+
+int flushtosock_ssl(struct servsock_handle *ssh);
+
+struct servsock_msg *servsock_msg_new(const char *text);
+
+struct servsock_msg *servsock_msg_ref(struct servsock_msg *msg);
+
+void servsock_msg_unref(struct servsock_msg *msg);
+
+int servsock_setbacklog(int backlog);
+
+int servsock_setwatermarks(size_t lowat, size_t hiwat);
+
+int servsock_sendmsg(struct servsock_handle *ssh, struct servsock_msg *msg);
+
+void servsock_close(struct servsock_handle *ssh);
+
+void servsock_copyqueue(struct servsock_handle *ssh, char *buf);
+
+struct servsock_handle *servsock_inherit(int sock, bool listening,
+    bool use_ssl);
+
 int closesock_ssl(struct servsock_handle *ssh);
@@ -0,0 +1,533 @@
+/*
+ * Copyright 2025 Jillian Alana Bolton
+ *
+ * The BSD 2-Clause License
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *
+ *     2. Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* shard.c - threads that serve connections for the main thread
+ *
+ * With -t, connections are handed to a number of shard threads, each with
+ * its own event loop (see event_init()).  A shard owns everything about its
+ * connections' sockets: the TLS handshake and TLS itself, reading and
+ * sanitizing input, and the output queue.  That is where most of the CPU
+ * goes when many players are connected.
+ *
+ * Everything else is owned by the main thread, as it is without -t:
+ * players, channels, bans, boards, the parser and the log buffers.  There
+ * are no locks around any of it, because no other thread touches it.
+ *
+ * The two sides talk through lock-free queues, one into each shard and
+ * one into the main thread.  Each can have many producers and has a
+ * single consumer (MPSC), and each has a pipe to wake its consumer's event
+ * loop.  The main thread sends text to a connection (a reference to a
+ * shared servsock_msg, so a yell is still formatted once), and asks for it
+ * to be closed.  A shard reports input, a finished handshake, or a failed
+ * connection.
+ *
+ * A servsock_handle is shared, but each field has one owner.  The shard
+ * owns the socket and the TLS and queue state, and the main thread owns
+ * func, arg and closing.  The main thread frees the handle only after the
+ * shard has closed it and said so, so a report that was already queued
+ * never refers to freed memory.
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <unistd.h>
+
+#include "event.h"
+#include "log.h"
+#include "lorien.h"
+#include "platform.h"
+#include "servsock_ssl.h"
+#include "shard.h"
+#include "utf8.h"
+
+/* Vyukov's intrusive MPSC queue.  Pushing is one atomic exchange, so any
+ * thread may push.  Only the owner pops.
+ */
+struct mpsc_node {
+	_Atomic(struct mpsc_node *) next;
+};
+
+struct mpsc_queue {
+	_Atomic(struct mpsc_node *) head; /* the last node pushed */
+	struct mpsc_node *tail;		  /* the next node to pop */
+	struct mpsc_node stub;
+	atomic_bool signaled; /* a byte is in the pipe, or about to be */
+	int notify[2];
+};
+
+/* what the main thread asks of a shard, and what a shard reports back */
+#define SHARD_ADOPT  10
+#define SHARD_SEND   11
+#define SHARD_CLOSE  12
+#define SHARD_CLOSED 13
+#define SHARD_STOP   14
+
+struct shard_op {
+	struct mpsc_node node; /* must be first */
+	int what;
+	int err;
+	struct servsock_handle *h;
+	struct servsock_msg *msg;
+};
+
+struct shard {
+	struct mpsc_queue q;
+	pthread_t tid;
+};
+
+static struct shard *shards;
+static int nshards;
+static int nextshard; /* round robin */
+static struct mpsc_queue mainq;
+static atomic_int nstopped; /* see shard_stop() */
+
+static void
+mpsc_init(struct mpsc_queue *q)
+{
+	atomic_init(&q->stub.next, NULL);
+	atomic_init(&q->head, &q->stub);
+	q->tail = &q->stub;
+	atomic_init(&q->signaled, false);
+}
+
+static void
+mpsc_push(struct mpsc_queue *q, struct mpsc_node *n)
+{
+	struct mpsc_node *prev;
+
+	atomic_store_explicit(&n->next, NULL, memory_order_relaxed);
+	prev = atomic_exchange_explicit(&q->head, n, memory_order_acq_rel);
+	atomic_store_explicit(&prev->next, n, memory_order_release);
+}
+
+/* NULL if the queue is empty, or if a push is half done.  The pusher will
+ * signal again in that case, see shard_post().
+ */
+static struct mpsc_node *
+mpsc_pop(struct mpsc_queue *q)
+{
+	struct mpsc_node *tail = q->tail;
+	struct mpsc_node *next = atomic_load_explicit(&tail->next,
+	    memory_order_acquire);
+
+	if (tail == &q->stub) {
+		if (!next)
+			return NULL;
+		q->tail = tail = next;
+		next = atomic_load_explicit(&tail->next, memory_order_acquire);
+	}
+
+	if (next) {
+		q->tail = next;
+		return tail;
+	}
+
+	if (tail != atomic_load_explicit(&q->head, memory_order_acquire))
+		return NULL;
+
+	mpsc_push(q, &q->stub);
+	next = atomic_load_explicit(&tail->next, memory_order_acquire);
+	if (next) {
+		q->tail = next;
+		return tail;
+	}
+	return NULL;
+}
+
+static int
+shard_post(struct mpsc_queue *q, int what, struct servsock_handle *h,
+    struct servsock_msg *msg, int err)
+{
+	struct shard_op *op;
+	char c = 0;
+
+	op = malloc(sizeof(*op));
+	if (!op) {
+		errno = ENOMEM;
+		return -1;
+	}
+	op->what = what;
+	op->err = err;
+	op->h = h;
+	op->msg = (msg) ? servsock_msg_ref(msg) : NULL;
+	mpsc_push(q, &op->node);
+
+	/* if the pipe is full, the consumer has been woken already */
+	if (!atomic_exchange(&q->signaled, true))
+		(void)write(q->notify[1], &c, 1);
+
+	errno = 0;
+	return 0;
+}
+
+/* Clears the wakeup before popping, so that a push that lands after the
+ * queue looks empty signals again.
+ */
+static struct shard_op *
+shard_next(struct mpsc_queue *q, bool first)
+{
+	char buf[64];
+
+	if (first) {
+		while (read(q->notify[0], buf, sizeof(buf)) > 0)
+			continue;
+		atomic_store(&q->signaled, false);
+	}
+	return (struct shard_op *)mpsc_pop(q);
+}
+
+/* shard thread: the connection failed, tell the main thread once */
+static void
+shard_gone(struct servsock_handle *h, int err)
+{
+	if (h->gone)
+		return;
+
+	h->gone = true;
+	(void)event_del(h->sock);
+	if (shard_post(&mainq, SHARD_GONE, h, NULL, err) == -1)
+		logerror("can't report a failed connection", errno);
+}
+
+/* shard thread: read what there is, and pass it on */
+static void
+shard_read(struct servsock_handle *h)
+{
+	struct servsock_msg *msg;
+	char buf[BUFSIZE];
+	int n;
+
+	do {
+		n = infromsock_ssl(h, buf, sizeof(buf));
+		if (n == -1) {
+			shard_gone(h, errno);
+			return;
+		}
+		if (n == 0)
+			break;
+
+		/* lowercasing depends on the player, see player_shardevent() */
+		n = strnlen(buf, n);
+		utf8_sanitize(buf, n, false);
+
+		msg = servsock_msg_new(buf);
+		if (!msg || (shard_post(&mainq, SHARD_INPUT, h, msg, 0) == -1)) {
+			shard_gone(h, ENOMEM);
+			servsock_msg_unref(msg);
+			return;
+		}
+		servsock_msg_unref(msg);
+		/* see handleinput() */
+	} while (!h->throttled || pendingsock_ssl(h));
+}
+
+/* shard thread: the event handler for a connection */
+static void
+shard_ready(int fd, int events, void *arg)
+{
+	struct servsock_handle *h = arg;
+
+	if (h->handshaking) {
+		if (handshake_ssl(h) == 0) {
+			if (shard_post(&mainq, SHARD_READY, h, NULL, 0) == -1)
+				shard_gone(h, errno);
+		} else if (errno != EAGAIN) {
+			shard_gone(h, errno);
+		}
+		return;
+	}
+
+	/* see player_ready() */
+	if (h->sslwant) {
+		h->sslwant = 0;
+		events = EVENT_READ | EVENT_WRITE;
+	}
+
+	if ((events & EVENT_WRITE) && (flushtosock_ssl(h) == -1)) {
+		shard_gone(h, errno);
+		return;
+	}
+
+	if (events & EVENT_READ)
+		shard_read(h);
+}
+
+/* shard thread: do what the main thread asked */
+static void
+shard_wakeup(int fd, int events, void *arg)
+{
+	struct shard *sh = arg;
+	struct servsock_handle *h;
+	struct shard_op *op;
+	bool first = true;
+
+	while ((op = shard_next(&sh->q, first))) {
+		first = false;
+		h = op->h;
+		switch (op->what) {
+		case SHARD_ADOPT:
+			if (event_add(h->sock, EVENT_READ, shard_ready, h) == -1)
+				shard_gone(h, errno);
+			break;
+		case SHARD_SEND:
+			if (!h->gone && (servsock_sendmsg(h, op->msg) == -1))
+				shard_gone(h, errno);
+			break;
+		case SHARD_CLOSE:
+			(void)event_del(h->sock);
+			servsock_close(h);
+			if (shard_post(&mainq, SHARD_CLOSED, h, NULL, 0) == -1)
+				logerror("can't report a closed connection",
+				    errno);
+			break;
+		case SHARD_STOP:
+			/* what's left in the queue is the main thread's */
+			free(op);
+			event_flush();
+			atomic_fetch_add(&nstopped, 1);
+			pthread_exit(NULL);
+		}
+		servsock_msg_unref(op->msg);
+		free(op);
+	}
+}
+
+static void *
+shard_main(void *arg)
+{
+	struct shard *sh = arg;
+
+	if ((event_init() == -1) ||
+	    (event_add(sh->q.notify[0], EVENT_READ, shard_wakeup, sh) == -1))
+		err(EX_OSERR, "can't start a shard's event loop");
+
+	for (;;)
+		if ((event_wait(-1) == -1) && (errno != EINTR))
+			logerror("shard event_wait failed", errno);
+
+	return NULL; /* NOTREACHED */
+}
+
+/* main thread: pass on what the shards reported */
+static void
+shard_mainready(int fd, int events, void *arg)
+{
+	struct servsock_handle *h;
+	struct servsock_msg *msg;
+	struct shard_op *op;
+	bool first = true;
+
+	while ((op = shard_next(&mainq, first))) {
+		first = false;
+		h = op->h;
+		msg = op->msg;
+		if (op->what == SHARD_CLOSED)
+			free(h);
+		else if (!h->closing)
+			h->func(h, op->what, (msg) ? msg->data : NULL,
+			    (msg) ? msg->len : 0, op->err, h->arg);
+		servsock_msg_unref(msg);
+		free(op);
+	}
+}
+
+static int
+shard_pipe(struct mpsc_queue *q)
+{
+	mpsc_init(q);
+	if (pipe(q->notify) == -1)
+		return -1;
+	if ((fcntl(q->notify[0], F_SETFL, O_NONBLOCK) == -1) ||
+	    (fcntl(q->notify[1], F_SETFL, O_NONBLOCK) == -1))
+		return -1;
+	return 0;
+}
+
+/* Starts n shard threads.  Called from the main thread after its own
+ * event_init().
+ */
+int
+shard_init(int n)
+{
+	int i, rc;
+
+	if ((n < 0) || (n > SHARD_MAX)) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (!n)
+		return 0;
+
+	if ((shard_pipe(&mainq) == -1) ||
+	    (event_add(mainq.notify[0], EVENT_READ, shard_mainready, NULL) ==
+		-1))
+		return -1;
+
+	shards = calloc(n, sizeof(*shards));
+	if (!shards) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	for (i = 0; i < n; i++) {
+		if (shard_pipe(&shards[i].q) == -1)
+			return -1;
+		rc = pthread_create(&shards[i].tid, NULL, shard_main,
+		    &shards[i]);
+		if (rc != 0) {
+			errno = rc;
+			return -1;
+		}
+		pthread_detach(shards[i].tid);
+		nshards++;
+	}
+
+	errno = 0;
+	return 0;
+}
+
+/* Stops the shard threads, so that the main thread serves every connection
+ * from then on, e.g., before an upgrade.  What the shards were asked to do
+ * and didn't get to is done here.  reclaim() must then take each connection
+ * back into the main thread's loop, before what the shards reported is
+ * passed on.
+ */
+void
+shard_stop(void (*reclaim)(void))
+{
+	struct servsock_handle *h;
+	struct shard_op *op;
+	int i;
+
+	if (!nshards)
+		return;
+
+	for (i = 0; i < nshards; i++)
+		if (shard_post(&shards[i].q, SHARD_STOP, NULL, NULL, 0) == -1)
+			err(EX_OSERR, "can't stop a shard");
+
+	while (atomic_load(&nstopped) < nshards)
+		usleep(1000);
+
+	for (i = 0; i < nshards; i++) {
+		while ((op = (struct shard_op *)mpsc_pop(&shards[i].q))) {
+			h = op->h;
+			switch (op->what) {
+			case SHARD_SEND:
+				/* not in the main loop yet, so it's sent or
+				 * queued now
+				 */
+				if (!h->gone &&
+				    (servsock_sendmsg(h, op->msg) == -1))
+					shard_gone(h, errno);
+				break;
+			case SHARD_CLOSE:
+				servsock_close(h);
+				if (shard_post(&mainq, SHARD_CLOSED, h, NULL,
+					0) == -1)
+					logerror("can't report a close",
+					    errno);
+				break;
+			}
+			/* SHARD_ADOPT needs nothing, reclaim() does it */
+			servsock_msg_unref(op->msg);
+			free(op);
+		}
+	}
+
+	nshards = 0;
+	reclaim();
+	shard_mainready(mainq.notify[0], EVENT_READ, NULL);
+}
+
+/* the number of shard threads, 0 if the main thread does everything */
+int
+shard_count(void)
+{
+	return nshards;
+}
+
+/* Hands an accepted connection to a shard.  From now on, the main thread
+ * only touches it through outtosock_ssl(), outmsgtosock_ssl() and
+ * closesock_ssl(), which come here.  If it can't be handed off, it's still
+ * the main thread's to close.
+ */
+int
+shard_adopt(struct servsock_handle *h, shard_handler func, void *arg)
+{
+	h->shard = &shards[nextshard];
+	shard_sethandler(h, func, arg);
+
+	if (shard_post(&h->shard->q, SHARD_ADOPT, h, NULL, 0) == -1) {
+		h->shard = NULL; /* the shard never saw it */
+		return -1;
+	}
+
+	nextshard = (nextshard + 1) % nshards;
+	return 0;
+}
+
+void
+shard_sethandler(struct servsock_handle *h, shard_handler func, void *arg)
+{
+	h->func = func;
+	h->arg = arg;
+}
+
+int
+shard_send(struct servsock_handle *h, struct servsock_msg *msg)
+{
+	if (h->closing) {
+		errno = EPIPE;
+		return -1;
+	}
+	return shard_post(&h->shard->q, SHARD_SEND, h, msg, 0);
+}
+
+/* The shard closes the connection, and the main thread frees it once the
+ * shard says it's done.
+ */
+int
+shard_close(struct servsock_handle *h)
+{
+	h->closing = true;
+	if (shard_post(&h->shard->q, SHARD_CLOSE, h, NULL, 0) == -1) {
+		logerror("can't close connection", errno);
+		return -1;
+	}
+	return 0;
+}
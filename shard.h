@@ -0,0 +1,62 @@
+/*
+ * Copyright 2025 Jillian Alana Bolton
+ *
+ * The BSD 2-Clause License
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *
+ *     2. Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* shard.h - threads that serve connections for the main thread
+ */
+
+#ifndef _SHARD_H_
+#define _SHARD_H_
+
+#include <sys/types.h>
+
+#define SHARD_MAX 64 /* most threads -t can ask for */
+
+/* what a shard tells the main thread about one of its connections */
+#define SHARD_INPUT 1 /* text arrived, sanitized but not lowercased */
+#define SHARD_READY 2 /* the TLS handshake is done */
+#define SHARD_GONE  3 /* the connection failed with err */
+
+struct servsock_handle;
+struct servsock_msg;
+
+/* called on the main thread, text is only for SHARD_INPUT */
+typedef void (*shard_handler)(struct servsock_handle *h, int what, char *text,
+    size_t len, int err, void *arg);
+
+int shard_adopt(struct servsock_handle *h, shard_handler func, void *arg);
+int shard_close(struct servsock_handle *h);
+int shard_count(void);
+int shard_init(int n);
+int shard_send(struct servsock_handle *h, struct servsock_msg *msg);
+void shard_sethandler(struct servsock_handle *h, shard_handler func,
+    void *arg);
+void shard_stop(void (*reclaim)(void));
+
+#endif
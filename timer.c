@@ -0,0 +1,364 @@
+/*
+ * Copyright 2008-2025, Bolton-Dormer Research Partnership
+ *
+ * The BSD 2-Clause License
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *
+ *     2. Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* timer.c - things the main thread does on a schedule, and the time of day
+ *
+ * Timers are kept in a hierarchical wheel: TIMER_LEVELS rings of
+ * TIMER_SLOTS lists each.  The first ring has a slot for each of the next
+ * TIMER_SLOTS ticks, the second one for each of the next TIMER_SLOTS runs
+ * of the first, and so on.  Setting or cancelling a timer is a list insert
+ * or remove, however many there are.  When the first ring comes around, the
+ * timers in the second ring's next slot are due within a lap and move down,
+ * and so on up.  A timer is only ever looked at when it moves or is due.
+ *
+ * The loop in doit() waits in event_wait() for at most timer_timeout(),
+ * then calls timer_run().  The time of day is read there, once a pass, and
+ * timer_now() hands it out to anything that wants to stamp something, on
+ * any thread.  timer_timeout() is never more than a second, so it's never
+ * more than a second behind.
+ *
+ * Only the main thread sets, cancels or runs timers.
+ */
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "timer.h"
+
+#define TIMER_BITS   6
+#define TIMER_SLOTS  (1 << TIMER_BITS)
+#define TIMER_MASK   (TIMER_SLOTS - 1)
+#define TIMER_LEVELS 4
+#define TIMER_CLOCK  1000 /* ms, longest event_wait() between clock reads */
+
+/* farthest a timer can be placed, about 19 days.  One set later than that
+ * waits in the last slot and is placed again when it comes due.
+ */
+#define TIMER_SPAN ((1ULL << (TIMER_BITS * TIMER_LEVELS)) - 1)
+
+LIST_HEAD(timerlist, timer);
+
+static struct timerlist wheel[TIMER_LEVELS][TIMER_SLOTS];
+static uint64_t ticks; /* the last tick timer_run() handled */
+static bool started;
+static unsigned long ntimers;
+static _Atomic(time_t) wallclock;
+
+#ifdef TESTTIMER
+static uint64_t fakems; /* the test's clock */
+#endif
+
+static uint64_t
+timer_ms(void)
+{
+#ifdef TESTTIMER
+	return fakems;
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#endif
+}
+
+static void
+timer_start(uint64_t now)
+{
+	if (started)
+		return;
+	ticks = now / TIMER_TICK;
+	started = true;
+}
+
+/* puts t in the slot of the ring that covers its due tick */
+static void
+timer_place(struct timer *t)
+{
+	uint64_t due = t->due;
+	int level = 0;
+
+	/* late, e.g., moved down by timer_run() on the tick it's due */
+	if (due < ticks)
+		due = ticks;
+	if (due - ticks > TIMER_SPAN)
+		due = ticks + TIMER_SPAN;
+
+	while ((level < TIMER_LEVELS - 1) &&
+	    (due - ticks >= (1ULL << (TIMER_BITS * (level + 1)))))
+		level++;
+
+	LIST_INSERT_HEAD(
+	    &wheel[level][(due >> (TIMER_BITS * level)) & TIMER_MASK], t,
+	    entries);
+}
+
+/* the timers in level's current slot move down now that it's their lap */
+static void
+timer_cascade(int level)
+{
+	struct timerlist *slot;
+	struct timer *t;
+
+	slot = &wheel[level][(ticks >> (TIMER_BITS * level)) & TIMER_MASK];
+	while ((t = LIST_FIRST(slot))) {
+		LIST_REMOVE(t, entries);
+		timer_place(t);
+	}
+}
+
+/* Calls func(arg) msec from now, or a tick later, which replaces what t was
+ * set to before.  Timers set for the same tick are called in no particular
+ * order.
+ */
+void
+timer_set(struct timer *t, unsigned long msec, void (*func)(void *arg),
+    void *arg)
+{
+	uint64_t now = timer_ms();
+
+	timer_start(now);
+	timer_cancel(t);
+
+	t->func = func;
+	t->arg = arg;
+	t->due = (now + msec + TIMER_TICK - 1) / TIMER_TICK;
+	if (t->due <= ticks)
+		t->due = ticks + 1;
+	t->pending = true;
+	ntimers++;
+	timer_place(t);
+}
+
+void
+timer_cancel(struct timer *t)
+{
+	if (!t->pending)
+		return;
+	LIST_REMOVE(t, entries);
+	t->pending = false;
+	ntimers--;
+}
+
+bool
+timer_pending(struct timer *t)
+{
+	return t->pending;
+}
+
+/* The time of day, as of the last pass through the event loop.  It costs a
+ * load, not a system call, so it's fine for stamping each line of input.
+ */
+time_t
+timer_now(void)
+{
+	time_t now = atomic_load_explicit(&wallclock, memory_order_relaxed);
+
+	/* before the loop starts, and in programs without one */
+	return now ? now : time(NULL);
+}
+
+/* calls the timers that are due, and reads the time of day */
+void
+timer_run(void)
+{
+	uint64_t now = timer_ms();
+	struct timerlist *slot;
+	struct timer *t;
+	int level;
+
+	atomic_store_explicit(&wallclock, time(NULL), memory_order_relaxed);
+	timer_start(now);
+
+	now /= TIMER_TICK;
+	while (ticks < now) {
+		ticks++;
+
+		/* a lap of each ring starts the next one's next slot */
+		for (level = 1; level < TIMER_LEVELS; level++) {
+			if ((ticks >> (TIMER_BITS * (level - 1))) & TIMER_MASK)
+				break;
+			timer_cascade(level);
+		}
+
+		/* func can set or cancel any timer, including the next one */
+		slot = &wheel[0][ticks & TIMER_MASK];
+		while ((t = LIST_FIRST(slot))) {
+			LIST_REMOVE(t, entries);
+			if (t->due > ticks) {
+				/* past TIMER_SPAN when it was placed */
+				timer_place(t);
+				continue;
+			}
+			t->pending = false;
+			ntimers--;
+			t->func(t->arg);
+		}
+	}
+}
+
+/* Milliseconds until timer_run() has something to do, for event_wait().  It
+ * doesn't look past the end of the first ring's lap, when the next slot of
+ * the second one moves down, or TIMER_CLOCK.
+ */
+int
+timer_timeout(void)
+{
+	uint64_t now = timer_ms();
+	uint64_t next;
+	int64_t ms;
+
+	timer_start(now);
+
+	for (next = ticks + 1; next < ticks + TIMER_CLOCK / TIMER_TICK;
+	     next++) {
+		if (!(next & TIMER_MASK) ||
+		    (ntimers && !LIST_EMPTY(&wheel[0][next & TIMER_MASK])))
+			break;
+	}
+
+	ms = (int64_t)(next * TIMER_TICK) - (int64_t)now;
+	return (ms > 0) ? (int)ms : 0;
+}
+
+#ifdef TESTTIMER
+#include <assert.h>
+
+#define NTEST 20000
+
+struct testtimer {
+	struct timer t;
+	uint64_t want; /* ms */
+	bool fired;
+};
+
+static struct testtimer tt[NTEST];
+static int nfired;
+static uint64_t lastms; /* the clock at the timer_run() before */
+
+static void
+fire(void *arg)
+{
+	struct testtimer *p = arg;
+
+	/* never early, and on the first run after the tick it was due on */
+	assert(!p->fired);
+	assert(fakems >= p->want);
+	assert(lastms < p->want + TIMER_TICK);
+	p->fired = true;
+	nfired++;
+}
+
+/* the farthest timer is re-set from its own callback */
+static struct timer chain;
+static int nchain;
+
+static void
+rechain(void *arg)
+{
+	(void)arg;
+	if (++nchain < 100)
+		timer_set(&chain, 250, rechain, NULL);
+}
+
+int
+main(int argc, char **argv)
+{
+	uint64_t end = 0, step;
+	int i, ncancelled = 0, timeout;
+
+	srandom(1);
+	fakems = lastms = 1234567; /* not on a tick, nor a lap */
+
+	for (i = 0; i < NTEST; i++) {
+		unsigned long msec;
+
+		switch (i % 4) {
+		case 0:
+			msec = random() % 2000;
+			break;
+		case 1:
+			msec = random() % 600000;
+			break;
+		case 2:
+			msec = random() % (3600UL * 1000 * 30);
+			break;
+		default:
+			msec = random() % (86400UL * 1000 * 40);
+			break;
+		}
+		tt[i].want = fakems + msec;
+		if (tt[i].want > end)
+			end = tt[i].want;
+		timer_set(&tt[i].t, msec, fire, &tt[i]);
+	}
+	timer_set(&chain, 250, rechain, NULL);
+
+	/* setting again replaces, cancelling twice is harmless */
+	for (i = 0; i < NTEST; i += 7) {
+		if (i % 2) {
+			timer_cancel(&tt[i].t);
+			timer_cancel(&tt[i].t);
+			ncancelled++;
+		} else {
+			tt[i].want = fakems + 5000;
+			timer_set(&tt[i].t, 5000, fire, &tt[i]);
+		}
+	}
+
+	timeout = timer_timeout();
+	assert((timeout >= 0) && (timeout <= TIMER_CLOCK));
+
+	/* an event loop that sleeps as long as it's told, or less */
+	while (fakems <= end + TIMER_TICK) {
+		timeout = timer_timeout();
+		assert((timeout >= 0) && (timeout <= TIMER_CLOCK));
+		step = (random() % 8) ? (uint64_t)timeout : random() % 50000;
+		lastms = fakems;
+		fakems += step ? step : 1;
+		timer_run();
+	}
+
+	for (i = 0; i < NTEST; i++) {
+		assert(!timer_pending(&tt[i].t));
+		assert(tt[i].fired == !((i % 7 == 0) && (i % 2)));
+	}
+	assert(nfired == NTEST - ncancelled);
+	assert(nchain == 100);
+	assert(ntimers == 0);
+
+	printf("%d timers fired, %d cancelled, %d chained\n", nfired,
+	    ncancelled, nchain);
+	return 0;
+}
+#endif
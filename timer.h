@@ -0,0 +1,65 @@
+/*
+ * Copyright 2008-2025, Bolton-Dormer Research Partnership
+ *
+ * The BSD 2-Clause License
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *
+ *     2. Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* timer.h - things the main thread does on a schedule, and the time of day
+ */
+
+#ifndef _TIMER_H_
+#define _TIMER_H_
+
+#include <sys/types.h>
+#include <sys/queue.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#define TIMER_TICK 100 /* milliseconds, the finest a timer can be set */
+
+/* A timer is set by timer_set() and calls func(arg) once when it's due.  A
+ * zeroed struct timer isn't set.
+ */
+struct timer {
+	LIST_ENTRY(timer) entries;
+	uint64_t due; /* in ticks */
+	void (*func)(void *arg);
+	void *arg;
+	bool pending;
+};
+
+void timer_cancel(struct timer *t);
+time_t timer_now(void);
+bool timer_pending(struct timer *t);
+void timer_run(void);
+void timer_set(struct timer *t, unsigned long msec, void (*func)(void *arg),
+    void *arg);
+int timer_timeout(void);
+
+#endif
@@ -0,0 +1,440 @@
+/*
+ * Copyright 2025 Jillian Alana Bolton
+ *
+ * The BSD 2-Clause License
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *
+ *     2. Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* tls.c - settings for the TLS listener: groups, ciphers, and resumption
+ *
+ * A full handshake costs the server a key exchange and a signature.  A
+ * client that comes back with a session ticket skips the signature, which
+ * is most of the cost with an RSA certificate, so a restart that drops
+ * every TLS player at once is far cheaper when they resume.
+ *
+ * Tickets are stateless: the session is encrypted with a key only the
+ * server knows and handed to the client.  OpenSSL would make up a key at
+ * startup, which a restart would throw away, so lorien keeps its own keys
+ * in TLS_TICKET_FILE and replaces the newest every TLS_TICKET_HOURS.  A
+ * ticket under the key before that one still resumes, and the client is
+ * given a fresh ticket.
+ *
+ * Handshakes run on the shard threads, so the keys are behind a lock.
+ *
+ * With kernel TLS, OpenSSL hands the session keys to the socket after the
+ * handshake, and the kernel encrypts whatever is sent.  Output to such a
+ * connection then goes out with send(2), or in a batch through the event
+ * loop, just like output to a plain socket (see servsock_send()).  If the
+ * kernel can't, e.g., the tls module isn't loaded, OpenSSL carries on as
+ * before.
+ */
+
+#include <sys/socket.h>
+
+#include <sys/stat.h>
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L && !defined(LIBRESSL_VERSION_NUMBER)
+#include <openssl/core_names.h>
+#define TLS_EVP_MAC
+#else
+#include <openssl/hmac.h>
+#endif
+
+#include "log.h"
+#include "tls.h"
+
+struct tls_ticket_key {
+	unsigned char name[16];
+	unsigned char aes[32];
+	unsigned char hmac[32];
+	int64_t created;
+};
+
+static char groups[256] = TLS_GROUPS;
+static char ciphersuites[256] = TLS_CIPHERSUITES;
+static char ciphers[512] = TLS_CIPHERS;
+static long cachesize = TLS_CACHE;
+static long tickethours = TLS_TICKET_HOURS;
+static long ktls = TLS_KTLS;
+
+static struct tls_ticket_key keys[TLS_TICKET_KEYS]; /* newest first */
+static int nkeys = 0;
+static pthread_mutex_t keylock = PTHREAD_MUTEX_INITIALIZER;
+
+static int
+setstring(char *dst, size_t size, const char *value)
+{
+	if (!*value || (strlen(value) >= size)) {
+		errno = EINVAL;
+		return -1;
+	}
+	strcpy(dst, value);
+	return 0;
+}
+
+static int
+setnumber(long *dst, const char *value)
+{
+	char *end;
+	long n;
+
+	errno = 0;
+	n = strtol(value, &end, 10);
+	if (errno || (end == value) || *end || (n < 0)) {
+		errno = EINVAL;
+		return -1;
+	}
+	*dst = n;
+	return 0;
+}
+
+/* name=value, from lorien -T.  The names are groups, ciphersuites (TLS
+ * 1.3), ciphers (TLS 1.2), cache (sessions, 0 for none), tickets (hours
+ * between new keys, 0 for no tickets) and ktls (0 or 1).
+ */
+int
+tls_set(const char *setting)
+{
+	const char *value = strchr(setting, '=');
+	size_t len;
+
+	if (!value) {
+		errno = EINVAL;
+		return -1;
+	}
+	len = value++ - setting;
+
+	if ((len == 6) && !strncmp(setting, "groups", len))
+		return setstring(groups, sizeof(groups), value);
+	if ((len == 12) && !strncmp(setting, "ciphersuites", len))
+		return setstring(ciphersuites, sizeof(ciphersuites), value);
+	if ((len == 7) && !strncmp(setting, "ciphers", len))
+		return setstring(ciphers, sizeof(ciphers), value);
+	if ((len == 5) && !strncmp(setting, "cache", len))
+		return setnumber(&cachesize, value);
+	if ((len == 7) && !strncmp(setting, "tickets", len))
+		return setnumber(&tickethours, value);
+	if ((len == 4) && !strncmp(setting, "ktls", len)) {
+		if ((setnumber(&ktls, value) == -1) || (ktls > 1)) {
+			errno = EINVAL;
+			return -1;
+		}
+		return 0;
+	}
+
+	errno = EINVAL;
+	return -1;
+}
+
+static void
+savekeys(void)
+{
+	const char *tmp = TLS_TICKET_FILE ".new";
+	ssize_t len = nkeys * sizeof(keys[0]);
+	int fd;
+
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+	if (fd == -1) {
+		logerror("can't save TLS ticket keys", errno);
+		return;
+	}
+	if ((write(fd, keys, len) != len) || (fsync(fd) == -1)) {
+		logerror("can't save TLS ticket keys", errno);
+		close(fd);
+		unlink(tmp);
+		return;
+	}
+	close(fd);
+	if (rename(tmp, TLS_TICKET_FILE) == -1) {
+		logerror("can't save TLS ticket keys", errno);
+		unlink(tmp);
+	}
+}
+
+/* a key that no ticket should be decrypted with any more */
+static bool
+expired(struct tls_ticket_key *key, time_t now)
+{
+	return (now - key->created) >= (tickethours * 3600 * TLS_TICKET_KEYS);
+}
+
+static int
+rotate(time_t now)
+{
+	struct tls_ticket_key key;
+
+	if ((RAND_bytes(key.name, sizeof(key.name)) != 1) ||
+	    (RAND_bytes(key.aes, sizeof(key.aes)) != 1) ||
+	    (RAND_bytes(key.hmac, sizeof(key.hmac)) != 1))
+		return -1;
+	key.created = now;
+
+	memmove(&keys[1], &keys[0], sizeof(keys) - sizeof(keys[0]));
+	keys[0] = key;
+	if (nkeys < TLS_TICKET_KEYS)
+		nkeys++;
+	OPENSSL_cleanse(&key, sizeof(key));
+	savekeys();
+	return 0;
+}
+
+static void
+loadkeys(time_t now)
+{
+	ssize_t len;
+	int fd;
+	int i;
+
+	fd = open(TLS_TICKET_FILE, O_RDONLY);
+	if (fd == -1) {
+		if (errno != ENOENT)
+			logerror("can't read TLS ticket keys", errno);
+		return;
+	}
+	len = read(fd, keys, sizeof(keys));
+	close(fd);
+	if (len < 0) {
+		logerror("can't read TLS ticket keys", errno);
+		len = 0;
+	}
+
+	nkeys = len / sizeof(keys[0]);
+	for (i = 0; i < nkeys; i++) {
+		/* a clock that went backwards, or keys from far too long ago */
+		if ((keys[i].created > now) || expired(&keys[i], now))
+			break;
+	}
+	nkeys = i;
+}
+
+/* the newest key, replaced first if it's old enough */
+static struct tls_ticket_key *
+currentkey(time_t now)
+{
+	if ((nkeys == 0) || (now - keys[0].created) >= (tickethours * 3600)) {
+		if (rotate(now) == -1)
+			return NULL;
+	}
+	return &keys[0];
+}
+
+#ifdef TLS_EVP_MAC
+static int
+setmac(EVP_MAC_CTX *hctx, struct tls_ticket_key *key)
+{
+	OSSL_PARAM params[3];
+
+	params[0] = OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY,
+	    key->hmac, sizeof(key->hmac));
+	params[1] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST,
+	    "sha256", 0);
+	params[2] = OSSL_PARAM_construct_end();
+	return EVP_MAC_CTX_set_params(hctx, params);
+}
+#else
+static int
+setmac(HMAC_CTX *hctx, struct tls_ticket_key *key)
+{
+	return HMAC_Init_ex(hctx, key->hmac, sizeof(key->hmac), EVP_sha256(),
+	    NULL);
+}
+#endif
+
+/* OpenSSL asks for a key to encrypt a new ticket (enc), or for the key
+ * named in a ticket a client brought back.  Returns 1 to go ahead, 2 to
+ * resume but issue a new ticket, 0 for a full handshake, or -1 on failure.
+ */
+static int
+ticketkey(SSL *ssl, unsigned char name[16], unsigned char *iv,
+    EVP_CIPHER_CTX *ectx,
+#ifdef TLS_EVP_MAC
+    EVP_MAC_CTX *hctx,
+#else
+    HMAC_CTX *hctx,
+#endif
+    int enc)
+{
+	struct tls_ticket_key *key = NULL;
+	time_t now = time(NULL);
+	int rc = -1;
+	int i;
+
+	(void)ssl;
+	pthread_mutex_lock(&keylock);
+	if (enc) {
+		key = currentkey(now);
+		if (!key || (RAND_bytes(iv, EVP_MAX_IV_LENGTH) != 1))
+			goto out;
+		memcpy(name, key->name, sizeof(key->name));
+		if (!EVP_EncryptInit_ex(ectx, EVP_aes_256_cbc(), NULL, key->aes,
+			iv) ||
+		    !setmac(hctx, key))
+			goto out;
+		rc = 1;
+		goto out;
+	}
+
+	for (i = 0; i < nkeys; i++) {
+		if (!memcmp(name, keys[i].name, sizeof(keys[i].name)))
+			key = &keys[i];
+	}
+	if (!key || expired(key, now)) {
+		rc = 0;
+		goto out;
+	}
+	if (!setmac(hctx, key) ||
+	    !EVP_DecryptInit_ex(ectx, EVP_aes_256_cbc(), NULL, key->aes, iv))
+		goto out;
+	rc = (key == &keys[0]) ? 1 : 2;
+out:
+	pthread_mutex_unlock(&keylock);
+	return rc;
+}
+
+/* Whether the kernel has the tls module, which is loaded on demand.  It
+ * refuses an unconnected socket, but only once it's there.
+ */
+static bool
+ktls_available(void)
+{
+#ifdef TCP_ULP
+	int fd, rc, e;
+
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd == -1)
+		return false;
+	rc = setsockopt(fd, IPPROTO_TCP, TCP_ULP, "tls", sizeof("tls"));
+	e = errno;
+	close(fd);
+	return (rc == 0) || (e != ENOENT);
+#else
+	return false;
+#endif
+}
+
+/* true if what's sent on the connection is encrypted by the kernel, which
+ * is only known once the handshake is done
+ */
+bool
+tls_ktls(SSL *ssl)
+{
+#ifdef BIO_get_ktls_send
+	return ktls && BIO_get_ktls_send(SSL_get_wbio(ssl));
+#else
+	(void)ssl;
+	return false;
+#endif
+}
+
+/* called by getsock_ssl() on the TLS listener's context */
+int
+tls_setup(SSL_CTX *ctx)
+{
+	static const unsigned char sid[] = "lorien";
+	time_t now = time(NULL);
+	char buf[sizeof(groups) + 64];
+
+	if (!SSL_CTX_set1_groups_list(ctx, groups)) {
+		logmsg("bad TLS groups");
+		return -1;
+	}
+	if (!SSL_CTX_set_ciphersuites(ctx, ciphersuites)) {
+		logmsg("bad TLS ciphersuites");
+		return -1;
+	}
+	if (!SSL_CTX_set_cipher_list(ctx, ciphers)) {
+		logmsg("bad TLS ciphers");
+		return -1;
+	}
+	SSL_CTX_set_options(ctx, SSL_OP_CIPHER_SERVER_PREFERENCE);
+#ifdef SSL_OP_IGNORE_UNEXPECTED_EOF
+	/* most clients just hang up, which would keep their sessions out of
+	 * the cache.  Nothing is lost to truncation: input is taken a line at
+	 * a time.
+	 */
+	SSL_CTX_set_options(ctx, SSL_OP_IGNORE_UNEXPECTED_EOF);
+#endif
+
+	SSL_CTX_set_session_id_context(ctx, sid, sizeof(sid) - 1);
+	if (cachesize) {
+		SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+		SSL_CTX_sess_set_cache_size(ctx, cachesize);
+	} else
+		SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
+
+	if (tickethours) {
+		pthread_mutex_lock(&keylock);
+		loadkeys(now);
+		if (!currentkey(now)) {
+			pthread_mutex_unlock(&keylock);
+			logmsg("can't make a TLS ticket key");
+			return -1;
+		}
+		pthread_mutex_unlock(&keylock);
+#ifdef TLS_EVP_MAC
+		SSL_CTX_set_tlsext_ticket_key_evp_cb(ctx, ticketkey);
+#else
+		SSL_CTX_set_tlsext_ticket_key_cb(ctx, ticketkey);
+#endif
+		SSL_CTX_set_timeout(ctx, tickethours * 3600 * TLS_TICKET_KEYS);
+	} else {
+		SSL_CTX_set_options(ctx, SSL_OP_NO_TICKET);
+		SSL_CTX_set_timeout(ctx, TLS_TICKET_HOURS * 3600);
+	}
+
+#ifdef SSL_OP_ENABLE_KTLS
+	if (ktls && ktls_available())
+		SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+	else if (ktls) {
+		logmsg("kernel TLS isn't available (no tls module?)");
+		ktls = 0;
+	}
+#else
+	ktls = 0;
+#endif
+
+	snprintf(buf, sizeof(buf),
+	    "TLS: groups %s, tickets %s, session cache %ld, kernel TLS %s",
+	    groups, tickethours ? "on" : "off", cachesize, ktls ? "on" : "off");
+	logmsg(buf);
+	return 0;
+}
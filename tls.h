@@ -0,0 +1,77 @@
+/*
+ * Copyright 2025 Jillian Alana Bolton
+ *
+ * The BSD 2-Clause License
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *
+ *     2. Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* tls.h - settings for the TLS listener: groups, ciphers, and resumption
+ */
+
+#ifndef _TLS_H_
+#define _TLS_H_
+
+#include <openssl/ssl.h>
+#include <stdbool.h>
+
+/* key exchange groups and ciphers, most preferred first.  X25519 and ECDSA
+ * are the cheapest for the server; the rest are there for older clients,
+ * and HIGH keeps whatever else OpenSSL would have offered them.
+ */
+#define TLS_GROUPS "X25519:P-256:P-384"
+#define TLS_CIPHERSUITES                                       \
+	"TLS_AES_128_GCM_SHA256:TLS_CHACHA20_POLY1305_SHA256:" \
+	"TLS_AES_256_GCM_SHA384"
+#define TLS_CIPHERS                                                    \
+	"ECDHE-ECDSA-AES128-GCM-SHA256:ECDHE-ECDSA-CHACHA20-POLY1305:" \
+	"ECDHE-ECDSA-AES256-GCM-SHA384:ECDHE-RSA-AES128-GCM-SHA256:"   \
+	"ECDHE-RSA-CHACHA20-POLY1305:ECDHE-RSA-AES256-GCM-SHA384:"     \
+	"HIGH:!aNULL:!MD5"
+
+/* session tickets are encrypted with a key that is replaced every
+ * TLS_TICKET_HOURS.  The one before it is kept, so a ticket is good for
+ * up to twice that.  The keys are saved in TLS_TICKET_FILE so that clients
+ * can resume after a restart.
+ */
+#define TLS_TICKET_HOURS 12
+#define TLS_TICKET_FILE	 "ticket.keys"
+#define TLS_TICKET_KEYS	 2
+
+/* sessions remembered by the server for clients that don't take tickets,
+ * or 0 for none
+ */
+#define TLS_CACHE 0
+
+/* 1 to have the kernel encrypt what's sent once the handshake is done, where
+ * it can (Linux with the tls module, and OpenSSL 3)
+ */
+#define TLS_KTLS 1
+
+bool tls_ktls(SSL *ssl);
+int tls_set(const char *setting);
+int tls_setup(SSL_CTX *ctx);
+
+#endif
@@ -31,6 +31,24 @@
 /* trie.c - routines to implement a trie with a variety of search algorithms
  * Jillian Alana Bolton
  *
+ * The trie is an adaptive radix tree (Leis et al., "The Adaptive Radix
+ * Tree", ICDE 2013).  An inner node has room for 4, 16, 48 or 256
+ * children, and is replaced by the next size up or down as keys come and
+ * go, so it costs about what its children need instead of 256 pointers.
+ * Bytes that every key below a node shares are kept in the node as its
+ * prefix, not as a chain of nodes, and a key with nothing else below it
+ * hangs off the last node where it parted from the others as a leaf.
+ *
+ * The leaves are the trie nodes that callers see.  Each one holds a copy
+ * of its key, so a node only keeps the first ART_PREFIX bytes of a long
+ * prefix and reads the rest from any leaf below it.  Leaves stay put while
+ * the nodes above them are replaced.  A key that is the start of longer
+ * ones ends at an inner node, in its leaf slot.
+ *
+ * Each inner node also knows how many keys are below it and which of them
+ * is first, kept up on the way back from an add or delete.  That makes
+ * completing a command a walk down the bytes that were typed, however many
+ * commands there are.
  */
 
 #include <sys/queue.h>
@@ -42,27 +60,810 @@
 #include <ctype.h>
 #include <err.h>
 #include <errno.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sysexits.h>
+#include <time.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "trie.h"
 
+#define ART_PREFIX 8 /* prefix bytes kept in a node */
+
+enum art_type { ART_NODE4, ART_NODE16, ART_NODE48, ART_NODE256 };
+
+struct art_node {
+	uint8_t type;
+	uint16_t n;			  /* children */
+	uint32_t plen;			  /* bytes in the prefix */
+	uint32_t count;			  /* keys at or below this node */
+	unsigned char prefix[ART_PREFIX]; /* the first of them */
+	trie *leaf;			  /* the key that ends after them */
+	trie *first;			  /* the smallest key below */
+};
+
+/* children in byte order */
+struct art_node4 {
+	struct art_node h;
+	unsigned char keys[4];
+	void *child[4];
+};
+
+struct art_node16 {
+	struct art_node h;
+	unsigned char keys[16];
+	void *child[16];
+};
+
+/* index[c] is 1 + the slot of the child for c, or 0 */
+struct art_node48 {
+	struct art_node h;
+	unsigned char index[256];
+	void *child[48];
+};
+
+struct art_node256 {
+	struct art_node h;
+	void *child[256];
+};
+
+static const size_t art_size[] = { sizeof(struct art_node4),
+	sizeof(struct art_node16), sizeof(struct art_node48),
+	sizeof(struct art_node256) };
+static const int art_room[] = { 4, 16, 48, 256 };
+
+/* a child is an inner node or, with the low bit set, a leaf */
+#define ART_ISLEAF(p) ((uintptr_t)(p) & 1)
+#define ART_LEAF(p)   ((trie *)((uintptr_t)(p) & ~(uintptr_t)1))
+#define ART_TAG(l)    ((void *)((uintptr_t)(l) | 1))
+
+#define ART_MIN(a, b) (((a) < (b)) ? (a) : (b))
+
+/* Nodes and leaves come from slabs that belong to the trie, carved off in
+ * order, so that keys added together sit together.  What's freed goes on a
+ * list for its size and is used again before the slab is, so a trie that
+ * keys come and go from stops calling malloc().  The slabs start small and
+ * double, up to ART_SLAB_MAX, and trie_collapse() frees them whole.  A
+ * leaf too big for any list gets a slab of its own.
+ */
+#define ART_ALIGN     16
+#define ART_ROUND(sz) (((sz) + ART_ALIGN - 1) & ~(size_t)(ART_ALIGN - 1))
+#define ART_SMALL     256 /* the biggest leaf kept on a list */
+#define ART_CLASSES   (ART_SMALL / ART_ALIGN + 2) /* and the 48 and 256 */
+#define ART_SLAB_MIN  1024
+#define ART_SLAB_MAX  65536
+
+struct art_slab {
+	LIST_ENTRY(art_slab) entries;
+	size_t size; /* bytes after the header */
+	size_t used;
+};
+
+#define ART_SLABHDR ART_ROUND(sizeof(struct art_slab))
+
+/* what a root's tree points to */
+struct art_heap {
+	void *top;
+	LIST_HEAD(, art_slab) slabs;
+	struct art_slab *cur;	 /* the one being carved */
+	void *free[ART_CLASSES]; /* by size, linked through their first word */
+	struct trie_stats stats;
+};
+
+static int
+art_class(size_t sz)
+{
+	if (sz <= ART_SMALL)
+		return ART_ROUND(sz) / ART_ALIGN - 1;
+	if (sz == sizeof(struct art_node48))
+		return ART_CLASSES - 2;
+	if (sz == sizeof(struct art_node256))
+		return ART_CLASSES - 1;
+	return -1;
+}
+
+static struct art_slab *
+art_newslab(struct art_heap *h, size_t size)
+{
+	struct art_slab *s = malloc(ART_SLABHDR + size);
+
+	if (!s)
+		return NULL;
+	s->size = size;
+	s->used = 0;
+	LIST_INSERT_HEAD(&h->slabs, s, entries);
+	h->stats.slabs++;
+	h->stats.slab_bytes += ART_SLABHDR + size;
+	h->stats.mallocs++;
+	return s;
+}
+
+static void
+art_put(struct art_heap *h, void *p, size_t sz)
+{
+	struct art_slab *s;
+	int cls = art_class(sz);
+
+	if (cls == -1) {
+		s = (struct art_slab *)((char *)p - ART_SLABHDR);
+		LIST_REMOVE(s, entries);
+		h->stats.slabs--;
+		h->stats.slab_bytes -= ART_SLABHDR + s->size;
+		free(s);
+		return;
+	}
+	*(void **)p = h->free[cls];
+	h->free[cls] = p;
+}
+
+static void *
+art_get(struct art_heap *h, size_t sz)
+{
+	struct art_slab *s = h->cur;
+	size_t size, left;
+	int cls = art_class(sz);
+	void *p;
+
+	sz = ART_ROUND(sz);
+	if (cls == -1) {
+		if (!(s = art_newslab(h, sz)))
+			return NULL;
+		s->used = sz;
+		return (char *)s + ART_SLABHDR;
+	}
+
+	if ((p = h->free[cls])) {
+		h->free[cls] = *(void **)p;
+		return p;
+	}
+
+	if (!s || (s->size - s->used < sz)) {
+		size = s ? ART_MIN(2 * s->size, ART_SLAB_MAX) : ART_SLAB_MIN;
+		if (!(h->cur = art_newslab(h, (size < sz) ? sz : size))) {
+			h->cur = s;
+			return NULL;
+		}
+
+		/* what's left of the old one goes on the lists */
+		while (s && ((left = s->size - s->used) >= ART_ALIGN)) {
+			left = ART_MIN(left, ART_SMALL) & ~(size_t)(ART_ALIGN - 1);
+			art_put(h, (char *)s + ART_SLABHDR + s->used, left);
+			s->used += left;
+		}
+		s = h->cur;
+	}
+
+	p = (char *)s + ART_SLABHDR + s->used;
+	s->used += sz;
+	return p;
+}
+
+/* the tree below root, or NULL */
+static void *
+art_top(trie *root)
+{
+	if (!(root && root->tree))
+		return NULL;
+	return ((struct art_heap *)root->tree)->top;
+}
+
 trie *
 trie_new(void)
 {
 	return calloc(1, sizeof(trie));
 }
 
+static struct art_node *
+art_alloc(struct art_heap *h, int type)
+{
+	struct art_node *n = art_get(h, art_size[type]);
+
+	if (n) {
+		memset(n, 0, art_size[type]);
+		n->type = type;
+		h->stats.nodes++;
+		h->stats.bytes += art_size[type];
+	}
+	return n;
+}
+
+static void
+art_free(struct art_heap *h, struct art_node *n)
+{
+	h->stats.nodes--;
+	h->stats.bytes -= art_size[n->type];
+	art_put(h, n, art_size[n->type]);
+}
+
+static trie *
+art_newleaf(struct art_heap *h, const unsigned char *key, size_t ksz,
+    void *payload)
+{
+	trie *l = art_get(h, sizeof(*l) + ksz);
+
+	if (!l)
+		return NULL;
+	h->stats.leaves++;
+	h->stats.bytes += sizeof(*l) + ksz;
+	l->payload = payload;
+	l->tree = NULL;
+	l->ksz = ksz;
+	memcpy(l->key, key, ksz);
+	return l;
+}
+
+static void
+art_freeleaf(struct art_heap *h, trie *l, bool free_payload)
+{
+	if (free_payload)
+		free(l->payload);
+	h->stats.leaves--;
+	h->stats.bytes -= sizeof(*l) + l->ksz;
+	art_put(h, l, sizeof(*l) + l->ksz);
+}
+
+/* the keys and children of a 4 or 16 */
 static int
-find_first_cb(void *ctx, trie *root)
+art_arrays(struct art_node *n, unsigned char **keys, void ***child)
+{
+	if (n->type == ART_NODE4) {
+		*keys = ((struct art_node4 *)n)->keys;
+		*child = ((struct art_node4 *)n)->child;
+	} else {
+		*keys = ((struct art_node16 *)n)->keys;
+		*child = ((struct art_node16 *)n)->child;
+	}
+	return n->n;
+}
+
+static void **
+art_findchild(struct art_node *n, unsigned char c)
 {
-	trie **p = (trie **)ctx;
-	*p = root;
+	struct art_node48 *n48;
+	struct art_node256 *n256;
+	unsigned char *keys;
+	void **child;
+	int i, cnt;
+
+	switch (n->type) {
+	case ART_NODE16:
+#ifdef __SSE2__
+	{
+		struct art_node16 *n16 = (struct art_node16 *)n;
+		int bits;
+
+		/* all 16 keys at once */
+		bits = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_set1_epi8((char)c),
+		    _mm_loadu_si128((__m128i *)n16->keys)));
+		bits &= (1 << n->n) - 1;
+		return bits ? &n16->child[__builtin_ctz(bits)] : NULL;
+	}
+#endif
+	case ART_NODE4:
+		cnt = art_arrays(n, &keys, &child);
+		for (i = 0; i < cnt; i++)
+			if (keys[i] == c)
+				return &child[i];
+		return NULL;
+	case ART_NODE48:
+		n48 = (struct art_node48 *)n;
+		i = n48->index[c];
+		return i ? &n48->child[i - 1] : NULL;
+	default:
+		n256 = (struct art_node256 *)n;
+		return n256->child[c] ? &n256->child[c] : NULL;
+	}
+}
+
+/* Children in byte order, or backwards: *i starts at art_begin() and each
+ * call returns the next child, with its byte in *c, or NULL at the end.
+ */
+static int
+art_begin(struct art_node *n, bool backwards)
+{
+	if (!backwards)
+		return 0;
+	return (n->type <= ART_NODE16) ? n->n - 1 : 255;
+}
+
+static void *
+art_step(struct art_node *n, int *i, unsigned char *c, bool backwards)
+{
+	struct art_node48 *n48 = (struct art_node48 *)n;
+	struct art_node256 *n256 = (struct art_node256 *)n;
+	int dir = backwards ? -1 : 1;
+	unsigned char *keys;
+	void **child;
+	void *p;
+	int b;
+
+	switch (n->type) {
+	case ART_NODE4:
+	case ART_NODE16:
+		if ((*i < 0) || (*i >= art_arrays(n, &keys, &child)))
+			return NULL;
+		*c = keys[*i];
+		p = child[*i];
+		*i += dir;
+		return p;
+	case ART_NODE48:
+		for (; (*i >= 0) && (*i < 256); *i += dir) {
+			if (n48->index[*i]) {
+				b = *i;
+				*i += dir;
+				*c = b;
+				return n48->child[n48->index[b] - 1];
+			}
+		}
+		return NULL;
+	default:
+		for (; (*i >= 0) && (*i < 256); *i += dir) {
+			if (n256->child[*i]) {
+				b = *i;
+				*i += dir;
+				*c = b;
+				return n256->child[b];
+			}
+		}
+		return NULL;
+	}
+}
+
+/* adds a child past the others, which must have smaller bytes for a 4 or 16 */
+static void
+art_append(struct art_node *n, unsigned char c, void *p)
+{
+	struct art_node48 *n48 = (struct art_node48 *)n;
+	unsigned char *keys;
+	void **child;
+
+	switch (n->type) {
+	case ART_NODE4:
+	case ART_NODE16:
+		(void)art_arrays(n, &keys, &child);
+		keys[n->n] = c;
+		child[n->n] = p;
+		break;
+	case ART_NODE48:
+		n48->child[n->n] = p;
+		n48->index[c] = n->n + 1;
+		break;
+	default:
+		((struct art_node256 *)n)->child[c] = p;
+		break;
+	}
+	n->n++;
+}
+
+/* a copy of n in a node of another size, or NULL */
+static struct art_node *
+art_resize(struct art_heap *h, struct art_node *n, int type)
+{
+	struct art_node *nn = art_alloc(h, type);
+	unsigned char c;
+	void *p;
+	int i;
+
+	if (!nn)
+		return NULL;
+
+	nn->plen = n->plen;
+	nn->count = n->count;
+	memcpy(nn->prefix, n->prefix, sizeof(nn->prefix));
+	nn->leaf = n->leaf;
+	nn->first = n->first;
+
+	i = art_begin(n, false);
+	while ((p = art_step(n, &i, &c, false)))
+		art_append(nn, c, p);
+	return nn;
+}
+
+/* *ref is n, which is replaced if it has to grow */
+static int
+art_addchild(struct art_heap *h, void **ref, struct art_node *n,
+    unsigned char c, void *p)
+{
+	struct art_node *nn;
+	unsigned char *keys;
+	void **child;
+	int i, cnt;
+
+	if (n->n == art_room[n->type]) {
+		nn = art_resize(h, n, n->type + 1);
+		if (!nn)
+			return -1;
+		*ref = nn;
+		art_free(h, n);
+		n = nn;
+	}
+
+	if (n->type > ART_NODE16) {
+		art_append(n, c, p);
+		return 0;
+	}
+
+	cnt = art_arrays(n, &keys, &child);
+	for (i = 0; (i < cnt) && (keys[i] < c); i++)
+		/* EMPTY */;
+	memmove(&keys[i + 1], &keys[i], cnt - i);
+	memmove(&child[i + 1], &child[i], (cnt - i) * sizeof(*child));
+	keys[i] = c;
+	child[i] = p;
+	n->n++;
 	return 0;
 }
 
+/* the smallest key at or below p */
+static trie *
+art_first(void *p)
+{
+	if (!p)
+		return NULL;
+	return ART_ISLEAF(p) ? ART_LEAF(p) : ((struct art_node *)p)->first;
+}
+
+/* the keys at or below p */
+static size_t
+art_keys(void *p)
+{
+	if (!p)
+		return 0;
+	return ART_ISLEAF(p) ? 1 : ((struct art_node *)p)->count;
+}
+
+/* n's smallest key, after it was lost; a 48 or 256 looks for its first
+ * child
+ */
+static void
+art_refirst(struct art_node *n)
+{
+	unsigned char c;
+	int i;
+
+	if (n->leaf) {
+		n->first = n->leaf;
+		return;
+	}
+	i = art_begin(n, false);
+	n->first = art_first(art_step(n, &i, &c, false));
+}
+
+/* a key was added to child, n's child for the key's byte at depth */
+static void
+art_added(struct art_node *n, void *child, size_t depth)
+{
+	trie *l = art_first(child);
+
+	n->count++;
+
+	/* the keys below n match up to depth, so one byte tells */
+	if ((n->first != n->leaf) && (l->key[depth] <= n->first->key[depth]))
+		n->first = l;
+}
+
+/* all of n's prefix, which starts at depth in the keys below it */
+static const unsigned char *
+art_prefix(struct art_node *n, size_t depth)
+{
+	if (n->plen <= ART_PREFIX)
+		return n->prefix;
+	return n->first->key + depth;
+}
+
+/* how much of n's prefix key has from depth */
+static size_t
+art_prefixmatch(struct art_node *n, const unsigned char *key, size_t ksz,
+    size_t depth)
+{
+	const unsigned char *pfx;
+	size_t i, max;
+
+	if (!n->plen)
+		return 0;
+
+	pfx = art_prefix(n, depth);
+	max = ART_MIN(n->plen, ksz - depth);
+	for (i = 0; (i < max) && (pfx[i] == key[depth + i]); i++)
+		/* EMPTY */;
+	return i;
+}
+
+/* where key parts from l, which it matches up to depth */
+static size_t
+art_common(trie *l, const unsigned char *key, size_t ksz, size_t depth)
+{
+	while ((depth < l->ksz) && (depth < ksz) &&
+	    (l->key[depth] == key[depth]))
+		depth++;
+	return depth;
+}
+
+/* l's place in a new node whose prefix ends at depth */
+static void
+art_hang(struct art_heap *h, struct art_node *n, trie *l, size_t depth)
+{
+	if (l->ksz == depth)
+		n->leaf = l;
+	else
+		(void)art_addchild(h, NULL, n, l->key[depth], ART_TAG(l));
+	n->count++;
+	art_refirst(n);
+}
+
+/* n is the only child of a node that is going away, through byte c */
+static void
+art_merge(struct art_node *parent, unsigned char c, struct art_node *n)
+{
+	unsigned char buf[ART_PREFIX];
+	size_t len = 0, i;
+
+	for (i = 0; (i < parent->plen) && (len < ART_PREFIX); i++)
+		buf[len++] = parent->prefix[i];
+	if (len < ART_PREFIX)
+		buf[len++] = c;
+	for (i = 0; (i < n->plen) && (len < ART_PREFIX); i++)
+		buf[len++] = n->prefix[i];
+
+	memcpy(n->prefix, buf, len);
+	n->plen += parent->plen + 1;
+}
+
+/* *ref is a node that lost a child or its leaf */
+static void
+art_shrink(struct art_heap *h, void **ref)
+{
+	struct art_node *n = *ref, *nn;
+	unsigned char c;
+	void *only;
+	int i;
+
+	if (!n->n) {
+		*ref = n->leaf ? ART_TAG(n->leaf) : NULL;
+		art_free(h, n);
+		return;
+	}
+
+	/* a node with one way through is folded into the one below */
+	if ((n->n == 1) && !n->leaf) {
+		i = art_begin(n, false);
+		only = art_step(n, &i, &c, false);
+		if (!ART_ISLEAF(only))
+			art_merge(n, c, only);
+		*ref = only;
+		art_free(h, n);
+		return;
+	}
+
+	/* some slack, so that a key coming and going doesn't resize */
+	if ((n->type == ART_NODE16 && n->n <= 3) ||
+	    (n->type == ART_NODE48 && n->n <= 12) ||
+	    (n->type == ART_NODE256 && n->n <= 40)) {
+		/* if there's no memory, it can stay as it is */
+		if ((nn = art_resize(h, n, n->type - 1))) {
+			*ref = nn;
+			art_free(h, n);
+		}
+	}
+}
+
+static void
+art_removechild(struct art_node *n, unsigned char c)
+{
+	struct art_node48 *n48 = (struct art_node48 *)n;
+	unsigned char *keys;
+	void **child;
+	int i, cnt, slot;
+
+	switch (n->type) {
+	case ART_NODE4:
+	case ART_NODE16:
+		cnt = art_arrays(n, &keys, &child);
+		for (i = 0; (i < cnt) && (keys[i] != c); i++)
+			/* EMPTY */;
+		memmove(&keys[i], &keys[i + 1], cnt - i - 1);
+		memmove(&child[i], &child[i + 1],
+		    (cnt - i - 1) * sizeof(*child));
+		break;
+	case ART_NODE48:
+		/* the last slot fills the hole */
+		slot = n48->index[c] - 1;
+		n48->index[c] = 0;
+		if (slot != n->n - 1) {
+			n48->child[slot] = n48->child[n->n - 1];
+			for (i = 0; i < 256; i++)
+				if (n48->index[i] == n->n) {
+					n48->index[i] = slot + 1;
+					break;
+				}
+		}
+		n48->child[n->n - 1] = NULL;
+		break;
+	default:
+		((struct art_node256 *)n)->child[c] = NULL;
+		break;
+	}
+	n->n--;
+}
+
+static trie *
+art_insert(struct art_heap *h, void **ref, const unsigned char *key,
+    size_t ksz, size_t depth, void *payload, int *status)
+{
+	const unsigned char *pfx;
+	struct art_node *n, *nn;
+	trie *l, *nl;
+	void **child;
+	size_t m;
+
+	if (!*ref) {
+		if (!(nl = art_newleaf(h, key, ksz, payload)))
+			goto nomem;
+		*ref = ART_TAG(nl);
+		return nl;
+	}
+
+	if (ART_ISLEAF(*ref)) {
+		l = ART_LEAF(*ref);
+		if ((l->ksz == ksz) && !memcmp(l->key, key, ksz)) {
+			*status = EEXIST;
+			return l;
+		}
+
+		/* a node for what the two keys share, and both below it */
+		m = art_common(l, key, ksz, depth);
+		nn = art_alloc(h, ART_NODE4);
+		nl = art_newleaf(h, key, ksz, payload);
+		if (!nn || !nl)
+			goto nomem2;
+		nn->plen = m - depth;
+		memcpy(nn->prefix, key + depth, ART_MIN(nn->plen, ART_PREFIX));
+		art_hang(h, nn, l, m);
+		art_hang(h, nn, nl, m);
+		*ref = nn;
+		return nl;
+	}
+
+	n = *ref;
+	if (n->plen) {
+		m = art_prefixmatch(n, key, ksz, depth);
+		if (m < n->plen) {
+			/* key leaves the prefix part way: split it there */
+			nn = art_alloc(h, ART_NODE4);
+			nl = art_newleaf(h, key, ksz, payload);
+			if (!nn || !nl)
+				goto nomem2;
+			nn->plen = m;
+			memcpy(nn->prefix, key + depth, ART_MIN(m, ART_PREFIX));
+
+			pfx = art_prefix(n, depth);
+			(void)art_addchild(h, NULL, nn, pfx[m], n);
+			nn->count = n->count;
+			n->plen -= m + 1;
+			memmove(n->prefix, pfx + m + 1,
+			    ART_MIN(n->plen, ART_PREFIX));
+
+			art_hang(h, nn, nl, depth + m);
+			*ref = nn;
+			return nl;
+		}
+		depth += n->plen;
+	}
+
+	if (depth == ksz) {
+		if (n->leaf) {
+			*status = EEXIST;
+			return n->leaf;
+		}
+		if (!(n->leaf = art_newleaf(h, key, ksz, payload)))
+			goto nomem;
+		n->count++;
+		n->first = n->leaf;
+		return n->leaf;
+	}
+
+	if ((child = art_findchild(n, key[depth]))) {
+		nl = art_insert(h, child, key, ksz, depth + 1, payload, status);
+		if (nl && !*status)
+			art_added(n, *child, depth);
+		return nl;
+	}
+
+	if (!(nl = art_newleaf(h, key, ksz, payload)))
+		goto nomem;
+	if (art_addchild(h, ref, n, key[depth], ART_TAG(nl)) == -1) {
+		art_freeleaf(h, nl, false);
+		goto nomem;
+	}
+	art_added(*ref, ART_TAG(nl), depth);
+	return nl;
+
+nomem2:
+	if (nn)
+		art_free(h, nn);
+	if (nl)
+		art_freeleaf(h, nl, false);
+nomem:
+	*status = ENOMEM;
+	return NULL;
+}
+
+static trie *
+art_remove(struct art_heap *h, void **ref, const unsigned char *key,
+    size_t ksz, size_t depth)
+{
+	struct art_node *n;
+	void **child;
+	trie *l;
+
+	if (!*ref)
+		return NULL;
+
+	if (ART_ISLEAF(*ref)) {
+		l = ART_LEAF(*ref);
+		if ((l->ksz != ksz) || memcmp(l->key, key, ksz))
+			return NULL;
+		*ref = NULL;
+		return l;
+	}
+
+	n = *ref;
+	if (art_prefixmatch(n, key, ksz, depth) < n->plen)
+		return NULL;
+	depth += n->plen;
+
+	if (depth == ksz) {
+		if (!(l = n->leaf))
+			return NULL;
+		n->leaf = NULL;
+		n->count--;
+		art_refirst(n);
+		art_shrink(h, ref);
+		return l;
+	}
+
+	if (!(child = art_findchild(n, key[depth])))
+		return NULL;
+	if (!(l = art_remove(h, child, key, ksz, depth + 1)))
+		return NULL;
+
+	n->count--;
+	if (!*child)
+		art_removechild(n, key[depth]);
+	if (n->first == l)
+		art_refirst(n);
+	if (!*child)
+		art_shrink(h, ref);
+	return l;
+}
+
+/* the leaves' memory goes with the slabs, this is just for the payloads */
+static void
+art_payloads(void *p)
+{
+	struct art_node *n;
+	unsigned char c;
+	void *child;
+	int i;
+
+	if (ART_ISLEAF(p)) {
+		free(ART_LEAF(p)->payload);
+		return;
+	}
+
+	n = p;
+	if (n->leaf)
+		free(n->leaf->payload);
+	i = art_begin(n, false);
+	while ((child = art_step(n, &i, &c, false)))
+		art_payloads(child);
+}
+
 /* given a root, find the first terminator
  * does not check the payload of the supplied root,
  * it only checks the leaves.
@@ -70,47 +871,33 @@ find_first_cb(void *ctx, trie *root)
 trie *
 trie_find_first(trie *root)
 {
-	int rc;
-	trie *first = NULL;
-
-	if (!root)
-		return NULL;
-
-	rc = trie_preorder(root, &first, find_first_cb, 0, TRIE_SPAN);
-	if (rc == -1)
-		return NULL;
-	return first;
+	return art_first(art_top(root));
 }
 
-/* pass true to free the payload, too */
+/* pass true to free the payload, too.  without payloads to free, it's a
+ * free() for each slab, not for each key.
+ */
 int
 trie_collapse(trie *root, bool free_payloads)
 {
-        int i;
-	SLIST_HEAD(f, trie_node) fl = SLIST_HEAD_INITIALIZER(fl);
-	trie *p = root;
+	struct art_heap *h;
+	struct art_slab *s;
 
 	if (!root)
 		return 0;
 
-	do {
-		for (i = 0; i < TRIE_SPAN; i++)
-			if (p->leaves[i]) {
-				SLIST_INSERT_HEAD(&fl, p->leaves[i], entries);
-				p->leaves[i] = NULL;
-			}
-
-		if (free_payloads)
-			free(p->payload);
-		p->payload = NULL;
-
-		free(p);
-		p = NULL;
-		if (!SLIST_EMPTY(&fl)) {
-			p = SLIST_FIRST(&fl);
-			SLIST_REMOVE_HEAD(&fl, entries);
+	if ((h = root->tree)) {
+		if (free_payloads && h->top)
+			art_payloads(h->top);
+		while ((s = LIST_FIRST(&h->slabs))) {
+			LIST_REMOVE(s, entries);
+			free(s);
 		}
-	} while (p);
+		free(h);
+	}
+	if (free_payloads)
+		free(root->payload);
+	free(root);
 
 	return 1;
 }
@@ -121,18 +908,7 @@ trie_collapse(trie *root, bool free_payloads)
 bool
 trie_isempty(trie *root)
 {
-	int i;
-
-	if (trie_find_first(root))
-		return false;
-
-	for (i = 0; i< TRIE_SPAN; i++)
-		if (root->leaves[i]) {
-			errno = EEXIST;
-			warn("found non-null leaf in empty trie");
-		}
-
-	return true;
+	return !art_top(root);
 }
 
 /* trie_delete()
@@ -141,37 +917,26 @@ trie_isempty(trie *root)
  * or 1 if it was found and successfully
  * deleted
  *
+ * nodes that are left with too little in them are shrunk or folded into
+ * the ones around them on the way back up.
  */
 int
 trie_delete(trie *root, unsigned char *key, size_t ksz, bool free_payloads)
 {
-	trie *parent;
-	unsigned char pkey;
+	struct art_heap *h;
+	trie *l;
 
 	if (!(root && key && ksz))
 		return 0;
 
-	do {
-		parent = root;
-		pkey = *key;
-		root = root->leaves[*key++];
-		if (!root)
-			return 0;
-	} while ((--ksz) > 0);
-
-	if (!root->payload)
+	if (!art_top(root))
 		return 0;
 
-	if (free_payloads)
-		free(root->payload);
-
-	root->payload = NULL;
-
-	if (trie_isempty(root)) {
-		parent->leaves[pkey] = NULL;
-		free(root);
-	}
+	h = root->tree;
+	if (!(l = art_remove(h, &h->top, key, ksz, 0)))
+		return 0;
 
+	art_freeleaf(h, l, free_payloads);
 	return 1;
 }
 
@@ -193,67 +958,353 @@ trie_delete(trie *root, unsigned char *key, size_t ksz, bool free_payloads)
 trie *
 trie_add(trie *root, unsigned char *key, size_t ksz, void *payload, int *status)
 {
-	trie *leaf;
-	trie *parent = root;
+	struct art_heap *h;
 	int mystat;
 
-	if (!status)
-		status = &mystat;
+	if (!status)
+		status = &mystat;
+
+	if (!(root && key && ksz && payload))
+		return NULL;
+
+	/* a trie gets its heap with its first key, and keeps it */
+	if (!(h = root->tree)) {
+		if (!(h = calloc(1, sizeof(*h)))) {
+			*status = ENOMEM;
+			return NULL;
+		}
+		LIST_INIT(&h->slabs);
+		h->stats.mallocs = 1;
+		root->tree = h;
+	}
+
+	*status = 0;
+	return art_insert(h, &h->top, key, ksz, 0, payload, status);
+}
+
+/* what root's nodes and leaves take, and what it got from malloc() */
+void
+trie_stats(trie *root, struct trie_stats *st)
+{
+	if (root && root->tree)
+		*st = ((struct art_heap *)root->tree)->stats;
+	else
+		memset(st, 0, sizeof(*st));
+}
+
+void *
+trie_payload(trie *root)
+{
+	return (root) ? root->payload : NULL;
+}
+
+/* keys in byte order, a shorter one before those it starts */
+static int
+art_keycmp(const unsigned char *a, size_t asz, const unsigned char *b,
+    size_t bsz)
+{
+	int rc = memcmp(a, b, ART_MIN(asz, bsz));
+
+	if (rc)
+		return rc;
+	return (asz > bsz) - (asz < bsz);
+}
+
+/* A cursor's stack holds each node between the root and the key it's on,
+ * and the child it went down, so the next key is found from there instead
+ * of from the root.  TRIE_FRAMES of them are kept in the cursor, which is
+ * deeper than message keys or commands go; past that they're moved to
+ * memory from malloc().
+ */
+static struct trie_frame *
+art_frames(struct trie_cursor *c)
+{
+	return c->stack ? c->stack : c->frames;
+}
+
+static int
+art_push(struct trie_cursor *c, void *node, int pos)
+{
+	struct trie_frame *s;
+
+	if (c->depth == c->room) {
+		if (!(s = realloc(c->stack, 2 * c->room * sizeof(*s))))
+			return -1;
+		if (!c->stack)
+			memcpy(s, c->frames, sizeof(c->frames));
+		c->stack = s;
+		c->room *= 2;
+	}
+	art_frames(c)[c->depth].node = node;
+	art_frames(c)[c->depth].pos = pos;
+	c->depth++;
+	return 0;
+}
+
+/* the first key at or below p, or the last one if backwards */
+static trie *
+art_descend(struct trie_cursor *c, void *p, bool backwards)
+{
+	struct art_node *n;
+	unsigned char ch;
+	void *child;
+	int i;
+
+	while (!ART_ISLEAF(p)) {
+		n = p;
+		i = art_begin(n, backwards);
+		if ((n->leaf && !backwards) ||
+		    !(child = art_step(n, &i, &ch, backwards))) {
+			if (art_push(c, n, -1) == -1)
+				return NULL;
+			return n->leaf;
+		}
+		if (art_push(c, n, backwards ? i + 1 : i - 1) == -1)
+			return NULL;
+		p = child;
+	}
+	return ART_LEAF(p);
+}
+
+/* the key after the one the stack leads to, or before it */
+static trie *
+art_advance(struct trie_cursor *c, bool backwards)
+{
+	struct trie_frame *f;
+	struct art_node *n;
+	unsigned char ch;
+	void *child;
+	int i;
+
+	while (c->depth) {
+		f = &art_frames(c)[c->depth - 1];
+		n = f->node;
+		if (f->pos != -1)
+			i = f->pos + (backwards ? -1 : 1);
+		else if (!backwards)
+			i = art_begin(n, false);
+		else
+			goto up; /* the node's own key is before its children */
+
+		if ((child = art_step(n, &i, &ch, backwards))) {
+			f->pos = backwards ? i + 1 : i - 1;
+			return art_descend(c, child, backwards);
+		}
+		if (backwards && n->leaf) {
+			f->pos = -1;
+			return n->leaf;
+		}
+up:
+		c->depth--;
+	}
+	return NULL;
+}
+
+/* The first key at or after key, or, if past, the first after key and
+ * every key that starts with it.
+ */
+static trie *
+art_seek(struct trie_cursor *c, const unsigned char *key, size_t ksz,
+    bool past)
+{
+	const unsigned char *pfx;
+	struct art_node *n;
+	size_t depth = 0, m, max;
+	unsigned char ch;
+	void *p, *child;
+	trie *l;
+	int i;
 
-	if (!(root && key && ksz && payload))
+	c->depth = 0;
+	if (!(p = art_top(c->root)))
 		return NULL;
 
-	do {
-		leaf = parent->leaves[*key++];
-	        if (leaf)
-			parent = leaf;
-		ksz--;
-	} while (leaf && ksz);
+	while (!ART_ISLEAF(p)) {
+		n = p;
+		pfx = art_prefix(n, depth);
+		max = ART_MIN(n->plen, ksz - depth);
+		for (m = 0; (m < max) && (pfx[m] == key[depth + m]); m++)
+			/* EMPTY */;
+
+		/* they part in the prefix, so all of n is before key or after */
+		if (m < max) {
+			if (pfx[m] < key[depth + m])
+				return art_advance(c, false);
+			return art_descend(c, n, false);
+		}
 
-	*status = 0;
+		/* all of n starts with key */
+		depth += m;
+		if (depth == ksz)
+			return past ? art_advance(c, false) :
+				      art_descend(c, n, false);
+
+		/* n's own key is shorter than key, so before it; the first
+		 * child at or after key's next byte is the way on
+		 */
+		i = (n->type > ART_NODE16) ? key[depth] : 0;
+		while ((child = art_step(n, &i, &ch, false)) &&
+		    (ch < key[depth]))
+			/* EMPTY */;
+		if (!child)
+			return art_advance(c, false);
+		if (art_push(c, n, i - 1) == -1)
+			return NULL;
+		if (ch != key[depth])
+			return art_descend(c, child, false);
+		p = child;
+		depth++;
+	}
 
-	if (leaf) {
-		if (ksz)
-			err(EX_SOFTWARE, "search stopped before end of key");
+	l = ART_LEAF(p);
+	if ((art_keycmp(l->key, l->ksz, key, ksz) < 0) ||
+	    (past && (l->ksz >= ksz) && !memcmp(l->key, key, ksz)))
+		return art_advance(c, false);
+	return l;
+}
 
-		if (leaf->payload)
-			*status = EEXIST;
-		else
-			leaf->payload = payload;
+/* l if it's in the cursor's range, which is where the cursor is now */
+static trie *
+art_land(struct trie_cursor *c, trie *l)
+{
+	if (l && c->lo && (art_keycmp(l->key, l->ksz, c->lo, c->losz) < 0))
+		l = NULL;
+	if (l && c->hi && (art_keycmp(l->key, l->ksz, c->hi, c->hisz) > 0) &&
+	    ((l->ksz < c->hisz) || memcmp(l->key, c->hi, c->hisz)))
+		l = NULL;
+	if (!l)
+		c->depth = 0;
+	return c->leaf = l;
+}
 
-		return leaf;
-	}
+/* trie_cursor_open()
+ *
+ * readies c for the keys of root.  it's not on any of them until a seek.
+ */
+void
+trie_cursor_open(struct trie_cursor *c, trie *root)
+{
+	memset(c, 0, sizeof(*c));
+	c->root = root;
+	c->room = TRIE_FRAMES;
+}
 
-	ksz++;
-	key--;
-	trie *newleaves[ksz];
+void
+trie_cursor_close(struct trie_cursor *c)
+{
+	free(c->stack);
+	trie_cursor_open(c, c->root);
+}
 
-	for (int i = 0; i < ksz; i++) {
-		newleaves[i] = trie_new();
-		if (newleaves[i])
-			continue;
+/* trie_cursor_range()
+ *
+ * limits c to the keys from lo up to and including hi, and every key that
+ * starts with hi, and seeks to the first of them.  either can be NULL for
+ * no limit.  to list the keys that start with a prefix, pass it as both.
+ *
+ * lo and hi are not copied and have to last as long as the cursor.
+ */
+trie *
+trie_cursor_range(struct trie_cursor *c, const unsigned char *lo,
+    size_t losz, const unsigned char *hi, size_t hisz)
+{
+	c->lo = lo;
+	c->losz = losz;
+	c->hi = hi;
+	c->hisz = hisz;
+	return trie_cursor_seek(c, NULL, 0);
+}
 
-		for (int j = 0; j < i; j++)
-			free(newleaves[j]);
-		*status = ENOMEM;
-		return NULL;
+/* trie_cursor_seek()
+ *
+ * moves c to the first key at or after key in its range, and returns it.
+ * a NULL key is the first key in the range.
+ *
+ * returns NULL if there's no such key, or if a deep trie needs memory for
+ * the cursor and there is none.  a cursor that returned NULL is on no key
+ * until the next seek.
+ */
+trie *
+trie_cursor_seek(struct trie_cursor *c, const unsigned char *key, size_t ksz)
+{
+	if (!key) {
+		key = (const unsigned char *)"";
+		ksz = 0;
 	}
+	if (c->lo && (art_keycmp(key, ksz, c->lo, c->losz) < 0)) {
+		key = c->lo;
+		ksz = c->losz;
+	}
+	return art_land(c, art_seek(c, key, ksz, false));
+}
 
-	for (int i = 0; i < ksz; i++) {
-		leaf = newleaves[i];
-		parent->leaves[key[i]] = leaf;
-		parent = leaf;
+/* moves c to the last key in its range */
+trie *
+trie_cursor_last(struct trie_cursor *c)
+{
+	trie *l = NULL;
+
+	/* just before the first key past the range */
+	if (c->hi && art_seek(c, c->hi, c->hisz, true))
+		l = art_advance(c, true);
+	else if (art_top(c->root)) {
+		c->depth = 0;
+		l = art_descend(c, art_top(c->root), true);
 	}
+	return art_land(c, l);
+}
 
-	leaf->payload = payload;
+trie *
+trie_cursor_next(struct trie_cursor *c)
+{
+	if (!c->leaf)
+		return NULL;
+	return art_land(c, art_advance(c, false));
+}
 
-	return leaf;
+trie *
+trie_cursor_prev(struct trie_cursor *c)
+{
+	if (!c->leaf)
+		return NULL;
+	return art_land(c, art_advance(c, true));
 }
 
-void *
-trie_payload(trie *root)
+/* calls func() for each key whose every byte is in the band.  a key with a
+ * byte out of it skips every key that starts the same way.
+ */
+static int
+art_walk(trie *root, void *ctx, int (*func)(void *, trie *), int lowfilt,
+    int hifilt, bool backwards)
 {
-	return (root) ? root->payload : NULL;
+	struct trie_cursor c;
+	trie *l;
+	size_t i;
+	int rc = -1;
+
+	trie_cursor_open(&c, root);
+	l = backwards ? trie_cursor_last(&c) : trie_cursor_seek(&c, NULL, 0);
+	while (l) {
+		for (i = 0; i < l->ksz; i++)
+			if ((l->key[i] < lowfilt) || (l->key[i] > hifilt))
+				break;
+
+		if (i == l->ksz) {
+			if (!(rc = func(ctx, l)))
+				break;
+		} else if (!backwards) {
+			l = art_land(&c, art_seek(&c, l->key, i + 1, true));
+			continue;
+		} else if (art_seek(&c, l->key, i + 1, false)) {
+			l = art_land(&c, art_advance(&c, true));
+			continue;
+		} else
+			break;
+
+		l = backwards ? trie_cursor_prev(&c) : trie_cursor_next(&c);
+	}
+	trie_cursor_close(&c);
+	return rc;
 }
 
 /* trie_preorder() performs pre-order traversal, controlled
@@ -265,7 +1316,8 @@ trie_payload(trie *root)
  * and the supplied context.
  *
  * The traversal space can be restricted, if appropriate, to a band of the
- * keyspace using the lowfilt and hifilt parameters.
+ * keyspace using the lowfilt and hifilt parameters: only keys whose every
+ * byte is in the band are visited.
  *
  * As a special case, if the trie has no terminal nodes (or if root is NULL)
  * the traversal returns -1.
@@ -276,31 +1328,10 @@ trie_payload(trie *root)
  *
  */
 int
-trie_preorder(trie *root, void *ctx, int (*func)(void *,trie *), int lowfilt,
+trie_preorder(trie *root, void *ctx, int (*func)(void *, trie *), int lowfilt,
     int hifilt)
 {
-	int i;
-	int rc = -1;
-	int frc = -1;
-
-	if (!root)
-		return rc;
-
-	for (i = lowfilt; i <= hifilt; i++) {
-		if (root->leaves[i]) {
-			if (root->leaves[i]->payload) {
-				frc = func(ctx,
-				    (void *)root->leaves[i]);
-				if (!frc)
-					return frc;
-			}
-			rc = trie_preorder(root->leaves[i], ctx, func, lowfilt,
-			    hifilt);
-			if (!rc)
-				return rc;
-		}
-	}
-	return (frc == -1) ? rc : frc;
+	return art_walk(root, ctx, func, lowfilt, hifilt, false);
 }
 
 /* this is the post-order traversal.  aside from the direction, its details
@@ -310,90 +1341,45 @@ int
 trie_postorder(trie *root, void *ctx, int (*func)(void *, trie *), int lowfilt,
     int hifilt)
 {
-	int i;
-	int rc = -1;
-	int frc = -1;
-
-	if (!root)
-		return rc;
-
-	for (i = hifilt; i >= lowfilt; i--) {
-		if (root->leaves[i]) {
-			rc = trie_postorder(root->leaves[i], ctx, func, lowfilt,
-			    hifilt);
-			if (!rc)
-				return rc;
-			if (root->leaves[i]->payload) {
-				frc = func(ctx,
-				    (void *)root->leaves[i]);
-				if (!frc)
-					return frc;
-			}
-		}
-	}
-	return (frc == -1) ? rc : frc;
-}
-
-struct find_only_ctx {
-	size_t count;
-	trie *root;
-};
-
-static int
-find_only_cb(void *ctx, trie *root)
-{
-	struct find_only_ctx *cp = ctx;
-
-	if (++cp->count > 1)
-		return 0;
-
-	cp->root = root;
-	return 1;
-}
-
-/* given a root, find a sole terminator
- * does not check the payload of the supplied root,
- * it only checks the leaves.
- *
- * returns:
- * NULL if no matches
- * root if multiple matches
- * terminating leaf if and only if there is exactly one terminator.
- */
-trie *
-trie_find_only(trie *root)
-{
-	int rc;
-	struct find_only_ctx ctx = { 0 };
-
-	if (!root)
-		return NULL;
-
-	rc = trie_preorder(root, &ctx, find_only_cb, 0, TRIE_SPAN);
-	if (rc == -1 || !ctx.root)
-		return NULL;
-
-	if (ctx.count > 1)
-		return root;
-
-	return ctx.root;
+	return art_walk(root, ctx, func, lowfilt, hifilt, true);
 }
 
 trie *
 trie_get(trie *root, unsigned char *key, size_t ksz)
 {
+	struct art_node *n;
+	void *p, **child;
+	size_t depth = 0;
+	trie *l;
+
 	if (!(root && key && ksz))
 		return NULL;
 
-	do {
-		root = root->leaves[*key++];
-		if (!root)
+	for (p = art_top(root); p && !ART_ISLEAF(p); p = *child) {
+		n = p;
+
+		/* the bytes of a long prefix that aren't kept are checked
+		 * against the leaf
+		 */
+		if ((depth + n->plen > ksz) || memcmp(n->prefix, key + depth,
+		    ART_MIN(n->plen, ART_PREFIX)))
 			return NULL;
-	} while ((--ksz) > 0);
+		depth += n->plen;
 
-	if (root->payload)
-		return root;
+		if (depth == ksz) {
+			l = n->leaf;
+			goto found;
+		}
+		if (!(child = art_findchild(n, key[depth++])))
+			return NULL;
+	}
+	if (!p)
+		return NULL;
+	l = ART_LEAF(p);
 
+found:
+	if (l && (l->ksz == ksz) && !memcmp(l->key, key, ksz))
+		return l;
 	return NULL;
 }
 
@@ -406,62 +1392,72 @@ trie_get(trie *root, unsigned char *key, size_t ksz)
  *    - mode is trie_match_autocomplete and multiple keys have values
  *    - no values exist below the consumed characters from key
  *    - mode is invalid, root is NULL, key is NULL, or ksz is zero
+ *
+ * for trie_match_fuzzy, a key that ends where the match stopped is the
+ * match, e.g., "/w" for "/wfoo", before any longer ones.
  */
 
 trie *
 trie_match(trie *root, unsigned char *key, size_t ksz, size_t *matched,
     enum trie_match_modes mode)
 {
-	size_t len = ksz;
-	unsigned char *cp = key;
-	trie *leaf = NULL;
+	struct art_node *n;
+	void *p = NULL, **child;
+	trie *l, *leaf = NULL, *exact = NULL;
+	size_t depth = 0, m;
 
 	if (!(root && key && ksz) || (mode > trie_match_max))
 		goto out;
 
-	/* match initial part of key */
+	/* match initial part of key, p is what's below where it stopped */
+	for (p = art_top(root); p; p = *child) {
+		if (ART_ISLEAF(p)) {
+			l = ART_LEAF(p);
+			depth = art_common(l, key, ksz, depth);
+			if (depth == l->ksz)
+				exact = l;
+			break;
+		}
 
-	for (leaf = root; len > 0; len--) {
-		if (!leaf->leaves[*cp])
+		n = p;
+		m = art_prefixmatch(n, key, ksz, depth);
+		depth += m;
+		if (m < n->plen)
+			break;
+		exact = n->leaf;
+		if ((depth == ksz) || !(child = art_findchild(n, key[depth])))
 			break;
-		leaf = leaf->leaves[*cp++];
+		exact = NULL;
+		depth++;
 	}
 
 	/* no characters in key matched */
-	if (len == ksz) {
-		leaf = NULL;
+	if (!depth)
 		goto out;
-	}
 
 	/* exact match */
-	if (!len && leaf->payload)
+	if ((depth == ksz) && exact) {
+		leaf = exact;
 		goto out;
+	}
 
 	if (mode == trie_match_fuzzy) {
-		leaf = trie_find_first(leaf);
-		if (!leaf) {
-			errno = ENOENT;
-			warn("trie_match_fuzzy: no values beyond partial key");
-		}
+		leaf = exact ? exact : art_first(p);
 		goto out;
 	}
 
 	/* all characters must be consumed for ambiguous or abbrev match */
-	if (len) {
-		leaf = NULL;
+	if (depth < ksz)
 		goto out;
-	}
 
 	if (mode == trie_match_ambiguous)
-		leaf = trie_find_first(leaf);
-	else { // mode == trie_match_autocomplete
-		trie *found = trie_find_only(leaf);
-		leaf = (found == leaf) ? NULL : found;
-	}
+		leaf = art_first(p);
+	else if (art_keys(p) == 1) // mode == trie_match_autocomplete
+		leaf = art_first(p);
 
 out:
 	if (matched)
-		*matched = cp - key;
+		*matched = depth;
 	return leaf;
 }
 
@@ -579,6 +1575,482 @@ stop_cb(void *ctx, trie *root)
 	return *cp;
 }
 
+/* a random key, from few enough bytes that keys share prefixes and some
+ * are prefixes of others
+ */
+static size_t
+random_key(unsigned char *key, size_t max)
+{
+	static const unsigned char alpha[] = { 'a', 'b', 'c', 0, 0xff };
+	size_t i, ksz = 1 + random() % max;
+
+	switch (random() % 4) {
+	case 0: /* every byte, for the big nodes */
+		for (i = 0; i < ksz; i++)
+			key[i] = random();
+		break;
+	case 1: /* a long shared prefix */
+		memset(key, 'p', ksz);
+		key[ksz - 1] = alpha[random() % sizeof(alpha)];
+		break;
+	default:
+		for (i = 0; i < ksz; i++)
+			key[i] = alpha[random() % sizeof(alpha)];
+		break;
+	}
+	return ksz;
+}
+
+#define REF_KEYS 4000
+#define REF_KSZ	 24
+
+struct ref_key {
+	unsigned char key[REF_KSZ];
+	size_t ksz;
+	bool in;
+};
+
+static struct ref_key ref[REF_KEYS];
+
+static int
+ref_cmp(const void *a, const void *b)
+{
+	const struct ref_key *ka = *(struct ref_key **)a;
+	const struct ref_key *kb = *(struct ref_key **)b;
+	int rc = memcmp(ka->key, kb->key, ART_MIN(ka->ksz, kb->ksz));
+
+	if (rc)
+		return rc;
+	return (ka->ksz > kb->ksz) - (ka->ksz < kb->ksz);
+}
+
+static struct ref_key *sorted[REF_KEYS];
+static int nsorted, nvisited;
+
+static int band_lo, band_hi; /* the filter the traversals are given */
+
+/* skips the keys the filter should, returns the next one or NULL */
+static struct ref_key *
+ref_inband(bool backwards)
+{
+	struct ref_key *r;
+	size_t i;
+
+	for (; nvisited < nsorted; nvisited++) {
+		r = sorted[backwards ? nsorted - 1 - nvisited : nvisited];
+		for (i = 0; i < r->ksz; i++)
+			if ((r->key[i] < band_lo) || (r->key[i] > band_hi))
+				break;
+		if (i == r->ksz)
+			return r;
+	}
+	return NULL;
+}
+
+static int
+ref_cb(void *ctx, trie *leaf)
+{
+	assert(trie_payload(leaf) == ref_inband(false));
+	nvisited++;
+	return 1;
+}
+
+static int
+ref_back_cb(void *ctx, trie *leaf)
+{
+	assert(trie_payload(leaf) == ref_inband(true));
+	nvisited++;
+	return 1;
+}
+
+/* the keys in the trie, in order, and the first one that starts with
+ * prefix, or NULL
+ */
+static struct ref_key *
+ref_sort(unsigned char *prefix, size_t psz, int *count)
+{
+	struct ref_key *first = NULL;
+	int i;
+
+	nsorted = 0;
+	for (i = 0; i < REF_KEYS; i++)
+		if (ref[i].in)
+			sorted[nsorted++] = &ref[i];
+	qsort(sorted, nsorted, sizeof(*sorted), ref_cmp);
+
+	*count = 0;
+	for (i = 0; i < nsorted; i++) {
+		if ((sorted[i]->ksz < psz) ||
+		    (psz && memcmp(sorted[i]->key, prefix, psz)))
+			continue;
+		if (!first)
+			first = sorted[i];
+		(*count)++;
+	}
+	return first;
+}
+
+/* the keys below p, checking that each node's count and first agree */
+static size_t
+check_sums(void *p)
+{
+	struct art_node *n;
+	unsigned char c;
+	void *child;
+	trie *first = NULL;
+	size_t count;
+	int i;
+
+	if (ART_ISLEAF(p))
+		return 1;
+
+	n = p;
+	count = n->leaf ? 1 : 0;
+	i = art_begin(n, false);
+	while ((child = art_step(n, &i, &c, false))) {
+		if (!first)
+			first = art_first(child);
+		count += check_sums(child);
+	}
+	assert(n->count == count);
+	assert(n->first == (n->leaf ? n->leaf : first));
+	return count;
+}
+
+/* the first of sorted at or after key */
+static int
+ref_seek(const unsigned char *key, size_t ksz)
+{
+	int i;
+
+	for (i = 0; i < nsorted; i++)
+		if (art_keycmp(sorted[i]->key, sorted[i]->ksz, key, ksz) >= 0)
+			break;
+	return i;
+}
+
+static bool
+ref_inrange(struct ref_key *r, unsigned char *lo, size_t losz,
+    unsigned char *hi, size_t hisz)
+{
+	if (art_keycmp(r->key, r->ksz, lo, losz) < 0)
+		return false;
+	return (art_keycmp(r->key, r->ksz, hi, hisz) <= 0) ||
+	    ((r->ksz >= hisz) && !memcmp(r->key, hi, hisz));
+}
+
+/* seeks, steps both ways and ranges, against sorted from ref_sort() */
+static void
+cursor_test(trie *t)
+{
+	struct trie_cursor c;
+	struct ref_key *r;
+	unsigned char lo[REF_KSZ], hi[REF_KSZ];
+	size_t losz, hisz;
+	trie *l;
+	int i, j, k;
+
+	trie_cursor_open(&c, t);
+	for (i = 0; i < 50; i++) {
+		losz = random_key(lo, REF_KSZ);
+		j = ref_seek(lo, losz);
+		l = trie_cursor_seek(&c, lo, losz);
+		for (k = 0; k < 20; k++, j++) {
+			if (j == nsorted) {
+				assert(!l);
+				break;
+			}
+			assert(trie_payload(l) == sorted[j]);
+			l = trie_cursor_next(&c);
+		}
+
+		l = trie_cursor_seek(&c, lo, losz);
+		for (j = ref_seek(lo, losz), k = 0; l && (k < 20); k++) {
+			assert(trie_payload(l) == sorted[j]);
+			l = trie_cursor_prev(&c);
+			j--;
+		}
+		assert(l ? (k == 20) : ((j == -1) || (!k && (j == nsorted))));
+		if (!l)
+			assert(!trie_cursor_next(&c));
+
+		/* a range, both ways */
+		r = &ref[random() % REF_KEYS];
+		hisz = r->ksz - random() % r->ksz;
+		memcpy(hi, r->key, hisz);
+		if (art_keycmp(lo, losz, hi, hisz) > 0)
+			continue;
+		l = trie_cursor_range(&c, lo, losz, hi, hisz);
+		for (j = 0; j < nsorted; j++) {
+			if (!ref_inrange(sorted[j], lo, losz, hi, hisz))
+				continue;
+			assert(trie_payload(l) == sorted[j]);
+			l = trie_cursor_next(&c);
+		}
+		assert(!l);
+		l = trie_cursor_last(&c);
+		for (j = nsorted - 1; j >= 0; j--) {
+			if (!ref_inrange(sorted[j], lo, losz, hi, hisz))
+				continue;
+			assert(trie_payload(l) == sorted[j]);
+			l = trie_cursor_prev(&c);
+		}
+		assert(!l);
+
+		/* every key that starts with hi */
+		l = trie_cursor_range(&c, hi, hisz, hi, hisz);
+		for (j = ref_seek(hi, hisz); (j < nsorted) &&
+		    (sorted[j]->ksz >= hisz) &&
+		    !memcmp(sorted[j]->key, hi, hisz); j++) {
+			assert(trie_payload(l) == sorted[j]);
+			l = trie_cursor_next(&c);
+		}
+		assert(!l);
+		c.lo = c.hi = NULL;
+	}
+	trie_cursor_close(&c);
+}
+
+/* adds and deletes at random, checking against a list of the keys */
+static void
+stress_test(void)
+{
+	trie *t = trie_new();
+	struct trie_stats st;
+	struct ref_key *r, *first;
+	unsigned char key[REF_KSZ];
+	trie *leaf;
+	size_t ksz, matched;
+	int i, round, rc, count, status;
+
+	assert(t);
+	srandom(2525);
+	for (i = 0; i < REF_KEYS; i++) {
+		ref[i].ksz = random_key(ref[i].key, REF_KSZ);
+		/* duplicates stay out, to keep the count simple */
+		for (int j = 0; j < i; j++)
+			if ((ref[j].ksz == ref[i].ksz) &&
+			    !memcmp(ref[j].key, ref[i].key, ref[i].ksz)) {
+				i--;
+				break;
+			}
+	}
+
+	for (round = 0; round < 20; round++) {
+		for (i = 0; i < REF_KEYS; i++) {
+			r = &ref[random() % REF_KEYS];
+			if (r->in) {
+				rc = trie_delete(t, r->key, r->ksz, false);
+				assert(rc == 1);
+				rc = trie_delete(t, r->key, r->ksz, false);
+				assert(rc == 0);
+			} else {
+				leaf = trie_add(t, r->key, r->ksz, r, &status);
+				assert(leaf && !status);
+				assert(trie_add(t, r->key, r->ksz, r, &status) ==
+				    leaf);
+				assert(status == EEXIST);
+			}
+			r->in = !r->in;
+		}
+
+		for (i = 0; i < REF_KEYS; i++) {
+			leaf = trie_get(t, ref[i].key, ref[i].ksz);
+			assert(ref[i].in ? (trie_payload(leaf) == &ref[i]) :
+			    !leaf);
+		}
+
+		first = ref_sort(NULL, 0, &count);
+		assert(!art_top(t) || (check_sums(art_top(t)) == (size_t)count));
+		band_lo = (round % 2) ? 1 : 0;
+		band_hi = (round % 2) ? 'z' : TRIE_SPAN - 1;
+		nvisited = 0;
+		rc = trie_preorder(t, NULL, ref_cb, band_lo, band_hi);
+		assert(!ref_inband(false));
+		nvisited = 0;
+		rc = trie_postorder(t, NULL, ref_back_cb, band_lo, band_hi);
+		assert(!ref_inband(true));
+		assert(trie_payload(trie_find_first(t)) == first);
+		cursor_test(t);
+		assert(trie_isempty(t) == !nsorted);
+
+		/* prefixes of keys, and of keys with a byte changed */
+		for (i = 0; i < 200; i++) {
+			r = &ref[random() % REF_KEYS];
+			memcpy(key, r->key, r->ksz);
+			ksz = 1 + random() % r->ksz;
+			if (random() % 2)
+				key[random() % ksz] ^= 1;
+
+			first = ref_sort(key, ksz, &count);
+			leaf = trie_match(t, key, ksz, &matched,
+			    trie_match_ambiguous);
+			if (first && (first->ksz == ksz))
+				assert(trie_payload(leaf) == first);
+			else if (first)
+				assert((trie_payload(leaf) == first) &&
+				    (matched == ksz));
+			else
+				assert(!leaf);
+
+			leaf = trie_match(t, key, ksz, &matched,
+			    trie_match_autocomplete);
+			if (first && ((first->ksz == ksz) || (count == 1)))
+				assert(trie_payload(leaf) == first);
+			else
+				assert(!leaf);
+		}
+	}
+
+	for (i = 0; i < REF_KEYS; i++)
+		if (ref[i].in)
+			assert(trie_delete(t, ref[i].key, ref[i].ksz, false));
+	assert(trie_isempty(t));
+	trie_stats(t, &st);
+	assert(!st.nodes && !st.leaves && !st.bytes);
+	assert(trie_collapse(t, false));
+}
+
+/* each key is the start of the next, a node apiece, and the long ones are
+ * too big for the slabs
+ */
+static void
+deep_test(void)
+{
+	static unsigned char deep[400];
+	struct trie_cursor c;
+	struct trie_stats st;
+	trie *t = trie_new();
+	trie *leaf;
+	size_t slabs;
+	int i;
+
+	memset(deep, 'a', sizeof(deep));
+	for (i = 1; i <= (int)sizeof(deep); i++)
+		assert(trie_add(t, deep, i, deep, NULL));
+	trie_cursor_open(&c, t);
+	leaf = trie_cursor_seek(&c, NULL, 0);
+	for (i = 1; leaf; i++) {
+		assert(leaf->ksz == (size_t)i);
+		leaf = trie_cursor_next(&c);
+	}
+	assert(i == sizeof(deep) + 1);
+	leaf = trie_cursor_last(&c);
+	for (i = sizeof(deep); leaf; i--) {
+		assert(leaf->ksz == (size_t)i);
+		leaf = trie_cursor_prev(&c);
+	}
+	assert(i == 0);
+	assert(c.stack);
+	trie_cursor_close(&c);
+
+	trie_stats(t, &st);
+	assert(st.leaves == sizeof(deep));
+	slabs = st.slabs;
+	for (i = sizeof(deep); sizeof(trie) + i > ART_SMALL; i--)
+		assert(trie_delete(t, deep, i, false));
+	trie_stats(t, &st);
+	assert(st.slabs == slabs - (sizeof(deep) - i));
+	trie_collapse(t, false);
+}
+
+/* what a key took when every node had a slot for each byte: one node for
+ * each distinct prefix of the keys
+ */
+#define OLD_NODE (sizeof(void *) * (TRIE_SPAN + 2))
+
+static int
+key_cmp(const void *a, const void *b)
+{
+	return memcmp(a, b, 12);
+}
+
+static double
+elapsed(struct timespec *t0)
+{
+	struct timespec t1;
+
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	return (t1.tv_sec - t0->tv_sec) + (t1.tv_nsec - t0->tv_nsec) / 1e9;
+}
+
+/* message keys, as msg.c makes them: a time and microseconds */
+static void
+size_test(int n)
+{
+	struct msgkey {
+		time_t created;
+		int32_t created_usec;
+	} __attribute__((packed)) *keys = calloc(n, sizeof(*keys));
+	trie *t = trie_new();
+	struct trie_stats st;
+	size_t oldnodes = 1, mallocs;
+	struct timespec t0;
+	int i, j;
+
+	assert(keys && t);
+	assert(sizeof(*keys) == 12);
+	for (i = 0; i < n; i++) {
+		keys[i].created = 1700000000 + i / 3;
+		keys[i].created_usec = random() % 1000000;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (i = 0; i < n; i++)
+		assert(trie_add(t, (void *)&keys[i], sizeof(keys[i]), &keys[i],
+		    NULL));
+	printf("  add %.0f ns", elapsed(&t0) * 1e9 / n);
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (i = 0; i < n; i++)
+		assert(trie_get(t, (void *)&keys[i], sizeof(keys[i])));
+	printf(", get %.0f ns", elapsed(&t0) * 1e9 / n);
+
+	/* the first byte is shared by hundreds of keys */
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (i = 0; i < n; i++) {
+		size_t matched;
+
+		assert(!trie_match(t, (void *)&keys[i], 1, &matched,
+		    trie_match_autocomplete));
+		assert(trie_match(t, (void *)&keys[i], 1, &matched,
+		    trie_match_ambiguous));
+	}
+	printf(", match %.0f ns each\n", elapsed(&t0) * 1e9 / (2 * n));
+
+	/* the same again comes from what was freed */
+	trie_stats(t, &st);
+	mallocs = st.mallocs;
+	for (i = 0; i < n; i++)
+		trie_delete(t, (void *)&keys[i], sizeof(keys[i]), false);
+	trie_stats(t, &st);
+	assert(!st.nodes && !st.leaves && !st.bytes);
+	for (i = 0; i < n; i++)
+		assert(trie_add(t, (void *)&keys[i], sizeof(keys[i]), &keys[i],
+		    NULL));
+	trie_stats(t, &st);
+	assert(st.mallocs == mallocs);
+
+	qsort(keys, n, sizeof(*keys), key_cmp);
+	for (i = 0; i < n; i++) {
+		j = 0;
+		if (i)
+			while ((j < 12) && (((unsigned char *)&keys[i])[j] ==
+			    ((unsigned char *)&keys[i - 1])[j]))
+				j++;
+		oldnodes += 12 - j;
+	}
+	printf("  %d message keys: %zu bytes each, it was %zu\n", n,
+	    st.bytes / n, oldnodes * OLD_NODE / n);
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	trie_collapse(t, false);
+	printf("  %zu nodes and %zu leaves in %zu slabs of %zu bytes, "
+	       "collapsed in %.0f us\n", st.nodes, st.leaves, st.slabs,
+	    st.slab_bytes, elapsed(&t0) * 1e6);
+	free(keys);
+}
+
 int
 main(int argc, char *argv[])
 {
@@ -837,6 +2309,18 @@ main(int argc, char *argv[])
 	printf(" passed\n");
 	fflush(stdout);
 
+	printf("trie fuzzy match stops at a key test...");
+	fflush(stdout);
+	matched = 0;
+	leaf = trie_match(test_trie, (unsigned char *)"sixBLAH",
+	    strlen("sixBLAH"), &matched, trie_match_fuzzy);
+	assert(leaf);
+	assert(3 == matched);
+	rc = strcmp(trie_payload(leaf), "SIX");
+	assert(!rc);
+	printf(" passed\n");
+	fflush(stdout);
+
 	printf("trie delete test...");
 	fflush(stdout);
 	rc = trie_delete(test_trie, (unsigned char *)"six", strlen("six"),
@@ -866,6 +2350,21 @@ main(int argc, char *argv[])
 	printf(" passed\n");
 	fflush(stdout);
 
+	printf("trie random add, delete and match test...");
+	fflush(stdout);
+	stress_test();
+	printf(" passed\n");
+	fflush(stdout);
+
+	printf("trie cursor deeper than its frames test...");
+	fflush(stdout);
+	deep_test();
+	printf(" passed\n");
+	fflush(stdout);
+
+	printf("trie size and speed:\n");
+	size_test(100000);
+
 	printf("all tests passed\n");
 
 	return 0;
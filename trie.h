@@ -41,10 +41,14 @@
 
 #define TRIE_SPAN 256
 
+/* A trie is the root that trie_new() returns, or one that is zeroed.  The
+ * other trie nodes callers see are the leaves, one for each key.
+ */
 struct trie_node {
-	SLIST_ENTRY(trie_node) entries;
-	struct trie_node *leaves[TRIE_SPAN];
 	void *payload;
+	void *tree;		/* in a root, the nodes and memory, see trie.c */
+	size_t ksz;		/* in a leaf, its key */
+	unsigned char key[];
 };
 
 typedef struct trie_node trie;
@@ -56,9 +60,50 @@ enum trie_match_modes {
 	trie_match_max = trie_match_fuzzy
 };
 
+/* for a trie, from trie_stats() */
+struct trie_stats {
+	size_t nodes;	   /* inner nodes */
+	size_t leaves;	   /* keys */
+	size_t bytes;	   /* in nodes and leaves */
+	size_t slabs;	   /* blocks from malloc() they're carved from */
+	size_t slab_bytes; /* in those */
+	size_t mallocs;	   /* calls to malloc(), ever */
+};
+
+#define TRIE_FRAMES 16 /* cursor depth before it needs memory */
+
+struct trie_frame {
+	void *node;
+	int pos; /* the child it went down, or -1 for the node's own key */
+};
+
+/* A cursor walks the keys of a trie in order, from trie_cursor_seek(),
+ * trie_cursor_last() or trie_cursor_range(), without recursing.  It is
+ * only good until the trie changes; seek again after that, e.g., from the
+ * last key seen, to page through a trie that's being added to.
+ */
+struct trie_cursor {
+	trie *root;
+	trie *leaf; /* the key it's on, or NULL */
+	const unsigned char *lo, *hi; /* the range, see trie_cursor_range() */
+	size_t losz, hisz;
+	struct trie_frame *stack;
+	int depth, room;
+	struct trie_frame frames[TRIE_FRAMES];
+};
+
 trie *trie_add(trie *root, unsigned char *key, size_t keysz, void *payload,
     int *status);
 int trie_collapse(trie *root, bool free_payloads);
+void trie_cursor_close(struct trie_cursor *c);
+trie *trie_cursor_last(struct trie_cursor *c);
+trie *trie_cursor_next(struct trie_cursor *c);
+void trie_cursor_open(struct trie_cursor *c, trie *root);
+trie *trie_cursor_prev(struct trie_cursor *c);
+trie *trie_cursor_range(struct trie_cursor *c, const unsigned char *lo,
+    size_t losz, const unsigned char *hi, size_t hisz);
+trie *trie_cursor_seek(struct trie_cursor *c, const unsigned char *key,
+    size_t ksz);
 int trie_delete(trie *root, unsigned char *key, size_t ksz, bool free_payloads);
 bool trie_isempty(trie *root);
 trie *trie_find_first(trie *root);
@@ -71,5 +116,6 @@ int trie_preorder(trie *root, void *ctx, int (*func)(void *, trie *),
     int lowfilt, int hifilt);
 int trie_postorder(trie *root, void *ctx, int (*func)(void *, trie *),
     int lowfilt, int hifilt);
+void trie_stats(trie *root, struct trie_stats *st);
 
 #endif /* _TRIE_H_ */
@@ -0,0 +1,1015 @@
+/*
+ * Copyright 2025 Jillian Alana Bolton
+ *
+ * The BSD 2-Clause License
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *
+ *     2. Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* upgrade.c - handing the players to a new lorien without dropping them
+ *
+ * /Upgrade starts the lorien binary again, with the same arguments, plus
+ * -U and one end of a Unix socket.  Over that socket, the old server hands
+ * the new one the listening sockets, and each plain player's connection
+ * with SCM_RIGHTS, along with what it needs to carry on: the channels, and
+ * each player's line, name, channel, levels, flags, gags, unframed input
+ * and unsent output.  Then the old server exits without closing anything,
+ * and the new one serves them.  Nobody is disconnected, and connections
+ * that arrive in the meantime wait in the listen backlog.
+ *
+ * A TLS connection can't be handed over, since its session is in the old
+ * server's OpenSSL.  TLS players are asked to reconnect instead, which is
+ * cheap for them with session resumption (see tls.c).
+ *
+ * The old server carries on if the new one doesn't start, or gives up
+ * before it has taken the players.  The new one doesn't serve until the
+ * old one has exited, so the two never serve at once.
+ *
+ * The records are laid out here, independent of the structs they are
+ * copied from, so that a newer lorien can take over from an older one.
+ * UPGRADE_VERSION must change whenever they do, so that a server refuses
+ * what it doesn't understand.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <unistd.h>
+
+#include "channel.h"
+#include "db.h"
+#include "event.h"
+#include "log.h"
+#include "lorien.h"
+#include "newplayer.h"
+#include "platform.h"
+#include "servsock_ssl.h"
+#include "upgrade.h"
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+#define UPGRADE_MAGIC	0x4c6f7269 /* "Lori" */
+#define UPGRADE_VERSION 1
+
+/* the most a record can be, which an honest one never comes near */
+#define UPGRADE_RECMAX (64 * 1024 * 1024)
+
+/* Each record is a header and len bytes.  An fd goes with the header. */
+enum upgrade_type {
+	UPGRADE_HELLO = 1, /* first, with the version */
+	UPGRADE_LISTENER,  /* a listening socket, and whether it's TLS */
+	UPGRADE_LINES,	   /* the highest line that will be handed over */
+	UPGRADE_CHANNEL,
+	UPGRADE_PLAYER, /* a player, and their connection */
+	UPGRADE_END
+};
+
+/* what the new server answers, a byte each */
+#define UPGRADE_READY 'R' /* it has the listening sockets, and is up */
+#define UPGRADE_DONE  'D' /* it has the players */
+
+struct upgrade_rec {
+	uint32_t type;
+	uint32_t len;
+};
+
+struct upgrade_hello {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t channelsize; /* sizes of the records, as a check */
+	uint32_t playersize;
+	int64_t boottime;
+	int32_t nlisteners;
+};
+
+struct upgrade_channel {
+	int64_t created;
+	uint8_t secure;
+	uint8_t persistent;
+	char name[MAX_CHAN];
+	char owner[LORIEN_V0174_NAME];
+	char desc[LORIEN_V0178_DESC];
+};
+
+struct upgrade_handle {
+	int32_t line;
+	uint32_t gen;
+};
+
+/* followed by ngags handles, pblen bytes of input and outlen of output */
+struct upgrade_player {
+	struct upgrade_handle self;
+	struct upgrade_handle dotspeeddial;
+	int32_t seclevel;
+	int32_t hilite;
+	int32_t privs;
+	int32_t wrap;
+	int32_t flags;
+	int32_t pagelen;
+	int32_t spamming;
+	int32_t port;
+	int32_t channel; /* in the order the channels were sent, or -1 */
+	uint32_t ngags;
+	uint32_t pblen;
+	uint32_t outlen;
+	int64_t cameon;
+	int64_t playerwhen;
+	int64_t idle;
+	char name[MAX_NAME];
+	char onfrom[MAX_NAME];
+	char host[MAX_NAME];
+	char numhost[MAX_NAME];
+	char password[MAX_PASS];
+};
+
+/* a player the new server took, until their gags are put back */
+struct upgrade_taken {
+	struct splayer *pplayer;
+	struct upgrade_handle old;
+	struct upgrade_handle dotspeeddial;
+	struct upgrade_handle *gags;
+	uint32_t ngags;
+};
+
+/* either side's progress through the records */
+struct upgrade_state {
+	int sock;
+	struct channel **channels; /* in the order sent */
+	int nchannels;
+	int top;		      /* the highest line handed over */
+	int nplayers;
+	int ntls;		      /* TLS players, who are left behind */
+	struct upgrade_taken *taken;  /* new server only */
+};
+
+static char **args;  /* how lorien was started, see upgrade_init() */
+static char fdarg[16]; /* -U's argument in args */
+static struct servsock_handle *listeners[2];
+static bool pending; /* see upgrade_command() */
+static struct player_handle upgrader;
+static int from = -1; /* the new server's end, see upgrade_listeners() */
+
+static int
+upgrade_write(int sock, const void *buf, size_t len)
+{
+	const char *p = buf;
+	ssize_t n;
+
+	while (len) {
+		n = send(sock, p, len, MSG_NOSIGNAL);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static int
+upgrade_read(int sock, void *buf, size_t len)
+{
+	char *p = buf;
+	ssize_t n;
+
+	while (len) {
+		n = recv(sock, p, len, 0);
+		if (n == 0) {
+			errno = EPIPE;
+			return -1;
+		}
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/* Sends a record made of the pieces in iov, and fd with it unless it's -1. */
+static int
+upgrade_send(int sock, enum upgrade_type type, struct iovec *iov, int iovcnt,
+    int fd)
+{
+	struct upgrade_rec rec = { type, 0 };
+	struct iovec hiov = { &rec, sizeof(rec) };
+	struct msghdr mh = { 0 };
+	struct cmsghdr *cmsg;
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} cm;
+	ssize_t n;
+	int i;
+
+	for (i = 0; i < iovcnt; i++)
+		rec.len += iov[i].iov_len;
+
+	mh.msg_iov = &hiov;
+	mh.msg_iovlen = 1;
+	if (fd != -1) {
+		memset(&cm, 0, sizeof(cm));
+		mh.msg_control = cm.buf;
+		mh.msg_controllen = sizeof(cm.buf);
+		cmsg = CMSG_FIRSTHDR(&mh);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+	}
+
+	do
+		n = sendmsg(sock, &mh, MSG_NOSIGNAL);
+	while ((n == -1) && (errno == EINTR));
+	if (n == -1)
+		return -1;
+	if (((size_t)n < sizeof(rec)) &&
+	    (upgrade_write(sock, (char *)&rec + n, sizeof(rec) - n) == -1))
+		return -1;
+
+	for (i = 0; i < iovcnt; i++)
+		if (upgrade_write(sock, iov[i].iov_base, iov[i].iov_len) == -1)
+			return -1;
+	return 0;
+}
+
+/* Reads a record's header, and the fd that came with it into *fd, or -1 if
+ * there wasn't one.
+ */
+static int
+upgrade_recv(int sock, struct upgrade_rec *rec, int *fd)
+{
+	struct iovec iov = { rec, sizeof(*rec) };
+	struct msghdr mh = { 0 };
+	struct cmsghdr *cmsg;
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} cm;
+	ssize_t n;
+
+	*fd = -1;
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	mh.msg_control = cm.buf;
+	mh.msg_controllen = sizeof(cm.buf);
+
+	do
+		n = recvmsg(sock, &mh, 0);
+	while ((n == -1) && (errno == EINTR));
+	if (n == 0)
+		errno = EPIPE;
+	if (n <= 0)
+		return -1;
+
+	for (cmsg = CMSG_FIRSTHDR(&mh); cmsg; cmsg = CMSG_NXTHDR(&mh, cmsg))
+		if ((cmsg->cmsg_level == SOL_SOCKET) &&
+		    (cmsg->cmsg_type == SCM_RIGHTS))
+			memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+
+	if (((size_t)n < sizeof(*rec)) &&
+	    (upgrade_read(sock, (char *)rec + n, sizeof(*rec) - n) == -1))
+		return -1;
+
+	if ((mh.msg_flags & MSG_CTRUNC) || (rec->len > UPGRADE_RECMAX)) {
+		errno = EPROTO;
+		return -1;
+	}
+	return 0;
+}
+
+/* Reads the next record, which has to be of the type, with len bytes. */
+static int
+upgrade_expect(int sock, enum upgrade_type type, void *buf, size_t len,
+    int *fd)
+{
+	struct upgrade_rec rec;
+
+	if (upgrade_recv(sock, &rec, fd) == -1)
+		return -1;
+	if ((rec.type != type) || (rec.len != len)) {
+		errno = EPROTO;
+		return -1;
+	}
+	return upgrade_read(sock, buf, len);
+}
+
+static int
+upgrade_wait(int sock, char want)
+{
+	char c;
+
+	if (upgrade_read(sock, &c, 1) == -1)
+		return -1;
+	if (c != want) {
+		errno = EPROTO;
+		return -1;
+	}
+	return 0;
+}
+
+static int
+upgrade_topline(struct splayer *pplayer, void *arg)
+{
+	int *top = arg;
+
+	if (player_getline(pplayer) > *top)
+		*top = player_getline(pplayer);
+	return 0;
+}
+
+/* Starts the new server, with its end of a socket pair as -U's argument.
+ * Returns its pid, and the old server's end in *sock.
+ */
+static pid_t
+upgrade_start(int *sock)
+{
+	struct timeval tv = { UPGRADE_TIMEOUT, 0 };
+	int sv[2], fd, top, e;
+	pid_t pid;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1)
+		return -1;
+
+	/* out of the way of stdin and stdout, which are replaced below */
+	fd = fcntl(sv[1], F_DUPFD, 3);
+	if (fd == -1) {
+		e = errno;
+		(void)close(sv[0]);
+		(void)close(sv[1]);
+		errno = e;
+		return -1;
+	}
+	(void)close(sv[1]);
+	sv[1] = fd;
+
+	(void)fcntl(sv[0], F_SETFD, FD_CLOEXEC);
+	(void)setsockopt(sv[0], SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	(void)setsockopt(sv[0], SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+#ifdef SO_NOSIGPIPE
+	fd = 1;
+	(void)setsockopt(sv[0], SOL_SOCKET, SO_NOSIGPIPE, &fd, sizeof(fd));
+#endif
+	snprintf(fdarg, sizeof(fdarg), "%d", sv[1]);
+
+	top = (sv[0] > sv[1]) ? sv[0] : sv[1];
+	if (event_highfd() > top)
+		top = event_highfd();
+	(void)player_walk(upgrade_topline, &top);
+
+	switch (pid = fork()) {
+	case -1:
+		e = errno;
+		(void)close(sv[0]);
+		(void)close(sv[1]);
+		errno = e;
+		return -1;
+	case 0:
+		/* it has only what it is handed, and the log as stderr */
+		for (fd = 0; fd <= top; fd++)
+			if ((fd != STDERR_FILENO) && (fd != sv[1]))
+				(void)close(fd);
+		(void)open("/dev/null", O_RDWR);
+		(void)open("/dev/null", O_RDWR);
+		execvp(args[0], args);
+		_exit(EX_OSERR);
+	}
+
+	(void)close(sv[1]);
+	*sock = sv[0];
+	return pid;
+}
+
+static int
+upgrade_sendlisteners(int sock)
+{
+	struct upgrade_hello hello = { 0 };
+	struct iovec iov = { &hello, sizeof(hello) };
+	int32_t use_ssl;
+	int i;
+
+	hello.magic = UPGRADE_MAGIC;
+	hello.version = UPGRADE_VERSION;
+	hello.channelsize = sizeof(struct upgrade_channel);
+	hello.playersize = sizeof(struct upgrade_player);
+	hello.boottime = lorien_boot_time;
+	for (i = 0; i < 2; i++)
+		if (listeners[i])
+			hello.nlisteners++;
+
+	if (upgrade_send(sock, UPGRADE_HELLO, &iov, 1, -1) == -1)
+		return -1;
+
+	iov.iov_base = &use_ssl;
+	iov.iov_len = sizeof(use_ssl);
+	for (i = 0; i < 2; i++) {
+		if (!listeners[i])
+			continue;
+		use_ssl = listeners[i]->use_ssl;
+		if (upgrade_send(sock, UPGRADE_LISTENER, &iov, 1,
+			listeners[i]->sock) == -1)
+			return -1;
+	}
+	return 0;
+}
+
+static int
+upgrade_sendchannel(struct channel *channel, void *arg)
+{
+	struct upgrade_state *st = arg;
+	struct upgrade_channel uc = { 0 };
+	struct iovec iov = { &uc, sizeof(uc) };
+	struct channel **tmp;
+
+	tmp = realloc(st->channels, (st->nchannels + 1) * sizeof(*tmp));
+	if (!tmp) {
+		errno = ENOMEM;
+		return -1;
+	}
+	st->channels = tmp;
+	st->channels[st->nchannels++] = channel;
+
+	uc.created = channel->created;
+	uc.secure = channel_secured(channel);
+	uc.persistent = channel_persists(channel);
+	memcpy(uc.name, channel->name, sizeof(uc.name));
+	memcpy(uc.owner, channel->owner, sizeof(uc.owner));
+	memcpy(uc.desc, channel->desc, sizeof(uc.desc));
+	return upgrade_send(st->sock, UPGRADE_CHANNEL, &iov, 1, -1);
+}
+
+static int
+upgrade_sendplayer(struct splayer *pplayer, void *arg)
+{
+	struct upgrade_state *st = arg;
+	struct upgrade_player up = { 0 };
+	struct upgrade_handle *gags;
+	struct iovec iov[4];
+	unsigned int i;
+	char *out;
+	int rc, e;
+
+	if (pplayer->h->use_ssl) {
+		st->ntls++;
+		return 0;
+	}
+
+	up.self.line = player_getline(pplayer);
+	up.self.gen = pplayer->gen;
+	up.dotspeeddial.line = pplayer->dotspeeddial.line;
+	up.dotspeeddial.gen = pplayer->dotspeeddial.gen;
+	up.seclevel = pplayer->seclevel;
+	up.hilite = pplayer->hilite;
+	up.privs = pplayer->privs;
+	up.wrap = pplayer->wrap;
+	up.flags = pplayer->flags;
+	up.pagelen = pplayer->pagelen;
+	up.spamming = pplayer->spamming;
+	up.port = pplayer->port;
+	up.channel = -1;
+	for (i = 0; i < (unsigned int)st->nchannels; i++)
+		if (st->channels[i] == pplayer->chnl)
+			up.channel = i;
+	up.ngags = pplayer->gags.count;
+	up.pblen = pplayer->pblen;
+	up.outlen = pplayer->h->outqlen;
+	up.cameon = pplayer->cameon;
+	up.playerwhen = pplayer->playerwhen;
+	up.idle = pplayer->idle;
+	memcpy(up.name, pplayer->name, sizeof(up.name));
+	memcpy(up.onfrom, pplayer->onfrom, sizeof(up.onfrom));
+	memcpy(up.host, pplayer->host, sizeof(up.host));
+	memcpy(up.numhost, pplayer->numhost, sizeof(up.numhost));
+	memcpy(up.password, pplayer->password, sizeof(up.password));
+
+	gags = calloc(up.ngags + 1, sizeof(*gags));
+	out = malloc(up.outlen + 1);
+	if (!gags || !out) {
+		free(gags);
+		free(out);
+		errno = ENOMEM;
+		return -1;
+	}
+	for (i = 0; i < up.ngags; i++) {
+		gags[i].line = pplayer->gags.handles[i].line;
+		gags[i].gen = pplayer->gags.handles[i].gen;
+	}
+	servsock_copyqueue(pplayer->h, out);
+
+	iov[0] = (struct iovec) { &up, sizeof(up) };
+	iov[1] = (struct iovec) { gags, up.ngags * sizeof(*gags) };
+	iov[2] = (struct iovec) { pplayer->pbuf, up.pblen };
+	iov[3] = (struct iovec) { out, up.outlen };
+	rc = upgrade_send(st->sock, UPGRADE_PLAYER, iov, 4, up.self.line);
+	e = errno;
+	free(gags);
+	free(out);
+	if (rc == 0)
+		st->nplayers++;
+	errno = e;
+	return rc;
+}
+
+static int
+upgrade_tellssl(struct splayer *pplayer, void *arg)
+{
+	if (pplayer->h->use_ssl)
+		sendtoplayer(pplayer,
+		    ">> The server is being upgraded.  Please reconnect.\r\n");
+	return 0;
+}
+
+static int
+upgrade_closessl(struct splayer *pplayer, void *arg)
+{
+	if (pplayer->h->use_ssl)
+		servsock_close(pplayer->h);
+	return 0;
+}
+
+/* The new server has the players.  The old one closes only the TLS
+ * connections, and exits, which the new one is waiting for.
+ */
+static void
+upgrade_exit(struct upgrade_state *st, pid_t pid)
+{
+	snprintf(sendbuf, sendbufsz,
+	    "upgraded: %d players went to process %d, %d on TLS were asked "
+	    "to reconnect",
+	    st->nplayers, (int)pid, st->ntls);
+	logmsg(sendbuf);
+
+	(void)player_walk(upgrade_tellssl, NULL);
+	event_flush();
+	(void)player_walk(upgrade_closessl, NULL);
+
+	ldb_close(&lorien_db);
+	exit(0);
+}
+
+/* Hands everything to a new server and exits, or returns why it couldn't,
+ * with errno set.
+ */
+static const char *
+upgrade_handoff(void)
+{
+	struct upgrade_state st = { 0 };
+	int32_t top;
+	struct iovec iov = { &top, sizeof(top) };
+	const char *why;
+	pid_t pid;
+	int e;
+
+	pid = upgrade_start(&st.sock);
+	if (pid == -1)
+		return "can't start the new server";
+
+	if ((upgrade_sendlisteners(st.sock) == -1) ||
+	    (upgrade_wait(st.sock, UPGRADE_READY) == -1)) {
+		why = "the new server didn't start, see the log";
+		goto fail;
+	}
+
+	/* Nothing changes once the main thread has every connection and the
+	 * output of the last pass is out.  If the upgrade fails after this,
+	 * the server carries on without its shard threads.
+	 */
+	player_unshard();
+	player_reap();
+	event_flush();
+
+	st.top = -1;
+	(void)player_walk(upgrade_topline, &st.top);
+	top = st.top;
+	if ((upgrade_send(st.sock, UPGRADE_LINES, &iov, 1, -1) == -1) ||
+	    (channel_walk(upgrade_sendchannel, &st) == -1) ||
+	    (player_walk(upgrade_sendplayer, &st) == -1) ||
+	    (upgrade_send(st.sock, UPGRADE_END, NULL, 0, -1) == -1) ||
+	    (upgrade_wait(st.sock, UPGRADE_DONE) == -1)) {
+		why = "the new server didn't take the players";
+		goto fail;
+	}
+
+	upgrade_exit(&st, pid);
+	/* NOTREACHED */
+
+fail:
+	e = errno;
+	(void)kill(pid, SIGKILL);
+	(void)waitpid(pid, NULL, 0);
+	(void)close(st.sock);
+	free(st.channels);
+	errno = e;
+	return why;
+}
+
+/* /Upgrade happens between passes of the main loop, see upgrade_poll(), so
+ * that no player's input is half handled.
+ */
+parse_error
+upgrade_command(struct splayer *pplayer)
+{
+	if (pending) {
+		sendtoplayer(pplayer, ">> An upgrade is under way.\r\n");
+		return PARSE_OK;
+	}
+
+	snprintf(sendbuf, sendbufsz, "%s asked for an upgrade to %s",
+	    pplayer->name, args[0]);
+	logmsg(sendbuf);
+	sendtoplayer(pplayer, ">> Upgrading...\r\n");
+
+	pending = true;
+	upgrader = player_handle(pplayer);
+	return PARSE_OK;
+}
+
+void
+upgrade_poll(void)
+{
+	struct splayer *pplayer;
+	const char *why;
+	int e;
+
+	if (!pending)
+		return;
+	pending = false;
+
+	why = upgrade_handoff();
+	e = errno;
+
+	snprintf(sendbuf, sendbufsz, "upgrade failed: %s", why);
+	if (e)
+		logerror(sendbuf, e);
+	else
+		logmsg(sendbuf);
+
+	pplayer = player_deref(upgrader);
+	if (pplayer) {
+		snprintf(sendbuf, sendbufsz, ">> The upgrade failed: %s.\r\n",
+		    why);
+		sendtoplayer(pplayer, sendbuf);
+	}
+}
+
+/* Remembers how lorien was started, less any -U, and what it listens on. */
+void
+upgrade_init(char **argv, struct servsock_handle *handle,
+    struct servsock_handle *sslhandle)
+{
+	int i, n = 0;
+
+	for (i = 0; argv[i]; i++)
+		continue;
+	args = calloc(i + 3, sizeof(*args));
+	if (!args)
+		err(EX_OSERR, "can't keep the arguments");
+
+	for (i = 0; argv[i]; i++) {
+		if (!strcmp(argv[i], "-U") && argv[i + 1]) {
+			i++;
+			continue;
+		}
+		args[n++] = argv[i];
+	}
+	args[n++] = "-U";
+	args[n] = fdarg;
+
+	listeners[0] = handle;
+	listeners[1] = sslhandle;
+}
+
+/* The new server, started with -U: takes the listening sockets, before it
+ * would bind its own.
+ */
+void
+upgrade_listeners(int sock, struct servsock_handle **handle,
+    struct servsock_handle **sslhandle)
+{
+	struct upgrade_hello hello;
+	struct servsock_handle *h;
+	int32_t use_ssl;
+	int fd, i;
+
+	from = sock;
+	(void)fcntl(from, F_SETFD, FD_CLOEXEC);
+
+	if (upgrade_expect(from, UPGRADE_HELLO, &hello, sizeof(hello), &fd) ==
+	    -1)
+		err(EX_PROTOCOL, "can't hear the old server");
+	if ((hello.magic != UPGRADE_MAGIC) ||
+	    (hello.version != UPGRADE_VERSION) ||
+	    (hello.channelsize != sizeof(struct upgrade_channel)) ||
+	    (hello.playersize != sizeof(struct upgrade_player)))
+		errx(EX_PROTOCOL,
+		    "can't take over from a server with upgrade version %u",
+		    hello.version);
+
+	/* /uptime goes on from when the first server started */
+	lorien_boot_time = hello.boottime;
+
+	for (i = 0; i < hello.nlisteners; i++) {
+		if ((upgrade_expect(from, UPGRADE_LISTENER, &use_ssl,
+			 sizeof(use_ssl), &fd) == -1) ||
+		    (fd == -1))
+			err(EX_PROTOCOL, "can't take a listening socket");
+		h = servsock_inherit(fd, true, use_ssl);
+		if (!h)
+			err(EX_OSERR, "can't listen on the old socket");
+		if (use_ssl)
+			*sslhandle = h;
+		else
+			*handle = h;
+	}
+}
+
+/* Gives a connection the line it had if that fd is free here, and another
+ * one if not.  Either way it's moved above the lines still to come first.
+ */
+static int
+upgrade_place(int fd, int line, int top)
+{
+	int nfd;
+
+	nfd = fcntl(fd, F_DUPFD, top + 1);
+	if (nfd == -1)
+		err(EX_OSERR, "can't move line %d", line);
+	(void)close(fd);
+
+	if ((line != nfd) && (fcntl(line, F_GETFD) == -1) && (errno == EBADF) &&
+	    (dup2(nfd, line) == line)) {
+		(void)close(nfd);
+		nfd = line;
+	}
+	(void)fcntl(nfd, F_SETFD, FD_CLOEXEC);
+	return nfd;
+}
+
+static void
+upgrade_takechannel(struct upgrade_state *st, struct upgrade_rec *rec)
+{
+	struct upgrade_channel uc;
+	struct channel *channel, **tmp;
+
+	if (rec->len != sizeof(uc))
+		errx(EX_PROTOCOL, "bad channel record");
+	if (upgrade_read(from, &uc, sizeof(uc)) == -1)
+		err(EX_PROTOCOL, "can't take a channel");
+	uc.name[sizeof(uc.name) - 1] = '\0';
+
+	/* the main channel is first */
+	if (!st->nchannels) {
+		channel = channel_getmain();
+		if (strcmp(channel->name, uc.name))
+			channel_rename(channel, uc.name);
+	} else if (!(channel = channel_find(uc.name)) &&
+	    !(channel = channel_add(uc.name)))
+		err(EX_OSERR, "can't add channel %s", uc.name);
+
+	memcpy(channel->owner, uc.owner, sizeof(channel->owner));
+	channel->owner[sizeof(channel->owner) - 1] = '\0';
+	memcpy(channel->desc, uc.desc, sizeof(channel->desc));
+	channel->desc[sizeof(channel->desc) - 1] = '\0';
+	channel->created = uc.created;
+	channel_secure(channel, uc.secure);
+	channel_persist(channel, uc.persistent);
+
+	tmp = realloc(st->channels, (st->nchannels + 1) * sizeof(*tmp));
+	if (!tmp)
+		err(EX_OSERR, "can't take channel %s", uc.name);
+	st->channels = tmp;
+	st->channels[st->nchannels++] = channel;
+}
+
+static void
+upgrade_takeplayer(struct upgrade_state *st, struct upgrade_rec *rec, int fd)
+{
+	struct upgrade_player up;
+	struct upgrade_taken *tmp;
+	struct upgrade_handle *gags;
+	struct splayer *pplayer;
+	char *out;
+	size_t len;
+	int line;
+
+	if ((fd == -1) || (rec->len < sizeof(up)))
+		errx(EX_PROTOCOL, "bad player record");
+	if (upgrade_read(from, &up, sizeof(up)) == -1)
+		err(EX_PROTOCOL, "can't take a player");
+
+	len = sizeof(up) + (size_t)up.ngags * sizeof(*gags) + up.pblen +
+	    up.outlen;
+	/* frameinput() keeps room for a NUL after the partial line */
+	if ((len != rec->len) || (up.pblen > sizeof(pplayer->pbuf) - 1))
+		errx(EX_PROTOCOL, "bad record for line %d", up.self.line);
+
+	tmp = realloc(st->taken, (st->nplayers + 1) * sizeof(*tmp));
+	if (tmp)
+		st->taken = tmp;
+	pplayer = calloc(1, sizeof(*pplayer));
+	gags = calloc(up.ngags + 1, sizeof(*gags));
+	out = malloc(up.outlen + 1);
+	if (!tmp || !pplayer || !gags || !out)
+		err(EX_OSERR, "can't take line %d", up.self.line);
+
+	if ((upgrade_read(from, gags, up.ngags * sizeof(*gags)) == -1) ||
+	    (upgrade_read(from, pplayer->pbuf, up.pblen) == -1) ||
+	    (upgrade_read(from, out, up.outlen) == -1))
+		err(EX_PROTOCOL, "can't take line %d", up.self.line);
+	out[up.outlen] = '\0';
+
+	pplayer->seclevel = up.seclevel;
+	pplayer->hilite = up.hilite;
+	pplayer->privs = up.privs;
+	pplayer->wrap = up.wrap;
+	pplayer->flags = up.flags;
+	pplayer->pagelen = up.pagelen;
+	pplayer->spamming = up.spamming;
+	pplayer->port = up.port;
+	pplayer->pblen = up.pblen;
+	pplayer->cameon = up.cameon;
+	pplayer->playerwhen = up.playerwhen;
+	pplayer->idle = up.idle;
+	strlcpy(pplayer->name, up.name, sizeof(pplayer->name));
+	strlcpy(pplayer->onfrom, up.onfrom, sizeof(pplayer->onfrom));
+	strlcpy(pplayer->host, up.host, sizeof(pplayer->host));
+	strlcpy(pplayer->numhost, up.numhost, sizeof(pplayer->numhost));
+	strlcpy(pplayer->password, up.password, sizeof(pplayer->password));
+	pplayer->chnl = ((up.channel >= 0) && (up.channel < st->nchannels)) ?
+	    st->channels[up.channel] :
+	    channel_getmain();
+	pplayer->gen = up.self.gen;
+
+	fd = upgrade_place(fd, up.self.line, st->top);
+	pplayer->h = servsock_inherit(fd, false, false);
+	if (!pplayer->h)
+		err(EX_OSERR, "can't take line %d", up.self.line);
+
+	line = player_restore(pplayer);
+	if (line == -1)
+		err(EX_OSERR, "can't take line %d", up.self.line);
+	if (line != up.self.line) {
+		snprintf(sendbuf, sendbufsz, "line %d is now line %d",
+		    up.self.line, line);
+		logmsg(sendbuf);
+	}
+	if (up.outlen)
+		(void)outtosock_ssl(pplayer->h, out);
+	free(out);
+
+	st->taken[st->nplayers++] = (struct upgrade_taken) {
+		.pplayer = pplayer,
+		.old = up.self,
+		.dotspeeddial = up.dotspeeddial,
+		.gags = gags,
+		.ngags = up.ngags,
+	};
+}
+
+/* whoever had the handle in the old server */
+static struct splayer *
+upgrade_deref(struct upgrade_state *st, struct upgrade_handle uh)
+{
+	int i;
+
+	for (i = 0; i < st->nplayers; i++)
+		if ((st->taken[i].old.line == uh.line) &&
+		    (st->taken[i].old.gen == uh.gen))
+			return st->taken[i].pplayer;
+	return NULL;
+}
+
+/* Gags and the last person .p'd to are handles, which may have to refer to
+ * another line now.
+ */
+static void
+upgrade_regag(struct upgrade_state *st)
+{
+	struct upgrade_taken *tp;
+	struct splayer *target;
+	uint32_t i;
+	int n;
+
+	for (n = 0; n < st->nplayers; n++) {
+		tp = &st->taken[n];
+		for (i = 0; i < tp->ngags; i++) {
+			target = upgrade_deref(st, tp->gags[i]);
+			if (target && (player_gag(tp->pplayer, target) == -1))
+				logerror("can't put back a gag", errno);
+		}
+		tp->pplayer->dotspeeddial = player_handle(
+		    upgrade_deref(st, tp->dotspeeddial));
+		free(tp->gags);
+	}
+}
+
+/* The new server, once it can serve: takes the players, and starts serving
+ * when the old server has exited.
+ */
+void
+upgrade_resume(void)
+{
+	struct upgrade_state st = { 0 };
+	struct upgrade_rec rec;
+	int32_t top;
+	char c = UPGRADE_READY;
+	ssize_t n;
+	int fd;
+
+	if (from == -1)
+		return;
+
+	if (upgrade_write(from, &c, 1) == -1)
+		err(EX_PROTOCOL, "can't talk to the old server");
+
+	st.top = -1;
+	for (;;) {
+		if (upgrade_recv(from, &rec, &fd) == -1)
+			err(EX_PROTOCOL, "lost the old server");
+		if ((fd != -1) && (rec.type != UPGRADE_PLAYER))
+			errx(EX_PROTOCOL, "unexpected fd");
+
+		switch (rec.type) {
+		case UPGRADE_LINES:
+			if (rec.len != sizeof(top))
+				errx(EX_PROTOCOL, "bad lines record");
+			if (upgrade_read(from, &top, sizeof(top)) == -1)
+				err(EX_PROTOCOL, "can't take the lines");
+			st.top = top;
+			continue;
+		case UPGRADE_CHANNEL:
+			upgrade_takechannel(&st, &rec);
+			continue;
+		case UPGRADE_PLAYER:
+			upgrade_takeplayer(&st, &rec, fd);
+			continue;
+		case UPGRADE_END:
+			break;
+		default:
+			errx(EX_PROTOCOL, "unknown record %u", rec.type);
+		}
+		break;
+	}
+	upgrade_regag(&st);
+
+	c = UPGRADE_DONE;
+	if (upgrade_write(from, &c, 1) == -1)
+		err(EX_PROTOCOL, "can't talk to the old server");
+
+	/* its end closes when it exits */
+	while ((n = read(from, &c, 1)) != 0)
+		if ((n == -1) && (errno != EINTR))
+			break;
+	(void)close(from);
+	from = -1;
+
+	snprintf(sendbuf, sendbufsz,
+	    "upgraded: took %d players and %d channels from the old server",
+	    st.nplayers, st.nchannels);
+	logmsg(sendbuf);
+	sendall(">> The server has been upgraded.\r\n", ALL, 0);
+
+	free(st.channels);
+	free(st.taken);
+}
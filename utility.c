@@ -33,6 +33,7 @@
 
 #include "log.h"
 #include "platform.h"
+#include "timer.h"
 #include "utility.h"
 
 char *hi_types[] = { "None", "Bold", "Underline", "Blink", "Reverse", "ERROR!",
@@ -257,7 +258,7 @@ timelet(time_t idle, long precision)
 	time_t tmptime;
 	int wks, days, hrs, mins, secs;
 
-	(void)time(&tmptime);
+	tmptime = timer_now();
 	timenoc = tmptime - idle;
 	secs = timenoc;
 	mins = secs / 60;